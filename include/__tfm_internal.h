@@ -28,8 +28,15 @@ struct tfm
     int (*get)(struct trace *t);
     void (*free)(struct trace *t);
 
+    // optional, get num traces with consecutive indices at once. on
+    // failure, members already filled in are released through free
+    int (*get_many)(struct trace **t, size_t num);
+
     bool tfm_managed_cache;
     void *data;
+
+    // hash of the parameters from tfm_describe, or 0
+    uint64_t key;
 };
 
 int copy_title(struct trace *to, struct trace *from);
@@ -38,6 +45,7 @@ int copy_samples(struct trace *to, struct trace *from);
 
 int passthrough(struct trace *trace);
 void passthrough_free(struct trace *t);
+void passthrough_release(struct trace *t);
 
 stat_t __summary_to_cability(summary_t s);
 
@@ -46,6 +54,10 @@ struct cpa_args
     int (*power_model)(uint8_t *, int, float *);
     int num_models;
 
+    // compute every output in one pass over the input, when the first is
+    // asked for, rather than one pass per output
+    bool shared_scan;
+
     int (*consumer_init)(struct trace_set *, void *);
     int (*consumer_exit)(struct trace_set *, void *);
     void (*progress_title)(char *, int, size_t, int);
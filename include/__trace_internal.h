@@ -7,7 +7,10 @@
 #include <stdbool.h>
 #include <string.h>
 
+#include "trace.h"
+
 struct trace_cache;
+struct trace_pool;
 struct trace_set;
 struct trace;
 
@@ -32,6 +35,11 @@ struct trace_set
 
     struct backend_intf *backend;
     struct trace_cache *cache;
+    struct trace_pool *pool;
+
+    // identifies this set's contents across runs, or 0 if unknown
+    uint64_t key;
+    struct trace_memo *memo;
 
     // for transformations
     struct trace_set *prev;
@@ -69,8 +77,26 @@ static log_level_t libtrace_log_level = WARN;
 #define TRACE_IDX(t)  (t)->index
 
 /* Trace interface */
+#define REQ_TITLE       (1 << 0)
+#define REQ_DATA        (1 << 1)
+#define REQ_SAMPLES     (1 << 2)
+#define REQ_ALL         (REQ_TITLE | REQ_DATA | REQ_SAMPLES)
+
+// which fields (and which samples) a consumer actually needs
+struct trace_request
+{
+    int fields;
+    size_t first_sample, num_samples;
+};
+
 int trace_free_memory(struct trace *t);
 int trace_copy(struct trace **res, struct trace *prev);
+int trace_get_request(struct trace_set *ts, struct trace *t, size_t index,
+                      struct trace_request *req);
+
+// the same for num traces with consecutive indices, filling in t[0] to t[num - 1]
+int trace_get_request_many(struct trace_set *ts, struct trace *t, size_t first, size_t num,
+                           struct trace_request *req);
 
 /* Backend interface */
 struct backend_intf
@@ -81,17 +107,69 @@ struct backend_intf
 
     int (*read)(struct trace *);
     int (*write)(struct trace *);
+
+    // optional, read only the requested fields and samples
+    int (*read_request)(struct trace *, struct trace_request *);
+
+    // optional, read the requested fields of num traces with consecutive indices at once
+    int (*read_batch)(struct trace **, size_t num, struct trace_request *);
+
+    // optional, write num traces with consecutive indices at once
+    int (*write_batch)(struct trace **, size_t num);
     void *arg;
 };
 
 int create_backend(struct trace_set *ts, const char *name);
 
+// without demand, the access doesn't drive the cache prefetcher
+int __trace_get(struct trace_set *ts, struct trace **t, size_t index, bool demand);
+
+/* Memoization */
+uint64_t tm_key(uint64_t seed, const void *buf, size_t len);
+uint64_t tm_source_key(const char *name);
+void tm_free(struct trace_set *ts);
+
+// tm_read returns 1 if the trace was restored from an earlier run
+int tm_read(struct trace_set *ts, struct trace *t);
+int tm_write(struct trace_set *ts, struct trace *t);
+
 /* Cache interface */
 size_t __find_num_traces(struct trace_set *ts, size_t size_bytes, int assoc);
-int tc_cache_manual(struct trace_cache **cache, size_t id, size_t nsets, size_t nways);
-int tc_lookup(struct trace_cache *cache, size_t index, struct trace **trace, bool keep_lock);
-int tc_store(struct trace_cache *cache, size_t index, struct trace *trace, bool keep_lock);
+int tc_cache_manual(struct trace_cache **cache, size_t id, size_t nsets, size_t nways,
+                    cache_policy_t policy, bool hashed);
+
+// with reserve, a miss may return 1: the caller then owns an in-flight
+// placeholder for index, and must either tc_store or tc_cancel it
+int tc_lookup(struct trace_cache *cache, size_t index, struct trace **trace, bool reserve);
+int tc_store(struct trace_cache *cache, size_t index, struct trace *trace);
+int tc_cancel(struct trace_cache *cache, size_t index);
+
+// fill a placeholder's trace from the spill file, returns 1 if it was there
+int tc_unspill(struct trace_cache *cache, struct trace *t);
+
+// note a consumer wants index, so the prefetcher can run ahead of it
+void tc_demand(struct trace_cache *cache, size_t index);
+void tc_stop_prefetch(struct trace_cache *cache);
 int tc_deref(struct trace_cache *cache, size_t index, struct trace *trace);
 int tc_free(struct trace_cache *cache);
 
+/* Buffer pool interface */
+typedef enum
+{
+    POOL_TRACE = 0,
+    POOL_TITLE,
+    POOL_DATA,
+    POOL_SAMPLES,
+    NUM_POOL_CLASSES
+} pool_class_t;
+
+// buffers of exactly a class size are recycled through the set's pool,
+// anything else (or a set without a pool) falls back to calloc/free.
+// recycled buffers are not zeroed, so callers must fill them completely
+int tp_create(struct trace_set *ts);
+void tp_free(struct trace_set *ts);
+void *tp_alloc(struct trace_set *ts, pool_class_t cls, size_t size);
+void tp_release(struct trace_set *ts, pool_class_t cls, void *buf, size_t size);
+void tp_release_trace(struct trace_set *ts, struct trace *t);
+
 #endif //LIBTRS___TRACE_INTERNAL_H
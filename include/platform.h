@@ -1,6 +1,8 @@
 #ifndef LIBTRS_PLATFORM_H
 #define LIBTRS_PLATFORM_H
 
+#include <stdint.h>
+
 #if defined(__linux__)
 
 #include <pthread.h>
@@ -92,15 +94,27 @@ int p_socket_write(LT_SOCK_TYPE s, void *buf, int len);
 int p_safesocket_read(LT_SOCK_TYPE s, void *buf, int len);
 int p_safesocket_write(LT_SOCK_TYPE s, void *buf, int len);
 
+/* File mapping */
+int p_file_map(LT_FILE_TYPE *file, void **res, size_t *len);
+int p_file_unmap(void *map, size_t len);
+int p_pread(LT_FILE_TYPE *file, void *buf, size_t len, size_t offs);
+int p_pwrite(LT_FILE_TYPE *file, void *buf, size_t len, size_t offs);
+int p_file_identity(const char *path, uint64_t *size, uint64_t *mtime);
+
 /* Locking and threading */
 
 int p_sem_create(LT_SEM_TYPE *res, int value);
 int p_sem_destroy(LT_SEM_TYPE *sem);
 int __p_sem_wait(LT_SEM_TYPE *sem);
+int p_sem_trywait(LT_SEM_TYPE *sem);
 int __p_sem_post(LT_SEM_TYPE *sem);
 
 int p_thread_create(LT_THREAD_TYPE *handle, void *func, void *arg);
 int p_thread_join(LT_THREAD_TYPE handle);
+void *p_thread_scratch(size_t len);
+
+/* Monotonic clock, in nanoseconds from an arbitrary start */
+uint64_t p_time_ns();
 
 #define sem_acquire(sem)                                                        \
     { int sem_ret = __p_sem_wait((sem)); if(sem_ret < 0) {                        \
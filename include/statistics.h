@@ -42,6 +42,10 @@ int stat_accumulate_dual_array_many(struct accumulator *, float *, float *, int,
 int stat_create_pattern_match(struct accumulator **, float *, int, int);
 int stat_pattern_match(struct accumulator *, float *, int, float **);
 
+// fold everything accumulated into src into dst, which must be of the same
+// type, dimensions and capabilities. src is left as it was
+int stat_merge_accumulator(struct accumulator *dst, struct accumulator *src);
+
 int stat_reset_accumulator(struct accumulator *);
 int stat_free_accumulator(struct accumulator *);
 int stat_get(struct accumulator *, stat_t, int, float *);
@@ -22,10 +22,6 @@ struct trace
     float *samples;
 };
 
-// configuration
-
-#define COHESIVE_CACHES     1
-
 /* trace set operations */
 
 /**
@@ -106,6 +102,145 @@ int ts_export_join(struct export *export);
  */
 int ts_create_cache(struct trace_set *ts, size_t size_bytes, size_t assoc);
 
+typedef enum
+{
+    CACHE_LRU = 0,
+    CACHE_CLOCK,
+    CACHE_2Q,
+    NUM_CACHE_POLICIES
+} cache_policy_t;
+
+/**
+ * Create a trace cache with an explicit replacement policy. LRU evicts
+ * the least recently used trace; CLOCK approximates it with a single
+ * reference bit per trace; 2Q keeps traces which were hit at least once
+ * in a protected segment, so that one pass over a large trace set does
+ * not evict the traces which are reused.
+ *
+ * @param ts The trace set which to create a cache for
+ * @param size_bytes The maximum size (in bytes) of the cache
+ * @param assoc The number of traces per cache set
+ * @param policy The replacement policy used within each cache set
+ * @param hashed Whether to hash trace indices before selecting a set
+ * @return 0 on success, or a (negative) standard errno error code on failure
+ */
+int ts_create_cache_policy(struct trace_set *ts, size_t size_bytes, size_t assoc,
+                           cache_policy_t policy, bool hashed);
+
+/**
+ * Set the size of the memory budget shared by all caches created with
+ * ts_create_cache_shared. Every cache charges the real size of the
+ * traces it holds against its budget. Whenever it is exceeded, traces
+ * are evicted from the cache whose hits currently save the least time
+ * per byte held, so capacity moves towards stages that are expensive to
+ * recompute and actually reused. Can be called again to change the limit.
+ *
+ * @param size_bytes The maximum size (in bytes) of all shared caches
+ * @return 0 on success, or a (negative) standard errno error code on failure
+ */
+int ts_set_cache_budget(size_t size_bytes);
+
+/**
+ * Create a trace cache which draws from the global budget set with
+ * ts_set_cache_budget, rather than a budget of its own.
+ *
+ * @param ts The trace set which to create a cache for
+ * @param assoc The number of traces per cache set
+ * @param policy The replacement policy used within each cache set
+ * @param hashed Whether to hash trace indices before selecting a set
+ * @return 0 on success, or a (negative) standard errno error code on failure
+ */
+int ts_create_cache_shared(struct trace_set *ts, size_t assoc,
+                           cache_policy_t policy, bool hashed);
+
+/**
+ * Add a second, on-disk tier to the trace set's cache. Traces evicted
+ * from memory are written (uncompressed) to a scratch file at the given
+ * path, and later misses are read back from it instead of being produced
+ * again. Worthwhile for sets which are expensive to compute, such as
+ * extracted or aligned traces. The file is deleted when the cache is.
+ *
+ * @param ts The trace set, which must already have a cache
+ * @param path Where to create the scratch file
+ * @param size_bytes The maximum size (in bytes) of the scratch file
+ * @return 0 on success, or a (negative) standard errno error code on failure
+ */
+int ts_cache_spill(struct trace_set *ts, const char *path, size_t size_bytes);
+
+#define CACHE_OCCUPANCY_BUCKETS     9
+
+struct cache_stats
+{
+    size_t nsets, nways;
+
+    size_t accesses, hits, misses;
+    size_t waits;                   // hits on traces still being produced
+    size_t stores, evictions;
+    size_t traces_held, bytes_held;
+
+    // time spent producing missed traces, and blocked on contended locks
+    size_t fills, lock_waits;
+    uint64_t fill_ns, lock_wait_ns;
+
+    // number of sets from empty (first bucket) to full (last bucket)
+    size_t occupancy[CACHE_OCCUPANCY_BUCKETS];
+
+    size_t spill_hits, spill_misses, spill_writes;
+    size_t prefetched;
+};
+
+/**
+ * Get a snapshot of the statistics of a trace set's cache. Counters are
+ * cumulative since the cache was created.
+ *
+ * @param ts The trace set
+ * @param stats Where to store the statistics
+ * @return 0 on success, -ENOENT if the set has no cache, or another
+ * (negative) standard errno error code on failure
+ */
+int ts_cache_stats(struct trace_set *ts, struct cache_stats *stats);
+
+/**
+ * Format a snapshot of the statistics of a trace set's cache as a single
+ * line of JSON (without newline), tagged with the set's ID and the time.
+ *
+ * @param ts The trace set
+ * @param buf Where to write the line
+ * @param len The size of buf
+ * @return 0 on success, -ENOENT if the set has no cache, or another
+ * (negative) standard errno error code on failure
+ */
+int ts_cache_stats_json(struct trace_set *ts, char *buf, size_t len);
+
+/**
+ * Start a thread which keeps the trace set's cache filled ahead of its
+ * consumers: whenever trace_get asks for an index, the following depth
+ * indices are produced in the background, so that reading and upstream
+ * transformations overlap with whatever consumes this set. Best with a
+ * mostly sequential access pattern, such as a render.
+ *
+ * @param ts The trace set, which must already have a cache and a known size
+ * @param depth How many traces to stay ahead of the furthest request
+ * @return 0 on success, or a (negative) standard errno error code on failure
+ */
+int ts_cache_prefetch(struct trace_set *ts, size_t depth);
+
+/**
+ * Keep every trace this set produces in a file under the given directory,
+ * named by the set's key: a hash of the source file's name, size and
+ * modification time, and the parameters of every transformation in
+ * between (see tfm_describe). A later run with the same key gets traces
+ * from that file instead of producing them again, so only stages after
+ * a changed one are recomputed. Files read by a transformation itself
+ * (e.g. append) are only keyed by their path, and transformations with
+ * side effects (e.g. save) shouldn't be memoized, as they are skipped.
+ *
+ * @param ts The trace set, which must have a key and a known size
+ * @param dir The directory to keep memo files in
+ * @return 0 on success, or a (negative) standard errno error code on failure
+ */
+int ts_memoize(struct trace_set *ts, const char *dir);
+
 /**
  * Get the number of traces in a trace set.
  *
@@ -155,6 +290,23 @@ size_t ts_trace_size(struct trace_set *ts);
  */
 int trace_get(struct trace_set *ts, struct trace **t, size_t index);
 
+/**
+ * Get count traces with consecutive indices from a trace set. This is
+ * the same as calling trace_get() for each of them, but traces missing
+ * from the cache are produced together where the transformation or
+ * backend supports it (e.g. a single read for a run of traces in a file),
+ * so per-trace overheads are paid once for the whole run. Each trace must
+ * still be freed with trace_free().
+ *
+ * @param ts The trace set to get traces from.
+ * @param first The index of the first trace.
+ * @param count The number of traces to get.
+ * @param traces Where to place pointers to the traces, with room for count.
+ * @return 0 on success, or a (negative) standard errno error code on
+ * failure, in which case none of the traces are returned.
+ */
+int trace_get_many(struct trace_set *ts, size_t first, size_t count, struct trace **traces);
+
 /**
  * Free a trace, removing all data, samples, and title from memory.
  * @param t The trace to free.
@@ -73,6 +73,18 @@ typedef struct
     double confidence;
 } match_region_t;
 
+/**
+ * Describe a transformation's parameters, in some canonical text form
+ * (such as its line in a config file). Trace sets derived through only
+ * described transformations from files get a key which identifies their
+ * contents across runs, which is what ts_memoize uses.
+ *
+ * @param tfm The transformation
+ * @param params Its parameters, in any stable text form
+ * @return 0 on success, or a (negative) standard errno error code on failure
+ */
+int tfm_describe(struct tfm *tfm, const char *params);
+
 // System
 int tfm_save(struct tfm **tfm, char *path);
 int tfm_synchronize(struct tfm **tfm, int max_distance);
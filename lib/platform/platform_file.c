@@ -0,0 +1,201 @@
+#include "platform.h"
+
+#include "__trace_internal.h"
+
+#if defined(LIBTRACE_PLATFORM_LINUX)
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#elif defined(LIBTRACE_PLATFORM_WINDOWS)
+    #include <io.h>
+#endif
+
+int p_file_map(LT_FILE_TYPE *file, void **res, size_t *len)
+{
+#if defined(LIBTRACE_PLATFORM_LINUX)
+    int fd;
+    void *map;
+    struct stat st;
+
+    fd = fileno(file);
+    if(fstat(fd, &st) < 0)
+    {
+        err("Failed to stat file for mapping: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED)
+    {
+        err("Failed to map file: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    *res = map;
+    *len = st.st_size;
+    return 0;
+#elif defined(LIBTRACE_PLATFORM_WINDOWS)
+    HANDLE handle, mapping;
+    LARGE_INTEGER size;
+    void *map;
+
+    handle = (HANDLE) _get_osfhandle(_fileno(file));
+    if(handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(handle, &size))
+    {
+        err("Failed to get size of file for mapping\n");
+        return -EIO;
+    }
+
+    mapping = CreateFileMapping(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(!mapping)
+    {
+        err("Failed to create file mapping\n");
+        return -EIO;
+    }
+
+    // the view keeps the mapping object alive
+    map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if(!map)
+    {
+        err("Failed to map view of file\n");
+        return -EIO;
+    }
+
+    *res = map;
+    *len = (size_t) size.QuadPart;
+    return 0;
+#endif
+}
+
+int p_file_unmap(void *map, size_t len)
+{
+#if defined(LIBTRACE_PLATFORM_LINUX)
+    return munmap(map, len);
+#elif defined(LIBTRACE_PLATFORM_WINDOWS)
+    return UnmapViewOfFile(map) ? 0 : -1;
+#endif
+}
+
+int p_pread(LT_FILE_TYPE *file, void *buf, size_t len, size_t offs)
+{
+#if defined(LIBTRACE_PLATFORM_LINUX)
+    int fd;
+    ssize_t ret;
+    size_t done = 0;
+
+    fd = fileno(file);
+    while(done < len)
+    {
+        ret = pread(fd, (uint8_t *) buf + done, len - done, (off_t) (offs + done));
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            err("Failed to read from file: %s\n", strerror(errno));
+            return -errno;
+        }
+        else if(ret == 0)
+            return -EIO;
+
+        done += ret;
+    }
+
+    return 0;
+#elif defined(LIBTRACE_PLATFORM_WINDOWS)
+    HANDLE handle;
+    OVERLAPPED ov;
+    DWORD read, chunk;
+    size_t done = 0;
+
+    // note that this moves the OS file pointer, so any stream
+    // reads on the same file must seek first
+    handle = (HANDLE) _get_osfhandle(_fileno(file));
+    while(done < len)
+    {
+        memset(&ov, 0, sizeof(OVERLAPPED));
+        ov.Offset = (DWORD) ((offs + done) & 0xFFFFFFFF);
+        ov.OffsetHigh = (DWORD) ((uint64_t) (offs + done) >> 32);
+
+        chunk = (len - done) > MAXDWORD ? MAXDWORD : (DWORD) (len - done);
+        if(!ReadFile(handle, (uint8_t *) buf + done, chunk, &read, &ov) || read == 0)
+            return -EIO;
+
+        done += read;
+    }
+
+    return 0;
+#endif
+}
+
+int p_pwrite(LT_FILE_TYPE *file, void *buf, size_t len, size_t offs)
+{
+#if defined(LIBTRACE_PLATFORM_LINUX)
+    int fd;
+    ssize_t ret;
+    size_t done = 0;
+
+    fd = fileno(file);
+    while(done < len)
+    {
+        ret = pwrite(fd, (uint8_t *) buf + done, len - done, (off_t) (offs + done));
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            err("Failed to write to file: %s\n", strerror(errno));
+            return -errno;
+        }
+
+        done += ret;
+    }
+
+    return 0;
+#elif defined(LIBTRACE_PLATFORM_WINDOWS)
+    HANDLE handle;
+    OVERLAPPED ov;
+    DWORD written, chunk;
+    size_t done = 0;
+
+    // same caveat as p_pread about the OS file pointer
+    handle = (HANDLE) _get_osfhandle(_fileno(file));
+    while(done < len)
+    {
+        memset(&ov, 0, sizeof(OVERLAPPED));
+        ov.Offset = (DWORD) ((offs + done) & 0xFFFFFFFF);
+        ov.OffsetHigh = (DWORD) ((uint64_t) (offs + done) >> 32);
+
+        chunk = (len - done) > MAXDWORD ? MAXDWORD : (DWORD) (len - done);
+        if(!WriteFile(handle, (uint8_t *) buf + done, chunk, &written, &ov) || written == 0)
+            return -EIO;
+
+        done += written;
+    }
+
+    return 0;
+#endif
+}
+
+int p_file_identity(const char *path, uint64_t *size, uint64_t *mtime)
+{
+#if defined(LIBTRACE_PLATFORM_LINUX)
+    struct stat st;
+
+    if(stat(path, &st) < 0)
+        return -errno;
+
+    *size = (uint64_t) st.st_size;
+    *mtime = (uint64_t) st.st_mtim.tv_sec * 1000000000ULL + (uint64_t) st.st_mtim.tv_nsec;
+    return 0;
+#elif defined(LIBTRACE_PLATFORM_WINDOWS)
+    struct _stat64 st;
+
+    if(_stat64(path, &st) < 0)
+        return -errno;
+
+    *size = (uint64_t) st.st_size;
+    *mtime = (uint64_t) st.st_mtime;
+    return 0;
+#endif
+}
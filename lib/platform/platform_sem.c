@@ -8,7 +8,7 @@ int p_sem_create(LT_SEM_TYPE *res, int value)
     return sem_init(res, 0, value);
 #elif defined(LIBTRACE_PLATFORM_WINDOWS)
     LT_SEM_TYPE sem;
-    sem = CreateSemaphore(NULL, value, 128, NULL);
+    sem = CreateSemaphore(NULL, value, LONG_MAX, NULL);
     if(sem)
     {
         *res = sem;
@@ -37,6 +37,18 @@ int __p_sem_wait(LT_SEM_TYPE *sem)
 #endif
 }
 
+// 0 if the semaphore was taken, without ever blocking
+int p_sem_trywait(LT_SEM_TYPE *sem)
+{
+#if defined(LIBTRACE_PLATFORM_LINUX)
+    return sem_trywait(sem);
+#elif defined(LIBTRACE_PLATFORM_WINDOWS)
+    int res = WaitForSingleObject(*sem, 0);
+    if(res == WAIT_OBJECT_0) return 0;
+    else return -1;
+#endif
+}
+
 int __p_sem_post(LT_SEM_TYPE *sem)
 {
 #if defined(LIBTRACE_PLATFORM_LINUX)
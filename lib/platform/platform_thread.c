@@ -1,5 +1,9 @@
 #include "platform.h"
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
 int p_thread_create(LT_THREAD_TYPE *handle, void *func, void *arg)
 {
 #if defined(LIBTRACE_PLATFORM_LINUX)
@@ -22,4 +26,81 @@ int p_thread_join(LT_THREAD_TYPE handle)
 #elif defined(LIBTRACE_PLATFORM_WINDOWS)
     return WaitForSingleObject(handle, INFINITE);
 #endif
-}
\ No newline at end of file
+}
+
+uint64_t p_time_ns()
+{
+#if defined(LIBTRACE_PLATFORM_LINUX)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+#elif defined(LIBTRACE_PLATFORM_WINDOWS)
+    static LARGE_INTEGER freq = {0};
+    LARGE_INTEGER now;
+
+    if(freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+
+    QueryPerformanceCounter(&now);
+    return (uint64_t) ((double) now.QuadPart * 1e9 / (double) freq.QuadPart);
+#endif
+}
+
+struct thread_scratch
+{
+    size_t len;
+    uint8_t buf[];
+};
+
+#if defined(LIBTRACE_PLATFORM_LINUX)
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void __scratch_key_init()
+{
+    pthread_key_create(&scratch_key, free);
+}
+#elif defined(LIBTRACE_PLATFORM_WINDOWS)
+static DWORD scratch_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE scratch_once = INIT_ONCE_STATIC_INIT;
+
+static VOID WINAPI __scratch_free(PVOID scratch)
+{
+    free(scratch);
+}
+
+static BOOL CALLBACK __scratch_key_init(PINIT_ONCE once, PVOID param, PVOID *ctx)
+{
+    scratch_key = FlsAlloc(__scratch_free);
+    return scratch_key != FLS_OUT_OF_INDEXES;
+}
+#endif
+
+void *p_thread_scratch(size_t len)
+{
+    struct thread_scratch *scratch, *grown;
+
+#if defined(LIBTRACE_PLATFORM_LINUX)
+    pthread_once(&scratch_once, __scratch_key_init);
+    scratch = pthread_getspecific(scratch_key);
+#elif defined(LIBTRACE_PLATFORM_WINDOWS)
+    if(!InitOnceExecuteOnce(&scratch_once, __scratch_key_init, NULL, NULL))
+        return NULL;
+    scratch = FlsGetValue(scratch_key);
+#endif
+
+    if(scratch && scratch->len >= len)
+        return scratch->buf;
+
+    grown = realloc(scratch, sizeof(struct thread_scratch) + len);
+    if(!grown)
+        return NULL;
+
+    grown->len = len;
+#if defined(LIBTRACE_PLATFORM_LINUX)
+    pthread_setspecific(scratch_key, grown);
+#elif defined(LIBTRACE_PLATFORM_WINDOWS)
+    FlsSetValue(scratch_key, grown);
+#endif
+    return grown->buf;
+}
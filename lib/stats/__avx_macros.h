@@ -284,5 +284,59 @@ static const float __gbl_abs_mask = -0.0f;
     avx_storeu_ps(type, minabs_ptr,                     \
         avx_var(type, minabs_name));
 
+// combining two accumulators (Chan et al.), where w is
+// n_src / n and f is n_dst * n_src / n
+
+#define merge_moments(type, delta_name, w_name, f_name, \
+                        m_ptr, s_ptr, \
+                        m_src_ptr, s_src_ptr)           \
+    avx_var(type, delta_name) =                         \
+        avx_sub_ps(type,                                \
+            avx_loadu_ps(type, m_src_ptr),              \
+            avx_loadu_ps(type, m_ptr));                 \
+    avx_storeu_ps(type, s_ptr,                          \
+        avx_add_ps(type,                                \
+            avx_add_ps(type,                            \
+                avx_loadu_ps(type, s_ptr),              \
+                avx_loadu_ps(type, s_src_ptr)),         \
+            avx_mul_ps(type,                            \
+                avx_mul_ps(type,                        \
+                    avx_var(type, delta_name),          \
+                    avx_var(type, delta_name)),         \
+                avx_var(type, f_name))));               \
+    avx_storeu_ps(type, m_ptr,                          \
+        avx_add_ps(type,                                \
+            avx_loadu_ps(type, m_ptr),                  \
+            avx_mul_ps(type,                            \
+                avx_var(type, delta_name),              \
+                avx_var(type, w_name))));
+
+// delta1 is the (already scaled by f) difference of the other mean
+#define merge_cov(type, delta1_name, \
+                    cov_ptr, cov_src_ptr, \
+                    m0_ptr, m0_src_ptr)                 \
+    avx_storeu_ps(type, cov_ptr,                        \
+        avx_add_ps(type,                                \
+            avx_add_ps(type,                            \
+                avx_loadu_ps(type, cov_ptr),            \
+                avx_loadu_ps(type, cov_src_ptr)),       \
+            avx_mul_ps(type,                            \
+                avx_sub_ps(type,                        \
+                    avx_loadu_ps(type, m0_src_ptr),     \
+                    avx_loadu_ps(type, m0_ptr)),        \
+                avx_var(type, delta1_name))));
+
+#define merge_max(type, dst_ptr, src_ptr)               \
+    avx_storeu_ps(type, dst_ptr,                        \
+        avx_max_ps(type,                                \
+            avx_loadu_ps(type, dst_ptr),                \
+            avx_loadu_ps(type, src_ptr)));
+
+#define merge_min(type, dst_ptr, src_ptr)               \
+    avx_storeu_ps(type, dst_ptr,                        \
+        avx_min_ps(type,                                \
+            avx_loadu_ps(type, dst_ptr),                \
+            avx_loadu_ps(type, src_ptr)));
+
 
 #endif //LIBTRS___AVX_MACROS_H
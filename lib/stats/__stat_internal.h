@@ -43,6 +43,7 @@ struct accumulator
     int (*free)(struct accumulator *);
     int (*get)(struct accumulator *, stat_t, int, float *);
     int (*get_all)(struct accumulator *, stat_t, float **);
+    int (*merge)(struct accumulator *, struct accumulator *);
 
 #if USE_GPU
     void *gpu_vars;
@@ -55,6 +56,7 @@ struct accumulator
     extern "C" int gpu_free_dual_array(struct accumulator *);
     extern "C" int gpu_accumulate_dual_array(struct accumulator *, float *, float *, int, int);
     extern "C" int gpu_sync_dual_array(struct accumulator *);
+    extern "C" int gpu_load_dual_array(struct accumulator *);
 
     extern "C" int gpu_pattern_preprocess(float *pattern, int pattern_len, float **out, float *var);
     extern "C" int gpu_pattern_free(float *pattern);
@@ -64,6 +66,7 @@ struct accumulator
     int gpu_free_dual_array(struct accumulator *);
     int gpu_accumulate_dual_array(struct accumulator *, float *, float *, int, int);
     int gpu_sync_dual_array(struct accumulator *);
+    int gpu_load_dual_array(struct accumulator *);
 
     int gpu_pattern_preprocess(float *, int, float **, float *);
     int gpu_pattern_free(float *);
@@ -5,6 +5,7 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 int __stat_reset_dual(struct accumulator *acc)
@@ -139,6 +140,52 @@ int __stat_get_all_dual(struct accumulator *acc, stat_t stat, float **res)
     return 0;
 }
 
+int __stat_merge_dual(struct accumulator *dst, struct accumulator *src)
+{
+    int i;
+    float n, f, delta[2];
+
+    if(dst->count == 0)
+    {
+        dst->count = src->count;
+        IF_CAP(dst, _AVG) memcpy(dst->_AVG.a, src->_AVG.a, 2 * sizeof(float));
+        IF_CAP(dst, _DEV) memcpy(dst->_DEV.a, src->_DEV.a, 2 * sizeof(float));
+        IF_CAP(dst, _COV) dst->_COV.f = src->_COV.f;
+        IF_CAP(dst, _MAX) memcpy(dst->_MAX.a, src->_MAX.a, 2 * sizeof(float));
+        IF_CAP(dst, _MIN) memcpy(dst->_MIN.a, src->_MIN.a, 2 * sizeof(float));
+        IF_CAP(dst, _MAXABS) memcpy(dst->_MAXABS.a, src->_MAXABS.a, 2 * sizeof(float));
+        IF_CAP(dst, _MINABS) memcpy(dst->_MINABS.a, src->_MINABS.a, 2 * sizeof(float));
+        return 0;
+    }
+
+    n = dst->count + src->count;
+    f = dst->count * src->count / n;
+
+    IF_CAP(dst, _AVG)
+    {
+        for(i = 0; i < 2; i++)
+        {
+            delta[i] = src->_AVG.a[i] - dst->_AVG.a[i];
+            dst->_DEV.a[i] += src->_DEV.a[i] + delta[i] * delta[i] * f;
+            dst->_AVG.a[i] += delta[i] * src->count / n;
+        }
+
+        IF_CAP(dst, _COV)
+        { dst->_COV.f += src->_COV.f + delta[0] * delta[1] * f; }
+    }
+
+    for(i = 0; i < 2; i++)
+    {
+        IF_CAP(dst, _MAX) dst->_MAX.a[i] = fmaxf(dst->_MAX.a[i], src->_MAX.a[i]);
+        IF_CAP(dst, _MIN) dst->_MIN.a[i] = fminf(dst->_MIN.a[i], src->_MIN.a[i]);
+        IF_CAP(dst, _MAXABS) dst->_MAXABS.a[i] = fmaxf(dst->_MAXABS.a[i], src->_MAXABS.a[i]);
+        IF_CAP(dst, _MINABS) dst->_MINABS.a[i] = fminf(dst->_MINABS.a[i], src->_MINABS.a[i]);
+    }
+
+    dst->count = n;
+    return 0;
+}
+
 int stat_create_dual(struct accumulator **acc, stat_t capabilities)
 {
     struct accumulator *res;
@@ -171,6 +218,7 @@ int stat_create_dual(struct accumulator **acc, stat_t capabilities)
     res->free = __stat_free_dual;
     res->get = __stat_get_dual;
     res->get_all = __stat_get_all_dual;
+    res->merge = __stat_merge_dual;
 
     *acc = res;
     return 0;
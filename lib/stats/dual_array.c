@@ -168,7 +168,7 @@ int __stat_get_dual_array(struct accumulator *acc, stat_t stat, int index, float
 int __stat_get_all_dual_array(struct accumulator *acc, stat_t stat, float **res)
 {
     int i, j, len;
-    float *result, *temp,
+    float *result, *temp = NULL,
             *source, *source_dev,
             count, dev;
 
@@ -404,6 +404,157 @@ int __stat_get_all_dual_array(struct accumulator *acc, stat_t stat, float **res)
     return 0;
 }
 
+/*
+ * Chan et al.'s pairwise update: with n = na + nb and d the difference
+ * of the means, the mean moves by d * nb / n, and the sums of squares
+ * and co-moments pick up an extra d * d' * na * nb / n. Co-moments need
+ * the old means of both sides, so they go first.
+ */
+int __stat_merge_dual_array(struct accumulator *dst, struct accumulator *src)
+{
+    int i, j, len0, len1;
+    float n, w, f, delta;
+
+    IF_HAVE_512(__m512 w_512, f_512, delta_512, delta1_512);
+    IF_HAVE_256(__m256 w_256, f_256, delta_256, delta1_256);
+    IF_HAVE_128(__m128 w_, f_, delta_, delta1_);
+
+#if USE_GPU
+    int ret = gpu_sync_dual_array(dst);
+    if(ret >= 0)
+        ret = gpu_sync_dual_array(src);
+
+    if(ret < 0)
+    {
+        err("Failed to sync values from GPU\n");
+        return ret;
+    }
+#endif
+
+    // indexed the way __accumulate_dual_array stores things
+    len0 = dst->transpose ? dst->dim1 : dst->dim0;
+    len1 = dst->transpose ? dst->dim0 : dst->dim1;
+
+    if(dst->count == 0)
+    {
+        dst->count = src->count;
+        IF_CAP(dst, _AVG) memcpy(dst->_AVG.a, src->_AVG.a, (len0 + len1) * sizeof(float));
+        IF_CAP(dst, _DEV) memcpy(dst->_DEV.a, src->_DEV.a, (len0 + len1) * sizeof(float));
+        IF_CAP(dst, _COV) memcpy(dst->_COV.a, src->_COV.a, len0 * len1 * sizeof(float));
+        IF_CAP(dst, _MAX) memcpy(dst->_MAX.a, src->_MAX.a, (len0 + len1) * sizeof(float));
+        IF_CAP(dst, _MIN) memcpy(dst->_MIN.a, src->_MIN.a, (len0 + len1) * sizeof(float));
+        IF_CAP(dst, _MAXABS) memcpy(dst->_MAXABS.a, src->_MAXABS.a, (len0 + len1) * sizeof(float));
+        IF_CAP(dst, _MINABS) memcpy(dst->_MINABS.a, src->_MINABS.a, (len0 + len1) * sizeof(float));
+        goto __done;
+    }
+
+    n = dst->count + src->count;
+    w = src->count / n;
+    f = dst->count * w;
+
+    IF_HAVE_128(w_ = _mm_broadcast_ss(&w); f_ = _mm_broadcast_ss(&f));
+    IF_HAVE_256(w_256 = _mm256_broadcast_ss(&w); f_256 = _mm256_broadcast_ss(&f));
+    IF_HAVE_512(w_512 = _mm512_broadcastss_ps(w_); f_512 = _mm512_broadcastss_ps(f_));
+
+    // needs the old means, so goes first
+    IF_CAP(dst, _COV)
+    {
+        for(j = 0; j < len1; j++)
+        {
+            delta = (src->_AVG.a[len0 + j] - dst->_AVG.a[len0 + j]) * f;
+            IF_HAVE_128(delta1_ = _mm_broadcast_ss(&delta));
+            IF_HAVE_256(delta1_256 = _mm256_broadcast_ss(&delta));
+            IF_HAVE_512(delta1_512 = _mm512_broadcastss_ps(delta1_));
+
+            for(i = 0; i < len0;)
+            {
+                LOOP_HAVE_512(i, len0,
+                              merge_cov(AVX512, delta1,
+                                        &dst->_COV.a[len0 * j + i], &src->_COV.a[len0 * j + i],
+                                        &dst->_AVG.a[i], &src->_AVG.a[i]);
+                );
+
+                LOOP_HAVE_256(i, len0,
+                              merge_cov(AVX256, delta1,
+                                        &dst->_COV.a[len0 * j + i], &src->_COV.a[len0 * j + i],
+                                        &dst->_AVG.a[i], &src->_AVG.a[i]);
+                );
+
+                LOOP_HAVE_128(i, len0,
+                              merge_cov(AVX128, delta1,
+                                        &dst->_COV.a[len0 * j + i], &src->_COV.a[len0 * j + i],
+                                        &dst->_AVG.a[i], &src->_AVG.a[i]);
+                );
+
+                dst->_COV.a[len0 * j + i] += src->_COV.a[len0 * j + i] +
+                                             (src->_AVG.a[i] - dst->_AVG.a[i]) * delta;
+                i++;
+            }
+        }
+    }
+
+    for(i = 0; i < len0 + len1;)
+    {
+        LOOP_HAVE_512(i, len0 + len1,
+                      IF_CAP(dst, _AVG) {
+                          merge_moments(AVX512, delta, w, f,
+                                        &dst->_AVG.a[i], &dst->_DEV.a[i],
+                                        &src->_AVG.a[i], &src->_DEV.a[i]);
+                      }
+                      IF_CAP(dst, _MAX) { merge_max(AVX512, &dst->_MAX.a[i], &src->_MAX.a[i]); }
+                      IF_CAP(dst, _MIN) { merge_min(AVX512, &dst->_MIN.a[i], &src->_MIN.a[i]); }
+                      IF_CAP(dst, _MAXABS) { merge_max(AVX512, &dst->_MAXABS.a[i], &src->_MAXABS.a[i]); }
+                      IF_CAP(dst, _MINABS) { merge_min(AVX512, &dst->_MINABS.a[i], &src->_MINABS.a[i]); }
+        );
+
+        LOOP_HAVE_256(i, len0 + len1,
+                      IF_CAP(dst, _AVG) {
+                          merge_moments(AVX256, delta, w, f,
+                                        &dst->_AVG.a[i], &dst->_DEV.a[i],
+                                        &src->_AVG.a[i], &src->_DEV.a[i]);
+                      }
+                      IF_CAP(dst, _MAX) { merge_max(AVX256, &dst->_MAX.a[i], &src->_MAX.a[i]); }
+                      IF_CAP(dst, _MIN) { merge_min(AVX256, &dst->_MIN.a[i], &src->_MIN.a[i]); }
+                      IF_CAP(dst, _MAXABS) { merge_max(AVX256, &dst->_MAXABS.a[i], &src->_MAXABS.a[i]); }
+                      IF_CAP(dst, _MINABS) { merge_min(AVX256, &dst->_MINABS.a[i], &src->_MINABS.a[i]); }
+        );
+
+        LOOP_HAVE_128(i, len0 + len1,
+                      IF_CAP(dst, _AVG) {
+                          merge_moments(AVX128, delta, w, f,
+                                        &dst->_AVG.a[i], &dst->_DEV.a[i],
+                                        &src->_AVG.a[i], &src->_DEV.a[i]);
+                      }
+                      IF_CAP(dst, _MAX) { merge_max(AVX128, &dst->_MAX.a[i], &src->_MAX.a[i]); }
+                      IF_CAP(dst, _MIN) { merge_min(AVX128, &dst->_MIN.a[i], &src->_MIN.a[i]); }
+                      IF_CAP(dst, _MAXABS) { merge_max(AVX128, &dst->_MAXABS.a[i], &src->_MAXABS.a[i]); }
+                      IF_CAP(dst, _MINABS) { merge_min(AVX128, &dst->_MINABS.a[i], &src->_MINABS.a[i]); }
+        );
+
+        IF_CAP(dst, _AVG)
+        {
+            delta = src->_AVG.a[i] - dst->_AVG.a[i];
+            dst->_DEV.a[i] += src->_DEV.a[i] + delta * delta * f;
+            dst->_AVG.a[i] += delta * w;
+        }
+
+        IF_CAP(dst, _MAX) dst->_MAX.a[i] = fmaxf(dst->_MAX.a[i], src->_MAX.a[i]);
+        IF_CAP(dst, _MIN) dst->_MIN.a[i] = fminf(dst->_MIN.a[i], src->_MIN.a[i]);
+        IF_CAP(dst, _MAXABS) dst->_MAXABS.a[i] = fmaxf(dst->_MAXABS.a[i], src->_MAXABS.a[i]);
+        IF_CAP(dst, _MINABS) dst->_MINABS.a[i] = fminf(dst->_MINABS.a[i], src->_MINABS.a[i]);
+        i++;
+    }
+
+    dst->count = n;
+__done:
+#if USE_GPU
+    // further accumulation into dst happens on the GPU
+    return gpu_load_dual_array(dst);
+#else
+    return 0;
+#endif
+}
+
 int stat_create_dual_array(struct accumulator **acc, stat_t capabilities, int num0, int num1)
 {
     struct accumulator *res;
@@ -448,6 +599,7 @@ int stat_create_dual_array(struct accumulator **acc, stat_t capabilities, int nu
     res->free = __stat_free_dual_array;
     res->get = __stat_get_dual_array;
     res->get_all = __stat_get_all_dual_array;
+    res->merge = __stat_merge_dual_array;
 
 #if USE_GPU
     int ret;
@@ -498,8 +650,8 @@ int __accumulate_dual_array(struct accumulator *acc,
 #if USE_GPU
     return gpu_accumulate_dual_array(acc, val0, val1, len0, len1);
 #else
-    int  j, k;
-    float m0_new_scalar, m1_new_scalar;
+    int i, j, k;
+    float m0_new_scalar, m1_new_scalar, m1_old_scalar;
 
     IF_HAVE_512(__m512 curr0_512, curr1_512, count_512,
                 m0_512, m0_new_512, s0_512, s0_new_512,
@@ -558,15 +710,15 @@ int __accumulate_dual_array(struct accumulator *acc,
 
         for(i = 0; i < len1;)
         {
-            LOOP_HAVE_512(i, len0,
+            LOOP_HAVE_512(i, len1,
                           IF_CAP(acc, _MAXABS) { init_abs(AVX512, &acc->_MAXABS.a[len0 + i], &val1[i]); }
                                   IF_CAP(acc, _MINABS) { init_abs(AVX512, &acc->_MINABS.a[len0 + i], &val1[i]); });
 
-            LOOP_HAVE_256(i, len0,
+            LOOP_HAVE_256(i, len1,
                           IF_CAP(acc, _MAXABS) { init_abs(AVX256, &acc->_MAXABS.a[len0 + i], &val1[i]); }
                                   IF_CAP(acc, _MINABS) { init_abs(AVX256, &acc->_MINABS.a[len0 + i], &val1[i]); });
 
-            LOOP_HAVE_128(i, len0,
+            LOOP_HAVE_128(i, len1,
                           IF_CAP(acc, _MAXABS) { init_abs(AVX128, &acc->_MAXABS.a[len0 + i], &val1[i]) }
                                   IF_CAP(acc, _MINABS) { init_abs(AVX128, &acc->_MINABS.a[len0 + i], &val1[i]) });
 
@@ -596,7 +748,7 @@ int __accumulate_dual_array(struct accumulator *acc,
                           }
                                   IF_CAP(acc, _MIN) {
                               accumulate_min(AVX512, curr0, &val0[i],
-                                             bound, &acc->_MAX.a[i]);
+                                             bound, &acc->_MIN.a[i]);
                           }
                                   IF_CAP(acc, _MAXABS) {
                               accumulate_maxabs(AVX512, curr0, &val0[i],
@@ -604,7 +756,7 @@ int __accumulate_dual_array(struct accumulator *acc,
                           }
                                   IF_CAP(acc, _MINABS) {
                               accumulate_minabs(AVX512, curr0, &val0[i],
-                                                bound, &acc->_MAXABS.a[i]);
+                                                bound, &acc->_MINABS.a[i]);
                           }
             )
 
@@ -621,7 +773,7 @@ int __accumulate_dual_array(struct accumulator *acc,
                           }
                                   IF_CAP(acc, _MIN) {
                               accumulate_min(AVX256, curr0, &val0[i],
-                                             bound, &acc->_MAX.a[i]);
+                                             bound, &acc->_MIN.a[i]);
                           }
                                   IF_CAP(acc, _MAXABS) {
                               accumulate_maxabs(AVX256, curr0, &val0[i],
@@ -629,7 +781,7 @@ int __accumulate_dual_array(struct accumulator *acc,
                           }
                                   IF_CAP(acc, _MINABS) {
                               accumulate_minabs(AVX256, curr0, &val0[i],
-                                                bound, &acc->_MAXABS.a[i]);
+                                                bound, &acc->_MINABS.a[i]);
                           }
             );
 
@@ -646,7 +798,7 @@ int __accumulate_dual_array(struct accumulator *acc,
                           }
                                   IF_CAP(acc, _MIN) {
                               accumulate_min(AVX128, curr0, &val0[i],
-                                             bound, &acc->_MAX.a[i]);
+                                             bound, &acc->_MIN.a[i]);
                           }
                                   IF_CAP(acc, _MAXABS) {
                               accumulate_maxabs(AVX128, curr0, &val0[i],
@@ -654,7 +806,7 @@ int __accumulate_dual_array(struct accumulator *acc,
                           }
                                   IF_CAP(acc, _MINABS) {
                               accumulate_minabs(AVX128, curr0, &val0[i],
-                                                bound, &acc->_MAXABS.a[i]);
+                                                bound, &acc->_MINABS.a[i]);
                           }
             );
 
@@ -691,7 +843,7 @@ int __accumulate_dual_array(struct accumulator *acc,
                           }
                                   IF_CAP(acc, _MIN) {
                               accumulate_min(AVX512, curr1, &val1[i],
-                                             bound, &acc->_MAX.a[len0 + i]);
+                                             bound, &acc->_MIN.a[len0 + i]);
                           }
                                   IF_CAP(acc, _MAXABS) {
                               accumulate_maxabs(AVX512, curr1, &val1[i],
@@ -699,7 +851,7 @@ int __accumulate_dual_array(struct accumulator *acc,
                           }
                                   IF_CAP(acc, _MINABS) {
                               accumulate_minabs(AVX512, curr1, &val1[i],
-                                                bound, &acc->_MAXABS.a[len0 + i]);
+                                                bound, &acc->_MINABS.a[len0 + i]);
                           }
 
                                   IF_CAP(acc, _COV) {
@@ -754,7 +906,7 @@ int __accumulate_dual_array(struct accumulator *acc,
                           }
                                   IF_CAP(acc, _MIN) {
                               accumulate_min(AVX256, curr1, &val1[i],
-                                             bound, &acc->_MAX.a[len0 + i]);
+                                             bound, &acc->_MIN.a[len0 + i]);
                           }
                                   IF_CAP(acc, _MAXABS) {
                               accumulate_maxabs(AVX256, curr1, &val1[i],
@@ -762,7 +914,7 @@ int __accumulate_dual_array(struct accumulator *acc,
                           }
                                   IF_CAP(acc, _MINABS) {
                               accumulate_minabs(AVX256, curr1, &val1[i],
-                                                bound, &acc->_MAXABS.a[len0 + i]);
+                                                bound, &acc->_MINABS.a[len0 + i]);
                           }
 
                                   IF_CAP(acc, _COV) {
@@ -817,7 +969,7 @@ int __accumulate_dual_array(struct accumulator *acc,
                           }
                                   IF_CAP(acc, _MIN) {
                               accumulate_min(AVX128, curr1, &val1[i],
-                                             bound, &acc->_MAX.a[len0 + i]);
+                                             bound, &acc->_MIN.a[len0 + i]);
                           }
                                   IF_CAP(acc, _MAXABS) {
                               accumulate_maxabs(AVX128, curr1, &val1[i],
@@ -825,7 +977,7 @@ int __accumulate_dual_array(struct accumulator *acc,
                           }
                                   IF_CAP(acc, _MINABS) {
                               accumulate_minabs(AVX128, curr1, &val1[i],
-                                                bound, &acc->_MAXABS.a[len0 + i]);
+                                                bound, &acc->_MINABS.a[len0 + i]);
                           }
 
                                   IF_CAP(acc, _COV) {
@@ -870,6 +1022,7 @@ int __accumulate_dual_array(struct accumulator *acc,
             {
                 m1_new_scalar = acc->_AVG.a[len0 + i] + (val1[i] - acc->_AVG.a[len0 + i]) / acc->count;
                 acc->_DEV.a[len0 + i] += ((val1[i] - acc->_AVG.a[len0 + i]) * (val1[i] - m1_new_scalar));
+                m1_old_scalar = acc->_AVG.a[len0 + i];
 
                 IF_HAVE_128(cov_m_ = _mm_broadcast_ss(&acc->_AVG.a[len0 + i]));
                 IF_HAVE_256(cov_m_256 = _mm256_broadcast_ss(&acc->_AVG.a[len0 + i]));
@@ -913,7 +1066,7 @@ int __accumulate_dual_array(struct accumulator *acc,
                                                  cov_curr, cov_m, &val0[k], &acc->_AVG.a[k]);
                     );
 
-                    acc->_COV.a[len0 * i + k] += ((val1[i] - m1_new_scalar) *
+                    acc->_COV.a[len0 * i + k] += ((val1[i] - m1_old_scalar) *
                                                   (val0[k] - acc->_AVG.a[k]));
                     k++;
                 }
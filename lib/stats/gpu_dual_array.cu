@@ -144,6 +144,53 @@ int gpu_sync_dual_array(struct accumulator *acc)
     return 0;
 }
 
+int gpu_load_dual_array(struct accumulator *acc)
+{
+    cudaError_t cuda_ret;
+    struct dual_array_gpu_vars *vars =
+            (struct dual_array_gpu_vars *) acc->gpu_vars;
+
+    cuda_ret = cudaMemcpyAsync(vars->m, acc->_AVG.a,
+                               (acc->dim0 + acc->dim1) * sizeof(float),
+                               cudaMemcpyHostToDevice,
+                               vars->stream);
+    if(cuda_ret != cudaSuccess)
+    {
+        err("Failed to copy m from host to GPU: %s\n", cudaGetErrorName(cuda_ret));
+        return -EINVAL;
+    }
+
+    cuda_ret = cudaMemcpyAsync(vars->s, acc->_DEV.a,
+                               (acc->dim0 + acc->dim1) * sizeof(float),
+                               cudaMemcpyHostToDevice,
+                               vars->stream);
+    if(cuda_ret != cudaSuccess)
+    {
+        err("Failed to copy s from host to GPU: %s\n", cudaGetErrorName(cuda_ret));
+        return -EINVAL;
+    }
+
+    cuda_ret = cudaMemcpyAsync(vars->cov, acc->_COV.a,
+                               (acc->dim0 * acc->dim1) * sizeof(float),
+                               cudaMemcpyHostToDevice,
+                               vars->stream);
+    if(cuda_ret != cudaSuccess)
+    {
+        err("Failed to copy cov from host to GPU: %s\n", cudaGetErrorName(cuda_ret));
+        return -EINVAL;
+    }
+
+    cuda_ret = cudaStreamSynchronize(vars->stream);
+    if(cuda_ret != cudaSuccess)
+    {
+        err("Failed to synchronize stream: %s\n", cudaGetErrorName(cuda_ret));
+        return -EINVAL;
+    }
+
+    vars->host_stale = false;
+    return 0;
+}
+
 int gpu_accumulate_dual_array(struct accumulator *acc, float *val0, float *val1, int len0, int len1)
 {
     cudaError_t cuda_ret;
@@ -87,6 +87,39 @@ int __stat_get_all_single(struct accumulator *acc, stat_t stat, float **res)
     return 0;
 }
 
+int __stat_merge_single(struct accumulator *dst, struct accumulator *src)
+{
+    float n, delta;
+
+    if(dst->count == 0)
+    {
+        dst->count = src->count;
+        IF_CAP(dst, _AVG) dst->_AVG.f = src->_AVG.f;
+        IF_CAP(dst, _DEV) dst->_DEV.f = src->_DEV.f;
+        IF_CAP(dst, _MAX) dst->_MAX.f = src->_MAX.f;
+        IF_CAP(dst, _MIN) dst->_MIN.f = src->_MIN.f;
+        IF_CAP(dst, _MAXABS) dst->_MAXABS.f = src->_MAXABS.f;
+        IF_CAP(dst, _MINABS) dst->_MINABS.f = src->_MINABS.f;
+        return 0;
+    }
+
+    n = dst->count + src->count;
+    IF_CAP(dst, _AVG)
+    {
+        delta = src->_AVG.f - dst->_AVG.f;
+        dst->_DEV.f += src->_DEV.f + delta * delta * dst->count * src->count / n;
+        dst->_AVG.f += delta * src->count / n;
+    }
+
+    IF_CAP(dst, _MAX) dst->_MAX.f = fmaxf(dst->_MAX.f, src->_MAX.f);
+    IF_CAP(dst, _MIN) dst->_MIN.f = fminf(dst->_MIN.f, src->_MIN.f);
+    IF_CAP(dst, _MAXABS) dst->_MAXABS.f = fmaxf(dst->_MAXABS.f, src->_MAXABS.f);
+    IF_CAP(dst, _MINABS) dst->_MINABS.f = fminf(dst->_MINABS.f, src->_MINABS.f);
+
+    dst->count = n;
+    return 0;
+}
+
 int stat_create_single(struct accumulator **acc, stat_t capabilities)
 {
     struct accumulator *res;
@@ -117,6 +150,7 @@ int stat_create_single(struct accumulator **acc, stat_t capabilities)
     res->free = __stat_free_single;
     res->get = __stat_get_single;
     res->get_all = __stat_get_all_single;
+    res->merge = __stat_merge_single;
 
     *acc = res;
     return 0;
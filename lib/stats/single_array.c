@@ -159,6 +159,91 @@ int __stat_get_all_single_array(struct accumulator *acc, stat_t stat, float **re
     return 0;
 }
 
+int __stat_merge_single_array(struct accumulator *dst, struct accumulator *src)
+{
+    int i;
+    float n, w, f, delta;
+
+    IF_HAVE_512(__m512 w_512, f_512, delta_512);
+    IF_HAVE_256(__m256 w_256, f_256, delta_256);
+    IF_HAVE_128(__m128 w_, f_, delta_);
+
+    if(dst->count == 0)
+    {
+        dst->count = src->count;
+        IF_CAP(dst, _AVG) memcpy(dst->_AVG.a, src->_AVG.a, dst->dim0 * sizeof(float));
+        IF_CAP(dst, _DEV) memcpy(dst->_DEV.a, src->_DEV.a, dst->dim0 * sizeof(float));
+        IF_CAP(dst, _MAX) memcpy(dst->_MAX.a, src->_MAX.a, dst->dim0 * sizeof(float));
+        IF_CAP(dst, _MIN) memcpy(dst->_MIN.a, src->_MIN.a, dst->dim0 * sizeof(float));
+        IF_CAP(dst, _MAXABS) memcpy(dst->_MAXABS.a, src->_MAXABS.a, dst->dim0 * sizeof(float));
+        IF_CAP(dst, _MINABS) memcpy(dst->_MINABS.a, src->_MINABS.a, dst->dim0 * sizeof(float));
+        return 0;
+    }
+
+    n = dst->count + src->count;
+    w = src->count / n;
+    f = dst->count * w;
+
+    IF_HAVE_128(w_ = _mm_broadcast_ss(&w); f_ = _mm_broadcast_ss(&f));
+    IF_HAVE_256(w_256 = _mm256_broadcast_ss(&w); f_256 = _mm256_broadcast_ss(&f));
+    IF_HAVE_512(w_512 = _mm512_broadcastss_ps(w_); f_512 = _mm512_broadcastss_ps(f_));
+
+    for(i = 0; i < dst->dim0;)
+    {
+        LOOP_HAVE_512(i, dst->dim0,
+                      IF_CAP(dst, _AVG) {
+                          merge_moments(AVX512, delta, w, f,
+                                        &dst->_AVG.a[i], &dst->_DEV.a[i],
+                                        &src->_AVG.a[i], &src->_DEV.a[i]);
+                      }
+                      IF_CAP(dst, _MAX) { merge_max(AVX512, &dst->_MAX.a[i], &src->_MAX.a[i]); }
+                      IF_CAP(dst, _MIN) { merge_min(AVX512, &dst->_MIN.a[i], &src->_MIN.a[i]); }
+                      IF_CAP(dst, _MAXABS) { merge_max(AVX512, &dst->_MAXABS.a[i], &src->_MAXABS.a[i]); }
+                      IF_CAP(dst, _MINABS) { merge_min(AVX512, &dst->_MINABS.a[i], &src->_MINABS.a[i]); }
+        );
+
+        LOOP_HAVE_256(i, dst->dim0,
+                      IF_CAP(dst, _AVG) {
+                          merge_moments(AVX256, delta, w, f,
+                                        &dst->_AVG.a[i], &dst->_DEV.a[i],
+                                        &src->_AVG.a[i], &src->_DEV.a[i]);
+                      }
+                      IF_CAP(dst, _MAX) { merge_max(AVX256, &dst->_MAX.a[i], &src->_MAX.a[i]); }
+                      IF_CAP(dst, _MIN) { merge_min(AVX256, &dst->_MIN.a[i], &src->_MIN.a[i]); }
+                      IF_CAP(dst, _MAXABS) { merge_max(AVX256, &dst->_MAXABS.a[i], &src->_MAXABS.a[i]); }
+                      IF_CAP(dst, _MINABS) { merge_min(AVX256, &dst->_MINABS.a[i], &src->_MINABS.a[i]); }
+        );
+
+        LOOP_HAVE_128(i, dst->dim0,
+                      IF_CAP(dst, _AVG) {
+                          merge_moments(AVX128, delta, w, f,
+                                        &dst->_AVG.a[i], &dst->_DEV.a[i],
+                                        &src->_AVG.a[i], &src->_DEV.a[i]);
+                      }
+                      IF_CAP(dst, _MAX) { merge_max(AVX128, &dst->_MAX.a[i], &src->_MAX.a[i]); }
+                      IF_CAP(dst, _MIN) { merge_min(AVX128, &dst->_MIN.a[i], &src->_MIN.a[i]); }
+                      IF_CAP(dst, _MAXABS) { merge_max(AVX128, &dst->_MAXABS.a[i], &src->_MAXABS.a[i]); }
+                      IF_CAP(dst, _MINABS) { merge_min(AVX128, &dst->_MINABS.a[i], &src->_MINABS.a[i]); }
+        );
+
+        IF_CAP(dst, _AVG)
+        {
+            delta = src->_AVG.a[i] - dst->_AVG.a[i];
+            dst->_DEV.a[i] += src->_DEV.a[i] + delta * delta * f;
+            dst->_AVG.a[i] += delta * w;
+        }
+
+        IF_CAP(dst, _MAX) dst->_MAX.a[i] = fmaxf(dst->_MAX.a[i], src->_MAX.a[i]);
+        IF_CAP(dst, _MIN) dst->_MIN.a[i] = fminf(dst->_MIN.a[i], src->_MIN.a[i]);
+        IF_CAP(dst, _MAXABS) dst->_MAXABS.a[i] = fmaxf(dst->_MAXABS.a[i], src->_MAXABS.a[i]);
+        IF_CAP(dst, _MINABS) dst->_MINABS.a[i] = fminf(dst->_MINABS.a[i], src->_MINABS.a[i]);
+        i++;
+    }
+
+    dst->count = n;
+    return 0;
+}
+
 int stat_create_single_array(struct accumulator **acc, stat_t capabilities, int num)
 {
     struct accumulator *res;
@@ -182,6 +267,7 @@ int stat_create_single_array(struct accumulator **acc, stat_t capabilities, int
     }
 
     res->type = ACC_SINGLE_ARRAY;
+    res->capabilities = capabilities;
     res->dim0 = num;
     res->dim1 = 0;
     res->count = 0;
@@ -197,6 +283,7 @@ int stat_create_single_array(struct accumulator **acc, stat_t capabilities, int
     res->free = __stat_free_single_array;
     res->get = __stat_get_single_array;
     res->get_all = __stat_get_all_single_array;
+    res->merge = __stat_merge_single_array;
 
     *acc = res;
     return 0;
@@ -274,7 +361,7 @@ int __accumulate_single_array(struct accumulator *acc, float *val, int len)
                           }
                           IF_CAP(acc, _MIN) {
                               accumulate_min(AVX512, curr, &val[i],
-                                             bound, &acc->_MAX.a[i]);
+                                             bound, &acc->_MIN.a[i]);
                           }
                           IF_CAP(acc, _MAXABS) {
                               accumulate_maxabs(AVX512, curr, &val[i],
@@ -282,7 +369,7 @@ int __accumulate_single_array(struct accumulator *acc, float *val, int len)
                           }
                           IF_CAP(acc, _MINABS) {
                               accumulate_minabs(AVX512, curr, &val[i],
-                                                bound, &acc->_MAXABS.a[i]);
+                                                bound, &acc->_MINABS.a[i]);
                           }
             )
 
@@ -299,7 +386,7 @@ int __accumulate_single_array(struct accumulator *acc, float *val, int len)
                           }
                           IF_CAP(acc, _MIN) {
                               accumulate_min(AVX256, curr, &val[i],
-                                             bound, &acc->_MAX.a[i]);
+                                             bound, &acc->_MIN.a[i]);
                           }
                           IF_CAP(acc, _MAXABS) {
                               accumulate_maxabs(AVX256, curr, &val[i],
@@ -307,7 +394,7 @@ int __accumulate_single_array(struct accumulator *acc, float *val, int len)
                           }
                           IF_CAP(acc, _MINABS) {
                               accumulate_minabs(AVX256, curr, &val[i],
-                                                bound, &acc->_MAXABS.a[i]);
+                                                bound, &acc->_MINABS.a[i]);
                           }
             );
 
@@ -324,7 +411,7 @@ int __accumulate_single_array(struct accumulator *acc, float *val, int len)
                           }
                           IF_CAP(acc, _MIN) {
                               accumulate_min(AVX128, curr, &val[i],
-                                             bound, &acc->_MAX.a[i]);
+                                             bound, &acc->_MIN.a[i]);
                           }
                           IF_CAP(acc, _MAXABS) {
                               accumulate_maxabs(AVX128, curr, &val[i],
@@ -332,7 +419,7 @@ int __accumulate_single_array(struct accumulator *acc, float *val, int len)
                           }
                           IF_CAP(acc, _MINABS) {
                               accumulate_minabs(AVX128, curr, &val[i],
-                                                bound, &acc->_MAXABS.a[i]);
+                                                bound, &acc->_MINABS.a[i]);
                           }
             );
 
@@ -17,6 +17,34 @@ int stat_reset_accumulator(struct accumulator *acc)
     return acc->reset(acc);
 }
 
+int stat_merge_accumulator(struct accumulator *dst, struct accumulator *src)
+{
+    if(!dst || !src)
+    {
+        err("Invalid accumulator\n");
+        return -EINVAL;
+    }
+
+    if(dst->type != src->type || dst->capabilities != src->capabilities ||
+       dst->dim0 != src->dim0 || dst->dim1 != src->dim1 ||
+       dst->transpose != src->transpose)
+    {
+        err("Accumulators have different types, capabilities, dimensions or layouts\n");
+        return -EINVAL;
+    }
+
+    if(src->count == 0)
+        return 0;
+
+    if(dst->merge)
+        return dst->merge(dst, src);
+    else
+    {
+        err("Accumulator does not have a merge function\n");
+        return -EINVAL;
+    }
+}
+
 int stat_free_accumulator(struct accumulator *acc)
 {
     if(!acc)
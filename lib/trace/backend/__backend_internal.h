@@ -3,6 +3,8 @@
 
 #include "platform.h"
 
+struct ztrs_prefetch;
+
 /* Riscure trsfile utils */
 struct backend_trs_arg
 {
@@ -15,9 +17,26 @@ struct backend_trs_arg
 
     bool mode;
     size_t trace_start, trace_length;
-    size_t num_written, position;
+    size_t num_written;
+
+    // only used by compressed backends
+    int codec, level;
+    uint64_t *offsets;
+    size_t num_offsets, max_offsets, loaded_offsets;
+    struct ztrs_prefetch *prefetch;
+
+    // only used by chunked backends
+    size_t block_traces, tile_samples;
+
+    // only used by memory-mapped readers
+    void *map;
+    size_t map_len;
 };
 
+#define ZTRS_CODEC_NONE     0
+#define ZTRS_CODEC_DEFLATE  1
+#define ZTRS_CODEC_DELTA    2
+
 #define MODE_READ   true
 #define MODE_WRITE  false
 #define TRS_ARG(ts)     ((struct backend_trs_arg *) (ts)->backend->arg)
@@ -27,9 +46,17 @@ int write_default_headers(struct trace_set *);
 int finalize_headers(struct trace_set *);
 int free_headers(struct trace_set *);
 
+/* Sample conversion */
+int expand_samples(datatype_t datatype, float yscale,
+                   void *in, float *out, size_t n);
+int pack_samples(datatype_t datatype, float yscale,
+                 float *in, void *out, size_t n);
+
 /* Backend initializers */
 int create_backend_trs(struct trace_set *, const char *);
+int create_backend_mtrs(struct trace_set *, const char *);
 int create_backend_ztrs(struct trace_set *, const char *);
+int create_backend_ctrs(struct trace_set *, const char *);
 int create_backend_net(struct trace_set *, const char *);
 
 #endif //LIBTRS___BACKEND_INTERNAL_H
\ No newline at end of file
@@ -8,8 +8,12 @@ int create_backend(struct trace_set *ts, const char *name)
 
     if(strcmp(tok, "trs") == 0)
         return create_backend_trs(ts, *pos);
+    else if(strcmp(tok, "mtrs") == 0)
+        return create_backend_mtrs(ts, *pos);
     else if(strcmp(tok, "ztrs") == 0)
         return create_backend_ztrs(ts, *pos);
+    else if(strcmp(tok, "ctrs") == 0)
+        return create_backend_ctrs(ts, *pos);
     else if(strcmp(tok, "net") == 0)
         return create_backend_net(ts, *pos);
     else
@@ -0,0 +1,407 @@
+#include "__trace_internal.h"
+#include "__backend_internal.h"
+
+#include "trace.h"
+#include "platform.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Chunked trace sets use the same headers as a regular trs, but the
+ * traces are grouped into blocks of block_traces traces. Each block
+ * holds the titles and data of its traces, followed by the samples
+ * split into tiles of tile_samples samples. Within a tile the samples
+ * are stored trace-major, so a narrow window of samples over many
+ * traces is a handful of short contiguous reads. Positions are
+ * computed as if every block were full, so traces can be written in
+ * any order.
+ */
+
+#define CTRS_DEFAULT_BLOCK_TRACES   64
+#define CTRS_DEFAULT_TILE_SAMPLES   4096
+
+// Reuse these, as the headers are the same as a regular trs
+extern int backend_trs_open(struct trace_set *ts);
+extern int backend_trs_create(struct trace_set *ts);
+extern int backend_trs_close(struct trace_set *ts);
+
+#define CTRS_META_SIZE(ts)      ((ts)->title_size + (ts)->data_size)
+#define CTRS_SAMPLE_SIZE(ts)    ((ts)->datatype & 0xF)
+
+size_t __ctrs_block_offset(struct trace_set *ts, size_t index)
+{
+    size_t block_size = TRS_ARG(ts)->block_traces *
+                        (CTRS_META_SIZE(ts) + ts->num_samples * CTRS_SAMPLE_SIZE(ts));
+
+    return TRS_ARG(ts)->trace_start + (index / TRS_ARG(ts)->block_traces) * block_size;
+}
+
+size_t __ctrs_meta_offset(struct trace_set *ts, size_t index)
+{
+    return __ctrs_block_offset(ts, index) +
+           (index % TRS_ARG(ts)->block_traces) * CTRS_META_SIZE(ts);
+}
+
+// offset of the row belonging to trace index in tile, and its width
+size_t __ctrs_row_offset(struct trace_set *ts, size_t index, size_t tile, size_t *width)
+{
+    size_t first = tile * TRS_ARG(ts)->tile_samples;
+
+    *width = ts->num_samples - first;
+    if(*width > TRS_ARG(ts)->tile_samples)
+        *width = TRS_ARG(ts)->tile_samples;
+
+    return __ctrs_block_offset(ts, index) +
+           TRS_ARG(ts)->block_traces * CTRS_META_SIZE(ts) +
+           first * TRS_ARG(ts)->block_traces * CTRS_SAMPLE_SIZE(ts) +
+           (index % TRS_ARG(ts)->block_traces) * (*width) * CTRS_SAMPLE_SIZE(ts);
+}
+
+int backend_ctrs_open(struct trace_set *ts)
+{
+    int ret;
+
+    // the geometry always comes from the headers when reading
+    TRS_ARG(ts)->block_traces = 0;
+    TRS_ARG(ts)->tile_samples = 0;
+
+    ret = backend_trs_open(ts);
+    if(ret < 0)
+    {
+        err("Failed to open underlying trace set\n");
+        return ret;
+    }
+
+    if(TRS_ARG(ts)->block_traces == 0 || TRS_ARG(ts)->tile_samples == 0)
+    {
+        err("Trace set %s is missing its chunk headers\n", TRS_ARG(ts)->name);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+int backend_ctrs_create(struct trace_set *ts)
+{
+    if(ts->datatype == DT_NONE || (ts->datatype & 0xF) == 0)
+    {
+        err("Invalid datatype for chunked trace set\n");
+        return -EINVAL;
+    }
+
+    return backend_trs_create(ts);
+}
+
+int backend_ctrs_close(struct trace_set *ts)
+{
+    return backend_trs_close(ts);
+}
+
+int backend_ctrs_read_request(struct trace *t, struct trace_request *req)
+{
+    int ret;
+    size_t tile, width, lo, hi, row;
+    size_t first = req->first_sample, num = req->num_samples;
+    uint8_t *raw;
+
+    char *result_title = NULL;
+    uint8_t *result_data = NULL;
+    float *result_samples = NULL;
+
+    if(first + num > t->owner->num_samples)
+    {
+        err("Sample range %zu + %zu out of bounds\n", first, num);
+        return -EINVAL;
+    }
+
+    if((req->fields & REQ_TITLE) && t->owner->title_size)
+    {
+        result_title = tp_alloc(t->owner, POOL_TITLE, t->owner->title_size);
+        if(!result_title)
+        {
+            err("Failed to allocate memory for trace title\n");
+            ret = -ENOMEM;
+            goto __fail;
+        }
+
+        ret = p_pread(TRS_ARG(t->owner)->file, result_title, t->owner->title_size,
+                      __ctrs_meta_offset(t->owner, TRACE_IDX(t)));
+        if(ret < 0)
+        {
+            err("Failed to read title for trace %zu\n", TRACE_IDX(t));
+            goto __fail;
+        }
+    }
+
+    if((req->fields & REQ_DATA) && t->owner->data_size)
+    {
+        result_data = tp_alloc(t->owner, POOL_DATA, t->owner->data_size);
+        if(!result_data)
+        {
+            err("Failed to allocate memory for trace data\n");
+            ret = -ENOMEM;
+            goto __fail;
+        }
+
+        ret = p_pread(TRS_ARG(t->owner)->file, result_data, t->owner->data_size,
+                      __ctrs_meta_offset(t->owner, TRACE_IDX(t)) + t->owner->title_size);
+        if(ret < 0)
+        {
+            err("Failed to read data for trace %zu\n", TRACE_IDX(t));
+            goto __fail;
+        }
+    }
+
+    if((req->fields & REQ_SAMPLES) && num)
+    {
+        result_samples = tp_alloc(t->owner, POOL_SAMPLES, num * sizeof(float));
+        if(!result_samples)
+        {
+            err("Failed to allocate memory for sample buffer\n");
+            ret = -ENOMEM;
+            goto __fail;
+        }
+
+        raw = p_thread_scratch(num * CTRS_SAMPLE_SIZE(t->owner));
+        if(!raw)
+        {
+            err("Failed to allocate scratch buffer for samples\n");
+            ret = -ENOMEM;
+            goto __fail;
+        }
+
+        // only touch the tiles overlapping the range
+        for(tile = first / TRS_ARG(t->owner)->tile_samples;
+            tile <= (first + num - 1) / TRS_ARG(t->owner)->tile_samples; tile++)
+        {
+            row = __ctrs_row_offset(t->owner, TRACE_IDX(t), tile, &width);
+
+            lo = tile * TRS_ARG(t->owner)->tile_samples;
+            hi = lo + width;
+            if(lo < first)
+                lo = first;
+
+            if(hi > first + num)
+                hi = first + num;
+
+            ret = p_pread(TRS_ARG(t->owner)->file,
+                          raw + (lo - first) * CTRS_SAMPLE_SIZE(t->owner),
+                          (hi - lo) * CTRS_SAMPLE_SIZE(t->owner),
+                          row + (lo - tile * TRS_ARG(t->owner)->tile_samples) * CTRS_SAMPLE_SIZE(t->owner));
+            if(ret < 0)
+            {
+                err("Failed to read tile %zu for trace %zu\n", tile, TRACE_IDX(t));
+                goto __fail;
+            }
+        }
+
+        ret = expand_samples(t->owner->datatype, t->owner->yscale,
+                             raw, result_samples, num);
+        if(ret < 0)
+        {
+            err("Failed to expand samples\n");
+            goto __fail;
+        }
+    }
+
+    t->title = result_title;
+    t->data = result_data;
+    t->samples = result_samples;
+    return 0;
+
+__fail:
+    if(result_title)
+        free(result_title);
+
+    if(result_data)
+        free(result_data);
+
+    if(result_samples)
+        free(result_samples);
+
+    return ret;
+}
+
+int backend_ctrs_read(struct trace *t)
+{
+    struct trace_request req = {
+            .fields = REQ_ALL,
+            .first_sample = 0,
+            .num_samples = t->owner->num_samples
+    };
+
+    return backend_ctrs_read_request(t, &req);
+}
+
+int backend_ctrs_write(struct trace *t)
+{
+    int ret = 0;
+    size_t tile, width, num_tiles, row;
+    uint8_t *raw;
+
+    if(!t)
+    {
+        err("Invalid trace\n");
+        return -EINVAL;
+    }
+
+    raw = calloc(t->owner->num_samples, CTRS_SAMPLE_SIZE(t->owner));
+    if(!raw)
+    {
+        err("Failed to allocate temporary memory\n");
+        return -ENOMEM;
+    }
+
+    if(t->samples)
+    {
+        ret = pack_samples(t->owner->datatype, t->owner->yscale,
+                           t->samples, raw, t->owner->num_samples);
+        if(ret < 0)
+        {
+            err("Failed to pack samples for trace %zu\n", TRACE_IDX(t));
+            goto __free_raw;
+        }
+    }
+
+    if(t->title)
+    {
+        ret = p_pwrite(TRS_ARG(t->owner)->file, t->title, t->owner->title_size,
+                       __ctrs_meta_offset(t->owner, TRACE_IDX(t)));
+        if(ret < 0)
+        {
+            err("Failed to write title for trace %zu\n", TRACE_IDX(t));
+            goto __free_raw;
+        }
+    }
+
+    if(t->data)
+    {
+        ret = p_pwrite(TRS_ARG(t->owner)->file, t->data, t->owner->data_size,
+                       __ctrs_meta_offset(t->owner, TRACE_IDX(t)) + t->owner->title_size);
+        if(ret < 0)
+        {
+            err("Failed to write data for trace %zu\n", TRACE_IDX(t));
+            goto __free_raw;
+        }
+    }
+
+    num_tiles = (t->owner->num_samples + TRS_ARG(t->owner)->tile_samples - 1) /
+                TRS_ARG(t->owner)->tile_samples;
+    for(tile = 0; tile < num_tiles; tile++)
+    {
+        row = __ctrs_row_offset(t->owner, TRACE_IDX(t), tile, &width);
+        ret = p_pwrite(TRS_ARG(t->owner)->file,
+                       raw + tile * TRS_ARG(t->owner)->tile_samples * CTRS_SAMPLE_SIZE(t->owner),
+                       width * CTRS_SAMPLE_SIZE(t->owner), row);
+        if(ret < 0)
+        {
+            err("Failed to write tile %zu for trace %zu\n", tile, TRACE_IDX(t));
+            goto __free_raw;
+        }
+    }
+
+    sem_acquire(&TRS_ARG(t->owner)->file_lock);
+    if(TRACE_IDX(t) + 1 > TRS_ARG(t->owner)->num_written)
+    {
+        TRS_ARG(t->owner)->num_written = TRACE_IDX(t) + 1;
+        ret = finalize_headers(t->owner);
+        if(ret < 0)
+            err("Failed to finalize headers\n");
+    }
+    sem_release(&TRS_ARG(t->owner)->file_lock);
+
+__free_raw:
+    free(raw);
+    return ret;
+}
+
+int __ctrs_parse_geometry(struct backend_trs_arg *arg, char *name)
+{
+    char *tok;
+    long val[2];
+    int i;
+
+    // name is "path [traces_per_block samples_per_tile]"
+    for(i = 1; i >= 0; i--)
+    {
+        tok = strrchr(name, ' ');
+        if(!tok || tok[1] < '0' || tok[1] > '9')
+            break;
+
+        val[i] = strtol(tok + 1, NULL, 10);
+        *tok = '\0';
+    }
+
+    if(i == 1)
+        return 0;
+    else if(i == 0)
+    {
+        err("Chunk geometry needs both traces per block and samples per tile\n");
+        return -EINVAL;
+    }
+
+    if(val[0] <= 0 || val[1] <= 0)
+    {
+        err("Invalid chunk geometry %li x %li\n", val[0], val[1]);
+        return -EINVAL;
+    }
+
+    arg->block_traces = (size_t) val[0];
+    arg->tile_samples = (size_t) val[1];
+    return 0;
+}
+
+int create_backend_ctrs(struct trace_set *ts, const char *name)
+{
+    struct backend_trs_arg *arg;
+    struct backend_intf *res = calloc(1, sizeof(struct backend_intf));
+    if(!res)
+    {
+        err("Failed to allocate backend interface struct\n");
+        return -ENOMEM;
+    }
+
+    res->open = backend_ctrs_open;
+    res->create = backend_ctrs_create;
+    res->close = backend_ctrs_close;
+    res->read = backend_ctrs_read;
+    res->read_request = backend_ctrs_read_request;
+    res->write = backend_ctrs_write;
+
+    arg = calloc(1, sizeof(struct backend_trs_arg));
+    if(!arg)
+    {
+        err("Failed to allocate argument for backend\n");
+        goto __free_res;
+    }
+
+    arg->name = calloc(strlen(name) + 1, sizeof(char));
+    if(!arg->name)
+    {
+        err("Failed to allocate name\n");
+        goto __free_arg;
+    }
+
+    strcpy(arg->name, name);
+    arg->block_traces = CTRS_DEFAULT_BLOCK_TRACES;
+    arg->tile_samples = CTRS_DEFAULT_TILE_SAMPLES;
+    if(__ctrs_parse_geometry(arg, arg->name) < 0)
+    {
+        err("Failed to parse chunk geometry for %s\n", name);
+        free(arg->name);
+        goto __free_arg;
+    }
+
+    res->arg = arg;
+    ts->backend = res;
+    return 0;
+
+__free_arg:
+    free(arg);
+
+__free_res:
+    free(res);
+    return -ENOMEM;
+}
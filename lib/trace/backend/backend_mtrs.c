@@ -0,0 +1,216 @@
+#include "__trace_internal.h"
+#include "__backend_internal.h"
+
+#include "trace.h"
+#include "platform.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Reuse these, as the headers are the same as a regular trs
+extern int backend_trs_open(struct trace_set *ts);
+extern int backend_trs_close(struct trace_set *ts);
+
+int backend_mtrs_open(struct trace_set *ts)
+{
+    int ret;
+
+    ret = backend_trs_open(ts);
+    if(ret < 0)
+    {
+        err("Failed to open underlying trace set\n");
+        return ret;
+    }
+
+    ret = p_file_map(TRS_ARG(ts)->file, &TRS_ARG(ts)->map, &TRS_ARG(ts)->map_len);
+    if(ret < 0)
+    {
+        err("Failed to map trace set file %s\n", TRS_ARG(ts)->name);
+        return ret;
+    }
+
+    if(TRS_ARG(ts)->map_len < TRS_ARG(ts)->trace_start +
+                              ts->num_traces * TRS_ARG(ts)->trace_length)
+    {
+        err("Trace set file %s is truncated (%zu bytes, expecting %zu traces)\n",
+            TRS_ARG(ts)->name, TRS_ARG(ts)->map_len, ts->num_traces);
+        ret = -EINVAL;
+        goto __unmap;
+    }
+
+    return 0;
+
+__unmap:
+    p_file_unmap(TRS_ARG(ts)->map, TRS_ARG(ts)->map_len);
+    TRS_ARG(ts)->map = NULL;
+    return ret;
+}
+
+int backend_mtrs_create(struct trace_set *ts)
+{
+    err("Creating a memory-mapped backend is invalid -- use trs to write\n");
+    return -EINVAL;
+}
+
+int backend_mtrs_close(struct trace_set *ts)
+{
+    if(TRS_ARG(ts)->map)
+    {
+        p_file_unmap(TRS_ARG(ts)->map, TRS_ARG(ts)->map_len);
+        TRS_ARG(ts)->map = NULL;
+    }
+
+    return backend_trs_close(ts);
+}
+
+int backend_mtrs_read_request(struct trace *t, struct trace_request *req)
+{
+    int ret;
+    uint8_t *base;
+
+    char *result_title = NULL;
+    uint8_t *result_data = NULL;
+    float *result_samples = NULL;
+    void *temp;
+
+    if(req->first_sample + req->num_samples > t->owner->num_samples)
+    {
+        err("Sample range %zu + %zu out of bounds\n", req->first_sample, req->num_samples);
+        return -EINVAL;
+    }
+
+    // no file lock needed, the mapping is read-only
+    base = (uint8_t *) TRS_ARG(t->owner)->map +
+           TRS_ARG(t->owner)->trace_start +
+           t->index * TRS_ARG(t->owner)->trace_length;
+
+    if((req->fields & REQ_TITLE) && t->owner->title_size)
+    {
+        result_title = tp_alloc(t->owner, POOL_TITLE, t->owner->title_size);
+        if(!result_title)
+        {
+            err("Failed to allocate memory for trace title\n");
+            ret = -ENOMEM;
+            goto __fail;
+        }
+
+        memcpy(result_title, base, t->owner->title_size);
+    }
+
+    if((req->fields & REQ_DATA) && t->owner->data_size)
+    {
+        result_data = tp_alloc(t->owner, POOL_DATA, t->owner->data_size);
+        if(!result_data)
+        {
+            err("Failed to allocate memory for trace data\n");
+            ret = -ENOMEM;
+            goto __fail;
+        }
+
+        memcpy(result_data, base + t->owner->title_size, t->owner->data_size);
+    }
+
+    if((req->fields & REQ_SAMPLES) && req->num_samples)
+    {
+        result_samples = tp_alloc(t->owner, POOL_SAMPLES, req->num_samples * sizeof(float));
+        if(!result_samples)
+        {
+            err("Failed to allocate memory for sample buffer\n");
+            ret = -ENOMEM;
+            goto __fail;
+        }
+
+        // expand samples straight out of the mapping
+        temp = base + t->owner->title_size + t->owner->data_size +
+               req->first_sample * (t->owner->datatype & 0xF);
+        ret = expand_samples(t->owner->datatype, t->owner->yscale,
+                             temp, result_samples, req->num_samples);
+        if(ret < 0)
+        {
+            err("Failed to expand samples\n");
+            goto __fail;
+        }
+    }
+
+    t->title = result_title;
+    t->data = result_data;
+    t->samples = result_samples;
+    return 0;
+
+__fail:
+    if(result_title)
+        free(result_title);
+
+    if(result_data)
+        free(result_data);
+
+    if(result_samples)
+        free(result_samples);
+
+    return ret;
+}
+
+int backend_mtrs_read(struct trace *t)
+{
+    struct trace_request req = {
+            .fields = REQ_ALL,
+            .first_sample = 0,
+            .num_samples = t->owner->num_samples
+    };
+
+    return backend_mtrs_read_request(t, &req);
+}
+
+int backend_mtrs_write(struct trace *t)
+{
+    err("Writing to a memory-mapped backend is invalid\n");
+    return -EINVAL;
+}
+
+int create_backend_mtrs(struct trace_set *ts, const char *name)
+{
+    struct backend_trs_arg *arg;
+    struct backend_intf *res = calloc(1, sizeof(struct backend_intf));
+    if(!res)
+    {
+        err("Failed to allocate backend interface struct\n");
+        return -ENOMEM;
+    }
+
+    res->open = backend_mtrs_open;
+    res->create = backend_mtrs_create;
+    res->close = backend_mtrs_close;
+    res->read = backend_mtrs_read;
+    res->read_request = backend_mtrs_read_request;
+    res->write = backend_mtrs_write;
+
+    arg = calloc(1, sizeof(struct backend_trs_arg));
+    if(!arg)
+    {
+        err("Failed to allocate argument for backend\n");
+        goto __free_res;
+    }
+
+    arg->name = calloc(strlen(name) + 1, sizeof(char));
+    if(!arg->name)
+    {
+        err("Failed to allocate name\n");
+        goto __free_arg;
+    }
+
+    strcpy(arg->name, name);
+    arg->map = NULL;
+    arg->map_len = 0;
+
+    res->arg = arg;
+    ts->backend = res;
+    return 0;
+
+__free_arg:
+    free(arg);
+
+__free_res:
+    free(res);
+    return -ENOMEM;
+}
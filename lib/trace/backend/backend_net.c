@@ -121,11 +121,11 @@ int backend_net_read(struct trace *t)
         goto __free_buf;
     }
 
-    t->title = calloc(t->owner->title_size, 1);
+    t->title = tp_alloc(t->owner, POOL_TITLE, t->owner->title_size);
     if(t->title)
-        t->data = calloc(t->owner->data_size, 1);
+        t->data = tp_alloc(t->owner, POOL_DATA, t->owner->data_size);
     if(t->data)
-        t->samples = calloc(t->owner->num_samples, sizeof(float));
+        t->samples = tp_alloc(t->owner, POOL_SAMPLES, t->owner->num_samples * sizeof(float));
     if(!t->data)
     {
         err("Failed to allocate some trace data\n");
@@ -9,6 +9,9 @@
 #include <stdbool.h>
 #include <string.h>
 
+// how much of the file a batched read pulls in with one call
+#define TRS_READ_BATCH_BYTES    (4 * 1024 * 1024)
+
 int backend_trs_open(struct trace_set *ts)
 {
     int ret;
@@ -42,6 +45,7 @@ __free_headers:
 
 __close_ts_file:
     p_fclose(TRS_ARG(ts)->file);
+    TRS_ARG(ts)->file = NULL;
     return ret;
 }
 
@@ -93,6 +97,7 @@ __free_headers:
 
 __close_ts_file:
     p_fclose(TRS_ARG(ts)->file);
+    TRS_ARG(ts)->file = NULL;
     return ret;
 }
 
@@ -124,290 +129,344 @@ int backend_trs_close(struct trace_set *ts)
     return 0;
 }
 
-int backend_trs_read(struct trace *t)
+// the span [lo, hi) of an on-disk record which covers the requested fields
+void __trs_request_span(struct trace_set *ts, struct trace_request *req, size_t *lo, size_t *hi)
 {
-    int ret, i;
-    size_t read;
+    bool title, data, samples;
+    size_t samples_offs = ts->title_size + ts->data_size +
+                          req->first_sample * (ts->datatype & 0xF);
+
+    title = (req->fields & REQ_TITLE) && ts->title_size;
+    data = (req->fields & REQ_DATA) && ts->data_size;
+    samples = (req->fields & REQ_SAMPLES) && req->num_samples;
+
+    *lo = title ? 0 :
+          data ? ts->title_size : samples_offs;
+    *hi = samples ? samples_offs + req->num_samples * (ts->datatype & 0xF) :
+          data ? ts->title_size + ts->data_size : ts->title_size;
+}
+
+// fill in the requested fields of t from record, which holds [lo, hi) of it
+int __trs_unpack_request(struct trace *t, struct trace_request *req,
+                         uint8_t *record, size_t lo)
+{
+    int ret;
+    size_t samples_offs;
 
     char *result_title = NULL;
     uint8_t *result_data = NULL;
     float *result_samples = NULL;
-    void *temp = NULL;
 
-    if(t->owner->title_size)
+    if((req->fields & REQ_TITLE) && t->owner->title_size)
     {
-        result_title = calloc(1, t->owner->title_size);
+        result_title = tp_alloc(t->owner, POOL_TITLE, t->owner->title_size);
         if(!result_title)
         {
             err("Failed to allocate memory for trace title\n");
             ret = -ENOMEM;
             goto __fail;
         }
+
+        memcpy(result_title, record, t->owner->title_size);
     }
 
-    if(t->owner->data_size)
+    if((req->fields & REQ_DATA) && t->owner->data_size)
     {
-        result_data = calloc(1, t->owner->data_size);
+        result_data = tp_alloc(t->owner, POOL_DATA, t->owner->data_size);
         if(!result_data)
         {
             err("Failed to allocate memory for trace data\n");
             ret = -ENOMEM;
             goto __fail;
         }
+
+        memcpy(result_data, record + t->owner->title_size - lo, t->owner->data_size);
     }
 
-    if(t->owner->num_samples)
+    if((req->fields & REQ_SAMPLES) && req->num_samples)
     {
-        temp = calloc(t->owner->datatype & 0xF, t->owner->num_samples);
-        if(!temp)
+        result_samples = tp_alloc(t->owner, POOL_SAMPLES, req->num_samples * sizeof(float));
+        if(!result_samples)
         {
-            err("Failed to allocate memory for temp sample buffer\n");
+            err("Failed to allocate memory for sample buffer\n");
             ret = -ENOMEM;
             goto __fail;
         }
 
-        result_samples = calloc(sizeof(float), t->owner->num_samples);
-        if(!result_samples)
+        samples_offs = t->owner->title_size + t->owner->data_size +
+                       req->first_sample * (t->owner->datatype & 0xF);
+        ret = expand_samples(t->owner->datatype, t->owner->yscale,
+                             record + samples_offs - lo, result_samples, req->num_samples);
+        if(ret < 0)
         {
-            err("Failed to allocate memory for sample buffer\n");
-            ret = -ENOMEM;
+            err("Failed to expand samples\n");
             goto __fail;
         }
     }
 
-    sem_acquire(&TRS_ARG(t->owner)->file_lock);
-    ret = p_fseek(TRS_ARG(t->owner)->file,
-                  TRS_ARG(t->owner)->trace_start +
-                  t->index * TRS_ARG(t->owner)->trace_length,
-                  SEEK_SET);
-    if(ret)
+    t->title = result_title;
+    t->data = result_data;
+    t->samples = result_samples;
+    return 0;
+
+__fail:
+    if(result_title)
+        free(result_title);
+
+    if(result_data)
+        free(result_data);
+
+    if(result_samples)
+        free(result_samples);
+
+    return ret;
+}
+
+int backend_trs_read_request(struct trace *t, struct trace_request *req)
+{
+    int ret;
+    uint8_t *record;
+    size_t lo, hi;
+
+    if(req->first_sample + req->num_samples > t->owner->num_samples)
     {
-        err("Failed to seek file to trace position\n");
-        ret = -EIO;
-        goto __fail_unlock;
+        err("Sample range %zu + %zu out of bounds\n", req->first_sample, req->num_samples);
+        return -EINVAL;
     }
 
-    read = p_fread(result_title, 1, t->owner->title_size, TRS_ARG(t->owner)->file);
-    if(read != t->owner->title_size)
+    // only read the span of the record covering the requested fields
+    __trs_request_span(t->owner, req, &lo, &hi);
+    if(hi <= lo)
     {
-        err("Failed to read title from file (read %zu expecting %zu)\n",
-            read, t->owner->title_size);
-        ret = -EIO;
-        goto __fail_unlock;
+        t->title = NULL;
+        t->data = NULL;
+        t->samples = NULL;
+        return 0;
     }
 
-    read = p_fread(result_data, 1, t->owner->data_size, TRS_ARG(t->owner)->file);
-    if(read != t->owner->data_size)
+    // reused across reads on this thread, valid until the next call
+    record = p_thread_scratch(hi - lo);
+    if(!record)
     {
-        err("Failed to read data from file (read %zu expecting %zu)\n",
-            read, t->owner->data_size);
-        ret = -EIO;
-        goto __fail_unlock;
+        err("Failed to allocate scratch buffer for trace record\n");
+        return -ENOMEM;
     }
 
-    read = p_fread(temp, t->owner->datatype & 0xF, t->owner->num_samples, TRS_ARG(t->owner)->file);
-    if(read != t->owner->num_samples)
+    // positional read, so no file lock is needed
+    ret = p_pread(TRS_ARG(t->owner)->file, record, hi - lo,
+                  TRS_ARG(t->owner)->trace_start +
+                  t->index * TRS_ARG(t->owner)->trace_length + lo);
+    if(ret < 0)
     {
-        err("Failed to read samples from file (read %zu expecting %zu)\n",
-            read, t->owner->num_samples);
-        ret = -EIO;
-        goto __fail_unlock;
+        err("Failed to read trace %zu from file\n", TRACE_IDX(t));
+        return -EIO;
     }
 
-    sem_release(&TRS_ARG(t->owner)->file_lock);
+    return __trs_unpack_request(t, req, record, lo);
+}
+
+int backend_trs_read_batch(struct trace **traces, size_t num, struct trace_request *req)
+{
+    int ret;
+    uint8_t *buf;
+    size_t i, j, lo, hi, count, span;
+    struct trace_set *ts;
 
-    // expand samples
-    switch(t->owner->datatype)
+    if(!traces || num == 0 || !req)
     {
-        case DT_BYTE:
-            for(i = 0; i < t->owner->num_samples; i++)
-                result_samples[i] = t->owner->yscale * (float) ((char *) temp)[i];
-            break;
-
-        case DT_SHORT:
-            for(i = 0; i < t->owner->num_samples; i++)
-                result_samples[i] = t->owner->yscale * (float) ((short *) temp)[i];
-            break;
-
-        case DT_INT:
-            for(i = 0; i < t->owner->num_samples; i++)
-                result_samples[i] = t->owner->yscale * (float) ((int *) temp)[i];
-            break;
-
-        case DT_FLOAT:
-            for(i = 0; i < t->owner->num_samples; i++)
-                result_samples[i] = t->owner->yscale * ((float *) temp)[i];
-            break;
-
-        case DT_NONE:
-        err("Invalid trace data type: %i\n", t->owner->datatype);
-            goto __fail;
+        err("Invalid trace array or request\n");
+        return -EINVAL;
+    }
+
+    ts = traces[0]->owner;
+    if(req->first_sample + req->num_samples > ts->num_samples)
+    {
+        err("Sample range %zu + %zu out of bounds\n", req->first_sample, req->num_samples);
+        return -EINVAL;
     }
 
-    free(temp);
+    __trs_request_span(ts, req, &lo, &hi);
+    if(hi <= lo)
+    {
+        for(i = 0; i < num; i++)
+        {
+            traces[i]->title = NULL;
+            traces[i]->data = NULL;
+            traces[i]->samples = NULL;
+        }
 
-    t->title = result_title;
-    t->data = result_data;
-    t->samples = result_samples;
-    return 0;
+        return 0;
+    }
 
-__fail_unlock:
-    sem_release(&TRS_ARG(t->owner)->file_lock);
+    // as many records as fit in one read, but always at least one
+    count = TRS_READ_BATCH_BYTES / TRS_ARG(ts)->trace_length;
+    if(count == 0)
+        count = 1;
 
-__fail:
-    if(result_title)
-        free(result_title);
+    for(i = 0; i < num; i += count)
+    {
+        if(count > num - i)
+            count = num - i;
 
-    if(result_data)
-        free(result_data);
+        span = (count - 1) * TRS_ARG(ts)->trace_length + hi - lo;
+        buf = p_thread_scratch(span);
+        if(!buf)
+        {
+            err("Failed to allocate scratch buffer for trace records\n");
+            ret = -ENOMEM;
+            goto __fail;
+        }
 
-    if(temp)
-        free(temp);
+        ret = p_pread(TRS_ARG(ts)->file, buf, span,
+                      TRS_ARG(ts)->trace_start +
+                      TRACE_IDX(traces[i]) * TRS_ARG(ts)->trace_length + lo);
+        if(ret < 0)
+        {
+            err("Failed to read traces %zu to %zu from file\n",
+                TRACE_IDX(traces[i]), TRACE_IDX(traces[i]) + count - 1);
+            ret = -EIO;
+            goto __fail;
+        }
 
-    if(result_samples)
-        free(result_samples);
+        for(j = 0; j < count; j++)
+        {
+            ret = __trs_unpack_request(traces[i + j], req,
+                                       buf + j * TRS_ARG(ts)->trace_length, lo);
+            if(ret < 0)
+            {
+                err("Failed to unpack trace %zu\n", TRACE_IDX(traces[i + j]));
+                i += j;
+                goto __fail;
+            }
+        }
+    }
+
+    return 0;
+
+__fail:
+    // nothing past the failed trace was filled in
+    for(j = i; j < num; j++)
+    {
+        traces[j]->title = NULL;
+        traces[j]->data = NULL;
+        traces[j]->samples = NULL;
+    }
 
     return ret;
 }
 
-int backend_trs_write(struct trace *t)
+int backend_trs_read(struct trace *t)
 {
-    int i, ret;
-    size_t written;
+    struct trace_request req = {
+            .fields = REQ_ALL,
+            .first_sample = 0,
+            .num_samples = t->owner->num_samples
+    };
 
-    size_t temp_len;
-    void *temp = NULL;
+    return backend_trs_read_request(t, &req);
+}
 
-    if(!t)
-    {
-        err("Invalid trace\n");
-        return -EINVAL;
-    }
+int backend_trs_write_batch(struct trace **traces, size_t num)
+{
+    int ret;
+    size_t i, first;
 
-    if(TRACE_IDX(t) != TRS_ARG(t->owner)->num_written)
+    struct trace_set *ts;
+    uint8_t *buf, *record;
+
+    if(!traces || num == 0)
     {
-        err("Out-of-order trace sent to write\n");
+        err("Invalid traces\n");
         return -EINVAL;
     }
 
-    switch(t->owner->datatype)
-    {
-        case DT_BYTE:
-            temp_len = ts_num_samples(t->owner) * sizeof(char);
-            temp = calloc(t->owner->num_samples, sizeof(char));
-            if(!temp) break;
-
-            for(i = 0; i < ts_num_samples(t->owner); i++)
-                ((char *) temp)[i] =
-                        (char) (t->samples[i] / t->owner->yscale);
-            break;
-
-        case DT_SHORT:
-            temp_len = ts_num_samples(t->owner) * sizeof(short);
-            temp = calloc(t->owner->num_samples, sizeof(short));
-            if(!temp) break;
-
-            for(i = 0; i < ts_num_samples(t->owner); i++)
-                ((short *) temp)[i] =
-                        (short) (t->samples[i] / t->owner->yscale);
-            break;
-
-        case DT_INT:
-            temp_len = ts_num_samples(t->owner) * sizeof(int);
-            temp = calloc(t->owner->num_samples, sizeof(int));
-            if(!temp) break;
-
-            for(i = 0; i < ts_num_samples(t->owner); i++)
-                ((int *) temp)[i] =
-                        (int) (t->samples[i] / t->owner->yscale);
-            break;
-
-        case DT_FLOAT:
-            temp_len = ts_num_samples(t->owner) * sizeof(float);
-            temp = calloc(t->owner->num_samples, sizeof(float));
-            if(!temp) break;
-
-            for(i = 0; i < ts_num_samples(t->owner); i++)
-                ((float *) temp)[i] =
-                        (t->samples[i] / t->owner->yscale);
-            break;
-
-        case DT_NONE:
-        default:
-        err("Bad trace set datatype %i\n", t->owner->datatype);
-            return -EINVAL;
-    }
+    ts = traces[0]->owner;
+    first = TRACE_IDX(traces[0]);
 
-    if(!temp)
+    // pack everything into one contiguous span of the file
+    buf = calloc(num, TRS_ARG(ts)->trace_length);
+    if(!buf)
     {
         err("Failed to allocate temporary memory\n");
         return -ENOMEM;
     }
 
-    sem_acquire(&TRS_ARG(t->owner)->file_lock);
-    ret = p_fseek(TRS_ARG(t->owner)->file,
-                  TRS_ARG(t->owner)->trace_start +
-                  t->index * TRS_ARG(t->owner)->trace_length,
-                  SEEK_SET);
-    if(ret)
+    for(i = 0; i < num; i++)
     {
-        err("Failed to seek to trace set file position\n");
-        ret = -errno;
-        goto __unlock;
-    }
+        if(traces[i]->owner != ts || TRACE_IDX(traces[i]) != first + i)
+        {
+            err("Non-consecutive trace sent to batch write\n");
+            ret = -EINVAL;
+            goto __free_buf;
+        }
 
-    if(t->title)
-    {
-        debug("Trace %zu writing %zu bytes of title\n", TRACE_IDX(t), t->owner->title_size);
-        written = p_fwrite(t->title, 1, t->owner->title_size, TRS_ARG(t->owner)->file);
-        if(written != t->owner->title_size)
+        record = buf + i * TRS_ARG(ts)->trace_length;
+        if(traces[i]->title)
+            memcpy(record, traces[i]->title, ts->title_size);
+
+        if(traces[i]->data)
+            memcpy(record + ts->title_size, traces[i]->data, ts->data_size);
+
+        if(traces[i]->samples)
         {
-            err("Failed to write all bytes of title to file\n");
-            ret = -EIO;
-            goto __free_temp;
+            ret = pack_samples(ts->datatype, ts->yscale, traces[i]->samples,
+                               record + ts->title_size + ts->data_size,
+                               ts->num_samples);
+            if(ret < 0)
+            {
+                err("Failed to pack samples for trace %zu\n", first + i);
+                goto __free_buf;
+            }
         }
     }
 
-    if(t->data)
+    sem_acquire(&TRS_ARG(ts)->file_lock);
+    if(first != TRS_ARG(ts)->num_written)
     {
-        debug("Trace %zu writing %zu bytes of data\n", TRACE_IDX(t), t->owner->data_size);
-        written = p_fwrite(t->data, 1, t->owner->data_size, TRS_ARG(t->owner)->file);
-        if(written != t->owner->data_size)
-        {
-            err("Failed to write all bytes of data to file\n");
-            ret = -EIO;
-            goto __free_temp;
-        }
+        err("Out-of-order trace sent to write\n");
+        ret = -EINVAL;
+        goto __unlock;
     }
 
-    debug("Trace %zu writing %zu bytes of samples\n", TRACE_IDX(t), temp_len);
-    written = p_fwrite(temp, 1, temp_len, TRS_ARG(t->owner)->file);
-    if(written != temp_len)
+    debug("Writing traces %zu to %zu\n", first, first + num - 1);
+    ret = p_pwrite(TRS_ARG(ts)->file, buf, num * TRS_ARG(ts)->trace_length,
+                   TRS_ARG(ts)->trace_start + first * TRS_ARG(ts)->trace_length);
+    if(ret < 0)
     {
-        err("Failed to write all bytes of samples to file\n");
-        ret = -EIO;
-        goto __free_temp;
+        err("Failed to write traces to file\n");
+        goto __unlock;
     }
 
-    // make number of traces agree
-    TRS_ARG(t->owner)->num_written++;
-    ret = finalize_headers(t->owner);
+    // make number of traces agree, once for the whole batch
+    TRS_ARG(ts)->num_written += num;
+    ret = finalize_headers(ts);
     if(ret < 0)
     {
         err("Failed to update headers in trace file\n");
         goto __unlock;
     }
 
-    fflush(TRS_ARG(t->owner)->file);
+    fflush(TRS_ARG(ts)->file);
     ret = 0;
 __unlock:
-    sem_release(&TRS_ARG(t->owner)->file_lock);
+    sem_release(&TRS_ARG(ts)->file_lock);
 
-__free_temp:
-    free(temp);
+__free_buf:
+    free(buf);
     return ret;
 }
 
+int backend_trs_write(struct trace *t)
+{
+    if(!t)
+    {
+        err("Invalid trace\n");
+        return -EINVAL;
+    }
+
+    return backend_trs_write_batch(&t, 1);
+}
+
 int create_backend_trs(struct trace_set *ts, const char *name)
 {
     struct backend_trs_arg *arg;
@@ -422,7 +481,10 @@ int create_backend_trs(struct trace_set *ts, const char *name)
     res->create = backend_trs_create;
     res->close = backend_trs_close;
     res->read = backend_trs_read;
+    res->read_request = backend_trs_read_request;
+    res->read_batch = backend_trs_read_batch;
     res->write = backend_trs_write;
+    res->write_batch = backend_trs_write_batch;
 
     arg = calloc(1, sizeof(struct backend_trs_arg));
     if(!arg)
@@ -11,87 +11,982 @@ extern int backend_trs_open(struct trace_set *ts);
 extern int backend_trs_create(struct trace_set *ts);
 extern int backend_trs_close(struct trace_set *ts);
 
-int __seek_to_trace(struct trace *t, uint32_t *size)
+/*
+ * Each trace is stored as [size][title][data][compressed samples][size],
+ * so traces can only be found by walking the size prefixes. To make
+ * random access cheap, we keep the offset of every trace's leading size
+ * field in memory. The offsets are filled in as traces are written (or
+ * lazily walked, for files without one) and persisted in a sidecar
+ * <name>.idx file when the set is closed.
+ */
+
+#define ZTRS_INDEX_MAGIC    0x5A494458  // "ZIDX"
+#define ZTRS_INDEX_EXT      ".idx"
+
+struct ztrs_index_header
+{
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t file_size;
+    uint64_t num_offsets;
+};
+
+int __ztrs_push_offset(struct trace_set *ts, uint64_t offset)
+{
+    uint64_t *grown;
+
+    if(TRS_ARG(ts)->num_offsets == TRS_ARG(ts)->max_offsets)
+    {
+        grown = realloc(TRS_ARG(ts)->offsets,
+                        2 * (TRS_ARG(ts)->max_offsets + 1) * sizeof(uint64_t));
+        if(!grown)
+        {
+            err("Failed to grow trace offset index\n");
+            return -ENOMEM;
+        }
+
+        TRS_ARG(ts)->offsets = grown;
+        TRS_ARG(ts)->max_offsets = 2 * (TRS_ARG(ts)->max_offsets + 1);
+    }
+
+    TRS_ARG(ts)->offsets[TRS_ARG(ts)->num_offsets++] = offset;
+    return 0;
+}
+
+char *__ztrs_index_name(struct trace_set *ts)
+{
+    char *res;
+
+    res = calloc(strlen(TRS_ARG(ts)->name) + strlen(ZTRS_INDEX_EXT) + 1, sizeof(char));
+    if(!res)
+        return NULL;
+
+    strcpy(res, TRS_ARG(ts)->name);
+    strcat(res, ZTRS_INDEX_EXT);
+    return res;
+}
+
+int __ztrs_file_size(struct trace_set *ts, uint64_t *size)
+{
+    long pos;
+
+    if(p_fseek(TRS_ARG(ts)->file, 0, SEEK_END))
+        return -EIO;
+
+    pos = p_ftell(TRS_ARG(ts)->file);
+    if(pos < 0)
+        return -EIO;
+
+    *size = (uint64_t) pos;
+    return 0;
+}
+
+int __ztrs_load_index(struct trace_set *ts)
 {
     int ret;
-    uint32_t last_size, this_size;
+    char *idx_name;
+    LT_FILE_TYPE *idx_file;
+
     size_t read;
+    uint64_t file_size;
+    struct ztrs_index_header header;
+
+    idx_name = __ztrs_index_name(ts);
+    if(!idx_name)
+    {
+        err("Failed to allocate index file name\n");
+        return -ENOMEM;
+    }
+
+    idx_file = p_fopen(idx_name, "rb");
+    if(!idx_file)
+    {
+        debug("No index for %s, will build one lazily\n", TRS_ARG(ts)->name);
+        free(idx_name);
+        return 0;
+    }
+
+    ret = __ztrs_file_size(ts, &file_size);
+    if(ret < 0)
+    {
+        err("Failed to get size of trace set file\n");
+        goto __close_idx;
+    }
+
+    read = p_fread(&header, sizeof(struct ztrs_index_header), 1, idx_file);
+    if(read != 1 || header.magic != ZTRS_INDEX_MAGIC ||
+       header.file_size != file_size || header.num_offsets > ts->num_traces)
+    {
+        warn("Ignoring stale or invalid index %s\n", idx_name);
+        ret = 0;
+        goto __close_idx;
+    }
+
+    TRS_ARG(ts)->offsets = calloc(header.num_offsets, sizeof(uint64_t));
+    if(!TRS_ARG(ts)->offsets)
+    {
+        err("Failed to allocate trace offset index\n");
+        ret = -ENOMEM;
+        goto __close_idx;
+    }
+
+    read = p_fread(TRS_ARG(ts)->offsets, sizeof(uint64_t), header.num_offsets, idx_file);
+    if(read != header.num_offsets ||
+       (header.num_offsets > 0 && TRS_ARG(ts)->offsets[0] != TRS_ARG(ts)->trace_start + sizeof(uint32_t)))
+    {
+        warn("Ignoring truncated or mismatched index %s\n", idx_name);
+        free(TRS_ARG(ts)->offsets);
+        TRS_ARG(ts)->offsets = NULL;
+        ret = 0;
+        goto __close_idx;
+    }
+
+    TRS_ARG(ts)->num_offsets = header.num_offsets;
+    TRS_ARG(ts)->max_offsets = header.num_offsets;
+    debug("Loaded %zu trace offsets from %s\n", TRS_ARG(ts)->num_offsets, idx_name);
+    ret = 0;
+
+__close_idx:
+    p_fclose(idx_file);
+    free(idx_name);
+    return ret;
+}
+
+int __ztrs_store_index(struct trace_set *ts)
+{
+    int ret;
+    char *idx_name;
+    LT_FILE_TYPE *idx_file;
+
+    size_t written;
+    struct ztrs_index_header header = {
+            .magic = ZTRS_INDEX_MAGIC,
+            .reserved = 0,
+            .num_offsets = TRS_ARG(ts)->num_offsets
+    };
+
+    ret = __ztrs_file_size(ts, &header.file_size);
+    if(ret < 0)
+    {
+        err("Failed to get size of trace set file\n");
+        return ret;
+    }
+
+    idx_name = __ztrs_index_name(ts);
+    if(!idx_name)
+    {
+        err("Failed to allocate index file name\n");
+        return -ENOMEM;
+    }
+
+    idx_file = p_fopen(idx_name, "wb");
+    if(!idx_file)
+    {
+        err("Failed to open index file %s\n", idx_name);
+        ret = -EIO;
+        goto __free_name;
+    }
+
+    written = p_fwrite(&header, sizeof(struct ztrs_index_header), 1, idx_file);
+    if(written == 1)
+        written = p_fwrite(TRS_ARG(ts)->offsets, sizeof(uint64_t),
+                           TRS_ARG(ts)->num_offsets, idx_file);
+
+    if(written != TRS_ARG(ts)->num_offsets && TRS_ARG(ts)->num_offsets != 0)
+    {
+        err("Failed to write trace offsets to index file\n");
+        ret = -EIO;
+    }
+    else ret = 0;
+
+    p_fclose(idx_file);
+__free_name:
+    free(idx_name);
+    return ret;
+}
+
+int __ztrs_find_trace(struct trace_set *ts, size_t index, uint64_t *offset)
+{
+    int ret;
+    uint32_t size;
+    uint64_t last;
+
+    // caller holds the file lock
+    if(index >= (TRS_ARG(ts)->mode == MODE_READ ? ts->num_traces : TRS_ARG(ts)->num_written))
+    {
+        err("Trace %zu is out of range\n", index);
+        return -EINVAL;
+    }
+
+    // walk forward from the last known trace
+    while(TRS_ARG(ts)->num_offsets <= index)
+    {
+        last = TRS_ARG(ts)->offsets[TRS_ARG(ts)->num_offsets - 1];
+        ret = p_pread(TRS_ARG(ts)->file, &size, sizeof(uint32_t), last);
+        if(ret < 0)
+        {
+            err("Failed to read trace size at offset %zu\n", (size_t) last);
+            return -EIO;
+        }
+
+        ret = __ztrs_push_offset(ts, last + 2 * sizeof(uint32_t) +
+                                     ts->title_size + ts->data_size + size);
+        if(ret < 0)
+        {
+            err("Failed to extend trace offset index\n");
+            return ret;
+        }
+    }
+
+    *offset = TRS_ARG(ts)->offsets[index];
+    return 0;
+}
+
+/*
+ * Sample codecs. Legacy files (without a codec header) are always
+ * deflate at Z_BEST_COMPRESSION. The delta codec is meant for integer
+ * ADC samples: consecutive differences are zigzag-encoded and then
+ * bit-packed in blocks of ZTRS_DELTA_BLOCK, each prefixed with its
+ * bit width.
+ */
+
+#define ZTRS_DELTA_BLOCK        64
+#define ZTRS_DEFAULT_LEVEL      Z_BEST_COMPRESSION
+
+static inline uint32_t __zigzag(int32_t v)
+{
+    return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+static inline int32_t __unzigzag(uint32_t v)
+{
+    return (int32_t) (v >> 1) ^ -(int32_t) (v & 1);
+}
+
+size_t __ztrs_delta_encode(datatype_t datatype, void *in, size_t n, uint8_t *out)
+{
+    int width, bits;
+    size_t i, j, len, pos = 0;
+    int32_t prev = 0, curr;
+    uint32_t vals[ZTRS_DELTA_BLOCK], max;
+    uint64_t acc;
+
+    for(i = 0; i < n; i += ZTRS_DELTA_BLOCK)
+    {
+        len = (n - i < ZTRS_DELTA_BLOCK) ? n - i : ZTRS_DELTA_BLOCK;
+
+        max = 0;
+        for(j = 0; j < len; j++)
+        {
+            if(datatype == DT_BYTE)
+                curr = ((int8_t *) in)[i + j];
+            else
+                curr = ((int16_t *) in)[i + j];
+
+            vals[j] = __zigzag(curr - prev);
+            max |= vals[j];
+            prev = curr;
+        }
+
+        for(width = 0; width < 32 && (max >> width); width++);
+        out[pos++] = (uint8_t) width;
+
+        acc = 0;
+        bits = 0;
+        for(j = 0; j < len; j++)
+        {
+            acc |= (uint64_t) vals[j] << bits;
+            for(bits += width; bits >= 8; bits -= 8)
+            {
+                out[pos++] = (uint8_t) acc;
+                acc >>= 8;
+            }
+        }
+
+        if(bits > 0)
+            out[pos++] = (uint8_t) acc;
+    }
+
+    return pos;
+}
+
+int __ztrs_delta_decode(datatype_t datatype, uint8_t *in, size_t in_len, void *out, size_t n)
+{
+    int width, bits;
+    size_t i, j, len, pos = 0;
+    int32_t prev = 0;
+    uint64_t acc, mask;
+
+    for(i = 0; i < n; i += ZTRS_DELTA_BLOCK)
+    {
+        len = (n - i < ZTRS_DELTA_BLOCK) ? n - i : ZTRS_DELTA_BLOCK;
+        if(pos >= in_len)
+            return -EINVAL;
+
+        width = in[pos++];
+        if(width > 32)
+            return -EINVAL;
+
+        mask = ((uint64_t) 1 << width) - 1;
+        acc = 0;
+        bits = 0;
+        for(j = 0; j < len; j++)
+        {
+            for(; bits < width; bits += 8)
+            {
+                if(pos >= in_len)
+                    return -EINVAL;
+
+                acc |= (uint64_t) in[pos++] << bits;
+            }
+
+            prev += __unzigzag((uint32_t) (acc & mask));
+            acc >>= width;
+            bits -= width;
+
+            if(datatype == DT_BYTE)
+                ((int8_t *) out)[i + j] = (int8_t) prev;
+            else
+                ((int16_t *) out)[i + j] = (int16_t) prev;
+        }
+    }
+
+    return (pos == in_len) ? 0 : -EINVAL;
+}
+
+size_t __ztrs_compress_bound(struct trace_set *ts, size_t raw_len)
+{
+    if(TRS_ARG(ts)->codec == ZTRS_CODEC_DELTA)
+        // at most 32 bits per sample, plus one width byte per block
+        return 4 * ts->num_samples + ts->num_samples / ZTRS_DELTA_BLOCK + 1;
+
+    return compressBound(raw_len);
+}
+
+int __ztrs_compress(struct trace_set *ts, void *raw, size_t raw_len,
+                    void *compressed, size_t bound, size_t *compressed_size)
+{
+    int ret;
+    z_stream def_stream = {
+            .zalloc = Z_NULL,
+            .zfree = Z_NULL,
+            .opaque = Z_NULL
+    };
+
+    if(TRS_ARG(ts)->codec == ZTRS_CODEC_DELTA)
+    {
+        *compressed_size = __ztrs_delta_encode(ts->datatype, raw, ts->num_samples, compressed);
+        return 0;
+    }
+
+    if(deflateInit(&def_stream, TRS_ARG(ts)->level) != Z_OK)
+    {
+        err("Failed to initialize deflate stream\n");
+        return -EINVAL;
+    }
+
+    def_stream.avail_in = raw_len;
+    def_stream.next_in = (Bytef *) raw;
+    def_stream.avail_out = bound;
+    def_stream.next_out = (Bytef *) compressed;
+
+    ret = deflate(&def_stream, Z_FINISH);
+    deflateEnd(&def_stream);
+
+    if(ret != Z_STREAM_END || def_stream.total_in != raw_len)
+    {
+        err("Failed to compress all data\n");
+        return -EINVAL;
+    }
+
+    *compressed_size = def_stream.total_out;
+    return 0;
+}
+
+int __ztrs_decompress(struct trace_set *ts, z_stream *inf_stream,
+                      void *compressed, size_t compressed_size, void *raw)
+{
+    int ret;
+    size_t raw_len = (ts->datatype & 0xF) * ts->num_samples;
+
+    if(TRS_ARG(ts)->codec == ZTRS_CODEC_DELTA)
+    {
+        ret = __ztrs_delta_decode(ts->datatype, compressed, compressed_size,
+                                  raw, ts->num_samples);
+        if(ret < 0)
+        {
+            err("Failed to decode delta-packed samples\n");
+            return ret;
+        }
+
+        return 0;
+    }
+
+    inflateReset(inf_stream);
+    inf_stream->avail_in = compressed_size;
+    inf_stream->next_in = (Bytef *) compressed;
+    inf_stream->avail_out = raw_len;
+    inf_stream->next_out = (Bytef *) raw;
+
+    inflate(inf_stream, Z_FINISH);
+    if(inf_stream->total_in != compressed_size ||
+       inf_stream->total_out != raw_len)
+    {
+        err("Failed to decompress all data\n");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+int __ztrs_parse_codec(struct backend_trs_arg *arg, char *name)
+{
+    char *tok, *level_tok = NULL, *end;
+    long level = -1;
+
+    // name is "path [codec [level]]". tokens are only taken off the end
+    // if they make up a whole codec spec, so paths may contain spaces
+    tok = strrchr(name, ' ');
+    if(tok && tok[1] >= '0' && tok[1] <= '9')
+    {
+        level = strtol(tok + 1, &end, 10);
+        if(*end == '\0')
+        {
+            level_tok = tok;
+            *level_tok = '\0';
+            tok = strrchr(name, ' ');
+        }
+        else level = -1;
+    }
+
+    if(tok && strcmp(tok + 1, "deflate") == 0)
+        arg->codec = ZTRS_CODEC_DEFLATE;
+    else if(tok && strcmp(tok + 1, "fast") == 0)
+    {
+        arg->codec = ZTRS_CODEC_DEFLATE;
+        arg->level = Z_BEST_SPEED;
+    }
+    else if(tok && strcmp(tok + 1, "delta") == 0)
+        arg->codec = ZTRS_CODEC_DELTA;
+    else
+    {
+        // no codec, so a trailing number is part of the path
+        if(level_tok)
+            *level_tok = ' ';
+
+        return 0;
+    }
+
+    if(level >= 0)
+    {
+        if(arg->codec == ZTRS_CODEC_DEFLATE && level > Z_BEST_COMPRESSION)
+        {
+            err("Invalid deflate level %li\n", level);
+            return -EINVAL;
+        }
+
+        arg->level = (int) level;
+    }
+
+    *tok = '\0';
+    return 0;
+}
+
+/*
+ * Sequential reads of a compressed set are bound by single-stream
+ * zlib. To get around this, reads of trace i queue up the following
+ * traces into a ring of prefetch slots, which a small pool of workers
+ * reads and inflates in the background. A later read of a trace that
+ * is already inflated (or in progress) only has to copy and expand it.
+ */
+
+#define ZTRS_PREFETCH_DEPTH     32
+#define ZTRS_PREFETCH_THREADS   4
+#define ZTRS_PREFETCH_BYTES     (256 * 1024 * 1024)
+
+struct ztrs_slot
+{
+    enum
+    {
+        SLOT_EMPTY, SLOT_QUEUED, SLOT_BUSY,
+        SLOT_READY, SLOT_COPYING
+    } state;
+
+    size_t index;
+    int waiters;
+    LT_SEM_TYPE done;
+
+    char *title;
+    uint8_t *data;
+    void *raw;
+};
+
+struct ztrs_prefetch
+{
+    bool running;
+    LT_SEM_TYPE lock, work;
+
+    size_t depth;
+    struct ztrs_slot *slots;
+    LT_THREAD_TYPE workers[ZTRS_PREFETCH_THREADS];
+};
+
+int __ztrs_read_record(struct trace_set *ts, size_t index, z_stream *inf_stream,
+                       void **compressed, size_t *compressed_len,
+                       char *title, uint8_t *data, void *raw)
+{
+    int ret;
+    uint64_t offset;
+    uint32_t compressed_size;
+    void *grown;
+
+    // only the index needs the lock, the reads themselves are positional
+    sem_acquire(&TRS_ARG(ts)->file_lock);
+    ret = __ztrs_find_trace(ts, index, &offset);
+    sem_release(&TRS_ARG(ts)->file_lock);
+
+    if(ret < 0)
+    {
+        err("Failed to find trace %zu\n", index);
+        return ret;
+    }
+
+    ret = p_pread(TRS_ARG(ts)->file, &compressed_size, sizeof(uint32_t), offset);
+    if(ret < 0)
+    {
+        err("Failed to read compressed size for trace %zu\n", index);
+        return ret;
+    }
+
+    offset += sizeof(uint32_t);
+    if(compressed_size > *compressed_len)
+    {
+        grown = realloc(*compressed, compressed_size);
+        if(!grown)
+        {
+            err("Failed to allocate memory for compressed data\n");
+            return -ENOMEM;
+        }
+
+        *compressed = grown;
+        *compressed_len = compressed_size;
+    }
+
+    ret = p_pread(TRS_ARG(ts)->file, title, ts->title_size, offset);
+    if(ret < 0)
+    {
+        err("Failed to read title from file\n");
+        return ret;
+    }
+
+    offset += ts->title_size;
+    ret = p_pread(TRS_ARG(ts)->file, data, ts->data_size, offset);
+    if(ret < 0)
+    {
+        err("Failed to read data from file\n");
+        return ret;
+    }
+
+    offset += ts->data_size;
+    ret = p_pread(TRS_ARG(ts)->file, *compressed, compressed_size, offset);
+    if(ret < 0)
+    {
+        err("Failed to read compressed samples from file\n");
+        return ret;
+    }
+
+    ret = __ztrs_decompress(ts, inf_stream, *compressed, compressed_size, raw);
+    if(ret < 0)
+    {
+        err("Failed to decompress samples for trace %zu\n", index);
+        return ret;
+    }
+
+    return 0;
+}
+
+LT_THREAD_FUNC(__ztrs_prefetch_worker, worker_arg)
+{
+    int ret, i;
+    struct trace_set *ts = worker_arg;
+    struct ztrs_prefetch *pf = TRS_ARG(ts)->prefetch;
+    struct ztrs_slot *slot;
+
+    void *compressed = NULL;
+    size_t compressed_len = 0;
 
-    debug("Reading trace %zu, with %zu traces written\n",
-          TRACE_IDX(t), TRS_ARG(t->owner)->num_written);
+    z_stream inf_stream = {
+            .zalloc = Z_NULL,
+            .zfree = Z_NULL,
+            .opaque = Z_NULL
+    };
+
+    if(inflateInit(&inf_stream) != Z_OK)
+    {
+        err("Failed to initialize inflate stream for prefetch worker\n");
+        return NULL;
+    }
 
     while(1)
     {
-        debug("Seek for trace %zu at position %zu, pos %li\n", TRACE_IDX(t),
-              TRS_ARG(t->owner)->position, p_ftell(TRS_ARG(t->owner)->file));
+        sem_acquire(&pf->work);
+        sem_acquire(&pf->lock);
+        if(!pf->running)
+        {
+            sem_release(&pf->lock);
+            break;
+        }
 
-        read = p_fread(&last_size, sizeof(uint32_t), 1, TRS_ARG(t->owner)->file);
-        if(read != 1)
+        // lowest queued trace first, as it will be needed soonest
+        slot = NULL;
+        for(i = 0; i < pf->depth; i++)
         {
-            err("Trace %zu: Failed to read last size from file at position %zu\n",
-                TRACE_IDX(t), TRS_ARG(t->owner)->position);
-            return -EIO;
+            if(pf->slots[i].state == SLOT_QUEUED &&
+               (!slot || pf->slots[i].index < slot->index))
+                slot = &pf->slots[i];
         }
 
-        if(TRACE_IDX(t) < TRS_ARG(t->owner)->position)
+        if(!slot)
         {
-            ret = p_fseek(TRS_ARG(t->owner)->file,
-                          (long) (-1 * (t->owner->title_size + t->owner->data_size +
-                                        last_size + 3 * sizeof(uint32_t))), SEEK_CUR);
-            if(ret < 0)
-            {
-                err("Failed to seek file to previous trace\n");
-                return -EIO;
-            }
+            sem_release(&pf->lock);
+            continue;
+        }
 
-            debug("Decreasing position pointer from %zu\n", TRS_ARG(t->owner)->position);
-            TRS_ARG(t->owner)->position--;
+        slot->state = SLOT_BUSY;
+        sem_release(&pf->lock);
+
+        ret = __ztrs_read_record(ts, slot->index, &inf_stream,
+                                 &compressed, &compressed_len,
+                                 slot->title, slot->data, slot->raw);
+        if(ret < 0)
+            warn("Failed to prefetch trace %zu\n", slot->index);
+
+        // failed slots are just dropped, and the reader retries itself
+        sem_acquire(&pf->lock);
+        slot->state = (ret < 0) ? SLOT_EMPTY : SLOT_READY;
+        for(; slot->waiters > 0; slot->waiters--)
+            sem_release(&slot->done);
+        sem_release(&pf->lock);
+    }
+
+    inflateEnd(&inf_stream);
+    free(compressed);
+    return NULL;
+}
+
+void __ztrs_prefetch_schedule(struct trace_set *ts, size_t index)
+{
+    int queued = 0;
+    size_t i;
+    struct ztrs_prefetch *pf = TRS_ARG(ts)->prefetch;
+    struct ztrs_slot *slot;
+
+    sem_acquire(&pf->lock);
+    for(i = index + 1; i < index + pf->depth && i < ts->num_traces; i++)
+    {
+        // slots only move forward, so traces which were already handed
+        // out (or queued by a reader further ahead) are left alone
+        slot = &pf->slots[i % pf->depth];
+        if(slot->index != -1 && slot->index >= i)
+            continue;
+
+        // somebody is still using this slot
+        if(slot->state == SLOT_BUSY || slot->state == SLOT_COPYING ||
+           slot->waiters > 0)
             continue;
+
+        if(slot->state != SLOT_QUEUED)
+            queued++;
+
+        slot->index = i;
+        slot->state = SLOT_QUEUED;
+    }
+    sem_release(&pf->lock);
+
+    for(; queued > 0; queued--)
+        sem_release(&pf->work);
+}
+
+int __ztrs_prefetch_get(struct trace_set *ts, size_t index,
+                        char *title, uint8_t *data, float *samples)
+{
+    int ret;
+    struct ztrs_prefetch *pf = TRS_ARG(ts)->prefetch;
+    struct ztrs_slot *slot = &pf->slots[index % pf->depth];
+
+    sem_acquire(&pf->lock);
+    while(slot->index == index &&
+          (slot->state == SLOT_QUEUED || slot->state == SLOT_BUSY))
+    {
+        slot->waiters++;
+        sem_release(&pf->lock);
+        sem_acquire(&slot->done);
+        sem_acquire(&pf->lock);
+    }
+
+    if(slot->index != index || slot->state != SLOT_READY)
+    {
+        sem_release(&pf->lock);
+        return 0;
+    }
+
+    slot->state = SLOT_COPYING;
+    sem_release(&pf->lock);
+
+    if(title)
+        memcpy(title, slot->title, ts->title_size);
+
+    if(data)
+        memcpy(data, slot->data, ts->data_size);
+
+    ret = expand_samples(ts->datatype, ts->yscale,
+                         slot->raw, samples, ts->num_samples);
+
+    sem_acquire(&pf->lock);
+    slot->state = SLOT_EMPTY;
+    sem_release(&pf->lock);
+
+    return (ret < 0) ? ret : 1;
+}
+
+void __ztrs_prefetch_free(struct trace_set *ts)
+{
+    int i;
+    struct ztrs_prefetch *pf = TRS_ARG(ts)->prefetch;
+
+    if(!pf)
+        return;
+
+    if(pf->running)
+    {
+        sem_with(&pf->lock, pf->running = false);
+        for(i = 0; i < ZTRS_PREFETCH_THREADS; i++)
+            sem_release(&pf->work);
+
+        for(i = 0; i < ZTRS_PREFETCH_THREADS; i++)
+            p_thread_join(pf->workers[i]);
+    }
+
+    if(pf->slots)
+    {
+        for(i = 0; i < pf->depth; i++)
+        {
+            p_sem_destroy(&pf->slots[i].done);
+            free(pf->slots[i].title);
+            free(pf->slots[i].data);
+            free(pf->slots[i].raw);
+        }
+
+        free(pf->slots);
+    }
+
+    p_sem_destroy(&pf->work);
+    p_sem_destroy(&pf->lock);
+    free(pf);
+    TRS_ARG(ts)->prefetch = NULL;
+}
+
+int __ztrs_prefetch_init(struct trace_set *ts)
+{
+    int ret, i;
+    size_t depth, raw_len;
+    struct ztrs_prefetch *pf;
+
+    raw_len = (ts->datatype & 0xF) * ts->num_samples;
+    depth = ZTRS_PREFETCH_BYTES / (raw_len + ts->title_size + ts->data_size);
+    if(depth > ZTRS_PREFETCH_DEPTH)
+        depth = ZTRS_PREFETCH_DEPTH;
+
+    if(depth < 2 || ts->num_traces < 2)
+    {
+        debug("Not prefetching for %s\n", TRS_ARG(ts)->name);
+        return 0;
+    }
+
+    pf = calloc(1, sizeof(struct ztrs_prefetch));
+    if(!pf)
+    {
+        err("Failed to allocate prefetch state\n");
+        return -ENOMEM;
+    }
+
+    TRS_ARG(ts)->prefetch = pf;
+    pf->depth = depth;
+
+    ret = p_sem_create(&pf->lock, 1);
+    if(ret < 0)
+    {
+        err("Failed to create prefetch lock\n");
+        free(pf);
+        TRS_ARG(ts)->prefetch = NULL;
+        return -EINVAL;
+    }
+
+    ret = p_sem_create(&pf->work, 0);
+    if(ret < 0)
+    {
+        err("Failed to create prefetch work semaphore\n");
+        p_sem_destroy(&pf->lock);
+        free(pf);
+        TRS_ARG(ts)->prefetch = NULL;
+        return -EINVAL;
+    }
+
+    pf->slots = calloc(depth, sizeof(struct ztrs_slot));
+    if(!pf->slots)
+    {
+        err("Failed to allocate prefetch slots\n");
+        ret = -ENOMEM;
+        goto __free_prefetch;
+    }
+
+    for(i = 0; i < depth; i++)
+    {
+        pf->slots[i].state = SLOT_EMPTY;
+        pf->slots[i].index = -1;
+
+        ret = p_sem_create(&pf->slots[i].done, 0);
+        if(ret < 0)
+        {
+            err("Failed to create prefetch slot semaphore\n");
+            pf->depth = i;
+            ret = -EINVAL;
+            goto __free_prefetch;
         }
 
-        read = p_fread(&this_size, sizeof(uint32_t), 1, TRS_ARG(t->owner)->file);
-        if(read != 1)
+        // title and data might be zero-length
+        pf->slots[i].title = calloc(ts->title_size + 1, sizeof(char));
+        pf->slots[i].data = calloc(ts->data_size + 1, sizeof(uint8_t));
+        pf->slots[i].raw = calloc(raw_len, sizeof(uint8_t));
+        if(!pf->slots[i].title || !pf->slots[i].data || !pf->slots[i].raw)
         {
-            err("Trace %zu: Failed to read last size from file at position %zu\n",
-                TRACE_IDX(t), TRS_ARG(t->owner)->position);
-            return -EIO;
+            err("Failed to allocate prefetch slot buffers\n");
+            pf->depth = i + 1;
+            ret = -ENOMEM;
+            goto __free_prefetch;
         }
+    }
 
-        if(TRACE_IDX(t) > TRS_ARG(t->owner)->position)
+    pf->running = true;
+    for(i = 0; i < ZTRS_PREFETCH_THREADS; i++)
+    {
+        ret = p_thread_create(&pf->workers[i], __ztrs_prefetch_worker, ts);
+        if(ret < 0)
         {
-            ret = p_fseek(TRS_ARG(t->owner)->file,
-                          (long) (t->owner->title_size + t->owner->data_size + this_size),
-                          SEEK_CUR);
-            if(ret < 0)
-            {
-                err("Failed to seek file to next trace\n");
-                return -EIO;
-            }
+            err("Failed to create prefetch worker\n");
+
+            sem_with(&pf->lock, pf->running = false);
+            for(ret = 0; ret < ZTRS_PREFETCH_THREADS; ret++)
+                sem_release(&pf->work);
+
+            for(; i > 0; i--)
+                p_thread_join(pf->workers[i - 1]);
 
-            debug("Advancing position pointer from %zu\n", TRS_ARG(t->owner)->position);
-            TRS_ARG(t->owner)->position++;
+            ret = -EINVAL;
+            goto __free_prefetch;
         }
-        else
+    }
+
+    debug("Prefetching %zu traces ahead for %s\n", depth, TRS_ARG(ts)->name);
+    return 0;
+
+__free_prefetch:
+    __ztrs_prefetch_free(ts);
+    return ret;
+}
+
+int backend_ztrs_open(struct trace_set *ts)
+{
+    int ret;
+
+    // the file says which codec it uses, not the backend string
+    TRS_ARG(ts)->codec = ZTRS_CODEC_NONE;
+    ret = backend_trs_open(ts);
+    if(ret < 0)
+    {
+        err("Failed to open underlying trace set\n");
+        return ret;
+    }
+
+    // files written before the codec header are always deflate
+    if(TRS_ARG(ts)->codec == ZTRS_CODEC_NONE)
+    {
+        TRS_ARG(ts)->codec = ZTRS_CODEC_DEFLATE;
+        TRS_ARG(ts)->level = ZTRS_DEFAULT_LEVEL;
+    }
+
+    ret = __ztrs_load_index(ts);
+    if(ret < 0)
+    {
+        err("Failed to load trace offset index\n");
+        return ret;
+    }
+
+    // seed the walk with the first trace, after the initial -1 size
+    if(TRS_ARG(ts)->num_offsets == 0 && ts->num_traces > 0)
+    {
+        ret = __ztrs_push_offset(ts, TRS_ARG(ts)->trace_start + sizeof(uint32_t));
+        if(ret < 0)
         {
-            // We are now at the correct trace position
-            *size = this_size;
-            return 0;
+            err("Failed to initialize trace offset index\n");
+            return ret;
         }
+    }
+
+    TRS_ARG(ts)->loaded_offsets = TRS_ARG(ts)->num_offsets;
+
+    ret = __ztrs_prefetch_init(ts);
+    if(ret < 0)
+    {
+        err("Failed to initialize trace prefetching\n");
+        return ret;
+    }
 
-        debug("Seek for trace %zu changed to @ %li\n", TRACE_IDX(t), p_ftell(TRS_ARG(t->owner)->file));
+    return 0;
+}
+
+int backend_ztrs_create(struct trace_set *ts)
+{
+    if(TRS_ARG(ts)->codec == ZTRS_CODEC_DELTA &&
+       ts->datatype != DT_BYTE && ts->datatype != DT_SHORT)
+    {
+        err("Delta codec is only supported for byte and short samples\n");
+        return -EINVAL;
+    }
+
+    TRS_ARG(ts)->num_offsets = 0;
+    return backend_trs_create(ts);
+}
+
+int backend_ztrs_close(struct trace_set *ts)
+{
+    int ret;
+
+    __ztrs_prefetch_free(ts);
+
+    // only bother writing the index if we learned something new
+    if(TRS_ARG(ts)->file &&
+       (TRS_ARG(ts)->mode == MODE_WRITE ||
+        TRS_ARG(ts)->num_offsets > TRS_ARG(ts)->loaded_offsets))
+    {
+        ret = __ztrs_store_index(ts);
+        if(ret < 0)
+            warn("Failed to store trace offset index for %s\n", TRS_ARG(ts)->name);
     }
+
+    free(TRS_ARG(ts)->offsets);
+    return backend_trs_close(ts);
 }
 
 int backend_ztrs_read(struct trace *t)
 {
-    int ret, i;
-    size_t read;
-    uint32_t compressed_size;
+    int ret;
+    size_t compressed_len = 0;
 
     char *result_title = NULL;
     uint8_t *result_data = NULL;
     float *result_samples = NULL;
-    void *temp = NULL, *compressed = NULL;
+    void *temp, *compressed = NULL;
 
     z_stream inf_stream = {
             .zalloc = Z_NULL,
@@ -101,7 +996,7 @@ int backend_ztrs_read(struct trace *t)
 
     if(t->owner->title_size)
     {
-        result_title = calloc(1, t->owner->title_size);
+        result_title = tp_alloc(t->owner, POOL_TITLE, t->owner->title_size);
         if(!result_title)
         {
             err("Failed to allocate memory for trace title\n");
@@ -112,7 +1007,7 @@ int backend_ztrs_read(struct trace *t)
 
     if(t->owner->data_size)
     {
-        result_data = calloc(1, t->owner->data_size);
+        result_data = tp_alloc(t->owner, POOL_DATA, t->owner->data_size);
         if(!result_data)
         {
             err("Failed to allocate memory for trace data\n");
@@ -123,15 +1018,7 @@ int backend_ztrs_read(struct trace *t)
 
     if(t->owner->num_samples)
     {
-        temp = calloc(t->owner->datatype & 0xF, t->owner->num_samples);
-        if(!temp)
-        {
-            err("Failed to allocate memory for temp sample buffer\n");
-            ret = -ENOMEM;
-            goto __fail;
-        }
-
-        result_samples = calloc(sizeof(float), t->owner->num_samples);
+        result_samples = tp_alloc(t->owner, POOL_SAMPLES, t->owner->num_samples * sizeof(float));
         if(!result_samples)
         {
             err("Failed to allocate memory for sample buffer\n");
@@ -140,114 +1027,64 @@ int backend_ztrs_read(struct trace *t)
         }
     }
 
-    sem_acquire(&TRS_ARG(t->owner)->file_lock);
-    ret = __seek_to_trace(t, &compressed_size);
-    if(ret < 0)
-    {
-        err("Failed to seek to trace\n");
-        goto __fail_unlock;
-    }
-
-    compressed = calloc(compressed_size, sizeof(uint8_t));
-    if(!compressed)
+    if(TRS_ARG(t->owner)->prefetch)
     {
-        err("Failed to allocate memory for compressed data\n");
-        goto __fail_unlock;
-    }
+        ret = __ztrs_prefetch_get(t->owner, TRACE_IDX(t),
+                                  result_title, result_data, result_samples);
+        __ztrs_prefetch_schedule(t->owner, TRACE_IDX(t));
 
-    read = p_fread(result_title, 1, t->owner->title_size, TRS_ARG(t->owner)->file);
-    if(read != t->owner->title_size)
-    {
-        err("Failed to read title from file (read %zu expecting %zu)\n",
-            read, t->owner->title_size);
-        ret = -EIO;
-        goto __fail_unlock;
+        if(ret < 0)
+        {
+            err("Failed to expand prefetched trace\n");
+            goto __fail;
+        }
+        else if(ret == 1)
+            goto __done;
     }
 
-    read = p_fread(result_data, 1, t->owner->data_size, TRS_ARG(t->owner)->file);
-    if(read != t->owner->data_size)
+    // not prefetched, so read and inflate it ourselves
+    temp = p_thread_scratch((t->owner->datatype & 0xF) * t->owner->num_samples);
+    if(!temp)
     {
-        err("Failed to read data from file (read %zu expecting %zu)\n",
-            read, t->owner->data_size);
-        ret = -EIO;
-        goto __fail_unlock;
+        err("Failed to allocate memory for temp sample buffer\n");
+        ret = -ENOMEM;
+        goto __fail;
     }
 
-    read = p_fread(compressed, 1, compressed_size, TRS_ARG(t->owner)->file);
-    if(read != compressed_size)
+    if(inflateInit(&inf_stream) != Z_OK)
     {
-        err("Failed to read compressed samples from file (read %zu expecting %i)\n",
-            read, compressed_size);
-        ret = -EIO;
-        goto __fail_unlock;
+        err("Failed to initialize inflate stream\n");
+        ret = -ENOMEM;
+        goto __fail;
     }
 
-    // leaving the file pointer in place for the next position
-    TRS_ARG(t->owner)->position++;
-
-    debug("Read for trace %zu leaving file @ %li\n", TRACE_IDX(t), p_ftell(TRS_ARG(t->owner)->file));
-    sem_release(&TRS_ARG(t->owner)->file_lock);
-
-    // decompress the samples
-    inf_stream.avail_in = compressed_size;
-    inf_stream.next_in = (Bytef *) compressed;
-    inf_stream.avail_out = (t->owner->datatype & 0xF) * t->owner->num_samples;
-    inf_stream.next_out = (Bytef *) temp;
-
-    inflateInit(&inf_stream);
-    inflate(&inf_stream, Z_NO_FLUSH);
+    ret = __ztrs_read_record(t->owner, TRACE_IDX(t), &inf_stream,
+                             &compressed, &compressed_len,
+                             result_title, result_data, temp);
     inflateEnd(&inf_stream);
+    free(compressed);
 
-    if(inf_stream.total_in != compressed_size ||
-       inf_stream.total_out != (t->owner->datatype & 0xF) * t->owner->num_samples)
+    if(ret < 0)
     {
-        err("Failed to decompress all data\n");
-        ret = -EINVAL;
+        err("Failed to read trace %zu\n", TRACE_IDX(t));
         goto __fail;
     }
 
-    free(compressed);
-    compressed = NULL;
-
     // expand samples
-    switch(t->owner->datatype)
+    ret = expand_samples(t->owner->datatype, t->owner->yscale,
+                         temp, result_samples, t->owner->num_samples);
+    if(ret < 0)
     {
-        case DT_BYTE:
-            for(i = 0; i < t->owner->num_samples; i++)
-                result_samples[i] = t->owner->yscale * (float) ((char *) temp)[i];
-            break;
-
-        case DT_SHORT:
-            for(i = 0; i < t->owner->num_samples; i++)
-                result_samples[i] = t->owner->yscale * (float) ((short *) temp)[i];
-            break;
-
-        case DT_INT:
-            for(i = 0; i < t->owner->num_samples; i++)
-                result_samples[i] = t->owner->yscale * (float) ((int *) temp)[i];
-            break;
-
-        case DT_FLOAT:
-            for(i = 0; i < t->owner->num_samples; i++)
-                result_samples[i] = t->owner->yscale * ((float *) temp)[i];
-            break;
-
-        case DT_NONE:
-        err("Invalid trace data type: %i\n", t->owner->datatype);
-            goto __fail;
+        err("Failed to expand samples\n");
+        goto __fail;
     }
 
-    free(temp);
-    temp = NULL;
-
+__done:
     t->title = result_title;
     t->data = result_data;
     t->samples = result_samples;
     return 0;
 
-__fail_unlock:
-    sem_release(&TRS_ARG(t->owner)->file_lock);
-
 __fail:
     if(result_title)
         free(result_title);
@@ -255,12 +1092,6 @@ __fail:
     if(result_data)
         free(result_data);
 
-    if(compressed)
-        free(compressed);
-
-    if(temp)
-        free(temp);
-
     if(result_samples)
         free(result_samples);
 
@@ -269,19 +1100,14 @@ __fail:
 
 int backend_ztrs_write(struct trace *t)
 {
-    int i, ret;
+    int ret;
     size_t written;
     uint32_t compressed_size, first_size;
+    long offset;
 
-    size_t temp_len;
+    size_t temp_len, bound, packed_size;
     void *temp = NULL, *compressed = NULL;
 
-    z_stream def_stream = {
-            .zalloc = Z_NULL,
-            .zfree = Z_NULL,
-            .opaque = Z_NULL
-    };
-
     if(!t)
     {
         err("Invalid trace\n");
@@ -294,92 +1120,45 @@ int backend_ztrs_write(struct trace *t)
         return -EINVAL;
     }
 
-    switch(t->owner->datatype)
-    {
-        case DT_BYTE:
-            temp_len = ts_num_samples(t->owner) * sizeof(char);
-            temp = calloc(t->owner->num_samples, sizeof(char));
-            if(!temp) break;
-
-            compressed = calloc(t->owner->num_samples, sizeof(char));
-            if(!compressed) break;
-
-            for(i = 0; i < ts_num_samples(t->owner); i++)
-                ((char *) temp)[i] =
-                        (char) (t->samples[i] / t->owner->yscale);
-            break;
-
-        case DT_SHORT:
-            temp_len = ts_num_samples(t->owner) * sizeof(short);
-            temp = calloc(t->owner->num_samples, sizeof(short));
-            if(!temp) break;
-
-            compressed = calloc(t->owner->num_samples, sizeof(short));
-            if(!compressed) break;
-
-            for(i = 0; i < ts_num_samples(t->owner); i++)
-                ((short *) temp)[i] =
-                        (short) (t->samples[i] / t->owner->yscale);
-            break;
-
-        case DT_INT:
-            temp_len = ts_num_samples(t->owner) * sizeof(int);
-            temp = calloc(t->owner->num_samples, sizeof(int));
-            if(!temp) break;
-
-            compressed = calloc(t->owner->num_samples, sizeof(int));
-            if(!compressed) break;
-
-            for(i = 0; i < ts_num_samples(t->owner); i++)
-                ((int *) temp)[i] =
-                        (int) (t->samples[i] / t->owner->yscale);
-            break;
-
-        case DT_FLOAT:
-            temp_len = ts_num_samples(t->owner) * sizeof(float);
-            temp = calloc(t->owner->num_samples, sizeof(float));
-            if(!temp) break;
-
-            compressed = calloc(t->owner->num_samples, sizeof(float));
-            if(!compressed) break;
-
-            for(i = 0; i < ts_num_samples(t->owner); i++)
-                ((float *) temp)[i] =
-                        (t->samples[i] / t->owner->yscale);
-            break;
-
-        case DT_NONE:
-        default:
-        err("Bad trace set datatype %i\n", t->owner->datatype);
-            return -EINVAL;
-    }
-
-    if(!temp || !compressed)
+    temp_len = (t->owner->datatype & 0xF) * t->owner->num_samples;
+    temp = calloc(1, temp_len);
+    if(!temp)
     {
         err("Failed to allocate temporary memory\n");
         return -ENOMEM;
     }
 
-    def_stream.avail_in = temp_len;
-    def_stream.next_in = (Bytef *) temp;
-    def_stream.avail_out = temp_len;
-    def_stream.next_out = (Bytef *) compressed;
+    if(t->samples)
+    {
+        ret = pack_samples(t->owner->datatype, t->owner->yscale,
+                           t->samples, temp, t->owner->num_samples);
+        if(ret < 0)
+        {
+            err("Failed to pack samples for trace %zu\n", TRACE_IDX(t));
+            goto __free_temp;
+        }
+    }
 
-    deflateInit(&def_stream, Z_BEST_COMPRESSION);
-    deflate(&def_stream, Z_FINISH);
-    deflateEnd(&def_stream);
+    bound = __ztrs_compress_bound(t->owner, temp_len);
+    compressed = calloc(bound, sizeof(uint8_t));
+    if(!compressed)
+    {
+        err("Failed to allocate memory for compressed samples\n");
+        ret = -ENOMEM;
+        goto __free_temp;
+    }
 
-    if(def_stream.total_in != temp_len)
+    ret = __ztrs_compress(t->owner, temp, temp_len, compressed, bound, &packed_size);
+    if(ret < 0)
     {
-        err("Failed to compress all data\n");
-        ret = -EINVAL;
+        err("Failed to compress samples for trace %zu\n", TRACE_IDX(t));
         goto __free_temp;
     }
 
     debug("Compressed trace %zu by %f\n", TRACE_IDX(t),
-          (float) def_stream.total_out / (float) def_stream.total_in);
+          (float) packed_size / (float) temp_len);
 
-    compressed_size = def_stream.total_out;
+    compressed_size = (uint32_t) packed_size;
     sem_acquire(&TRS_ARG(t->owner)->file_lock);
     ret = p_fseek(TRS_ARG(t->owner)->file, 0, SEEK_END);
     if(ret)
@@ -403,6 +1182,14 @@ int backend_ztrs_write(struct trace *t)
         }
     }
 
+    offset = p_ftell(TRS_ARG(t->owner)->file);
+    if(offset < 0)
+    {
+        err("Failed to get trace position in file\n");
+        ret = -EIO;
+        goto __unlock;
+    }
+
     // this size
     written = p_fwrite(&compressed_size, sizeof(uint32_t), 1, TRS_ARG(t->owner)->file);
     if(written != 1)
@@ -420,7 +1207,7 @@ int backend_ztrs_write(struct trace *t)
         {
             err("Failed to write all bytes of title to file\n");
             ret = -EIO;
-            goto __free_temp;
+            goto __unlock;
         }
     }
 
@@ -432,7 +1219,7 @@ int backend_ztrs_write(struct trace *t)
         {
             err("Failed to write all bytes of data to file\n");
             ret = -EIO;
-            goto __free_temp;
+            goto __unlock;
         }
     }
 
@@ -442,7 +1229,7 @@ int backend_ztrs_write(struct trace *t)
     {
         err("Failed to write all bytes of samples to file\n");
         ret = -EIO;
-        goto __free_temp;
+        goto __unlock;
     }
 
     // prev size
@@ -456,6 +1243,13 @@ int backend_ztrs_write(struct trace *t)
 
     debug("Write for trace %zu ending @ %li\n", TRACE_IDX(t), p_ftell(TRS_ARG(t->owner)->file));
 
+    ret = __ztrs_push_offset(t->owner, (uint64_t) offset);
+    if(ret < 0)
+    {
+        err("Failed to add trace to offset index\n");
+        goto __unlock;
+    }
+
     // make number of traces agree
     TRS_ARG(t->owner)->num_written++;
     ret = finalize_headers(t->owner);
@@ -465,7 +1259,6 @@ int backend_ztrs_write(struct trace *t)
         goto __unlock;
     }
 
-    TRS_ARG(t->owner)->position = 0;
     p_fflush(TRS_ARG(t->owner)->file);
     ret = 0;
 __unlock:
@@ -488,9 +1281,9 @@ int create_backend_ztrs(struct trace_set *ts, const char *name)
         return -ENOMEM;
     }
 
-    res->open = backend_trs_open;
-    res->create = backend_trs_create;
-    res->close = backend_trs_close;
+    res->open = backend_ztrs_open;
+    res->create = backend_ztrs_create;
+    res->close = backend_ztrs_close;
     res->read = backend_ztrs_read;
     res->write = backend_ztrs_write;
 
@@ -509,7 +1302,18 @@ int create_backend_ztrs(struct trace_set *ts, const char *name)
     }
 
     strcpy(arg->name, name);
-    arg->position = 0;
+    arg->codec = ZTRS_CODEC_DEFLATE;
+    arg->level = ZTRS_DEFAULT_LEVEL;
+    if(__ztrs_parse_codec(arg, arg->name) < 0)
+    {
+        err("Failed to parse codec for %s\n", name);
+        free(arg->name);
+        goto __free_arg;
+    }
+
+    arg->offsets = NULL;
+    arg->num_offsets = 0;
+    arg->max_offsets = 0;
 
     res->arg = arg;
     ts->backend = res;
@@ -20,6 +20,7 @@ typedef enum header
     INPUT_OFFSET, OUTPUT_OFFSET, KEY_OFFSET, INPUT_LENGTH, OUTPUT_LENGTH, KEY_LENGTH,
     NUMBER_OF_ENABLED_CHANNELS, NUMBER_OF_USED_OSCILLOSCOPES,
     XY_SCAN_WIDTH, XY_SCAN_HEIGHT, XY_MEASUREMENTS_PER_SPOT,
+    ZTRS_CODEC = 0x7A, CTRS_BLOCK_TRACES, CTRS_TILE_SAMPLES,
 } header_t;
 
 static const char header_desc[][80] = {
@@ -68,6 +69,9 @@ static const char header_desc[][80] = {
         [XY_SCAN_WIDTH]                     = "Number of steps in the \"x\" direction during XY scan",
         [XY_SCAN_HEIGHT]                    = "Number of steps in the \"y\" direction during XY scan",
         [XY_MEASUREMENTS_PER_SPOT]          = "Number of consecutive measurements done per spot during XY scan",
+        [ZTRS_CODEC]                        = "Sample codec (and level) of a compressed trace set",
+        [CTRS_BLOCK_TRACES]                 = "Number of traces per block of a chunked trace set",
+        [CTRS_TILE_SAMPLES]                 = "Number of samples per tile of a chunked trace set",
 };
 
 #define __def_TH_INT   integer
@@ -156,6 +160,9 @@ static const struct th_def all_headers[] = {
         HEADER_NAME(XY_SCAN_WIDTH, 0x73, "WI", false, TH_INT, 4, 0),
         HEADER_NAME(XY_SCAN_HEIGHT, 0x74, "HE", false, TH_INT, 4, 0),
         HEADER_NAME(XY_MEASUREMENTS_PER_SPOT, 0x75, "ME", false, TH_INT, 4, 0),
+        HEADER_NAME(ZTRS_CODEC, 0x7A, "ZC", false, TH_INT, 4, 0),
+        HEADER_NAME(CTRS_BLOCK_TRACES, 0x7B, "BT", false, TH_INT, 4, 0),
+        HEADER_NAME(CTRS_TILE_SAMPLES, 0x7C, "BS", false, TH_INT, 4, 0),
 };
 
 #define TAG_LEN(tag)    all_headers[tag].len
@@ -174,34 +181,37 @@ struct th_data
     } val;
 };
 
-int __read_tag_and_len(FILE *ts_file, uint8_t *tag, uint32_t *actual_len)
+int __read_tag_and_len(FILE *ts_file, size_t *offs, uint8_t *tag, uint32_t *actual_len)
 {
+    int ret;
     uint8_t len;
-    size_t ret;
 
-    ret = fread(tag, 1, 1, ts_file);
-    if(ret != 1)
+    ret = p_pread(ts_file, tag, 1, *offs);
+    if(ret < 0)
     {
         err("Failed to read next tag from trace set file\n");
         return -EIO;
     }
 
-    ret = fread(&len, 1, 1, ts_file);
-    if(ret != 1)
+    ret = p_pread(ts_file, &len, 1, *offs + 1);
+    if(ret < 0)
     {
         err("Failed to read tag length from trace set file\n");
         return -EIO;
     }
 
+    *offs += 2;
     if(len & 0x80)
     {
         *actual_len = 0;
-        ret = fread(actual_len, 1, len & 0x7F, ts_file);
-        if(ret != (len & 0x7F))
+        ret = p_pread(ts_file, actual_len, len & 0x7F, *offs);
+        if(ret < 0)
         {
             err("Failed to read extended tag length from trace set file\n");
             return -EIO;
         }
+
+        *offs += len & 0x7F;
     }
     else *actual_len = len;
 
@@ -371,7 +381,7 @@ void ts_dump_headers(struct trace_set *ts)
 int __parse_headers(struct trace_set *ts)
 {
     int i, j, stat;
-    size_t ret;
+    size_t offs = 0;
 
     uint8_t tag;
     uint32_t actual_len;
@@ -395,7 +405,7 @@ int __parse_headers(struct trace_set *ts)
     debug("Parsing headers for trace set %zu\n", ts->set_id);
     for(i = 0; i < TRS_ARG(ts)->num_headers; i++)
     {
-        stat = __read_tag_and_len(TRS_ARG(ts)->file, &tag, &actual_len);
+        stat = __read_tag_and_len(TRS_ARG(ts)->file, &offs, &tag, &actual_len);
         if(stat < 0)
         {
             err("Failed to get next tag and length\n");
@@ -408,8 +418,8 @@ int __parse_headers(struct trace_set *ts)
             case TH_INT:
             case TH_FLT:
             case TH_BOOL:
-                ret = fread(&TRS_ARG(ts)->headers[i].val, 1, actual_len, TRS_ARG(ts)->file);
-                if(ret != actual_len)
+                stat = p_pread(TRS_ARG(ts)->file, &TRS_ARG(ts)->headers[i].val, actual_len, offs);
+                if(stat < 0)
                 {
                     err("Failed to read standard tag data from trace set file\n");
                     stat = -EIO;
@@ -427,8 +437,8 @@ int __parse_headers(struct trace_set *ts)
                     goto __fail;
                 }
 
-                ret = fread(TRS_ARG(ts)->headers[i].val.bytes, 1, actual_len, TRS_ARG(ts)->file);
-                if(ret != actual_len)
+                stat = p_pread(TRS_ARG(ts)->file, TRS_ARG(ts)->headers[i].val.bytes, actual_len, offs);
+                if(stat < 0)
                 {
                     err("Failed to read array tag data from trace set file\n");
                     stat = -EIO;
@@ -441,6 +451,7 @@ int __parse_headers(struct trace_set *ts)
                 return -EINVAL;
         }
 
+        offs += actual_len;
         if(tag == NUMBER_TRACES)
         {
             ts->num_traces = TRS_ARG(ts)->headers[i].val.integer;
@@ -484,6 +495,22 @@ int __parse_headers(struct trace_set *ts)
             ts->yscale = TRS_ARG(ts)->headers[i].val.floating;
             debug("Found y scale = %f\n", ts->yscale);
         }
+        else if(tag == ZTRS_CODEC)
+        {
+            TRS_ARG(ts)->codec = TRS_ARG(ts)->headers[i].val.integer & 0xFF;
+            TRS_ARG(ts)->level = TRS_ARG(ts)->headers[i].val.integer >> 8;
+            debug("Found codec = %i, level %i\n", TRS_ARG(ts)->codec, TRS_ARG(ts)->level);
+        }
+        else if(tag == CTRS_BLOCK_TRACES)
+        {
+            TRS_ARG(ts)->block_traces = (size_t) (uint32_t) TRS_ARG(ts)->headers[i].val.integer;
+            debug("Found traces per block = %zu\n", TRS_ARG(ts)->block_traces);
+        }
+        else if(tag == CTRS_TILE_SAMPLES)
+        {
+            TRS_ARG(ts)->tile_samples = (size_t) (uint32_t) TRS_ARG(ts)->headers[i].val.integer;
+            debug("Found samples per tile = %zu\n", TRS_ARG(ts)->tile_samples);
+        }
     }
 
     // others are okay to not have
@@ -495,7 +522,7 @@ int __parse_headers(struct trace_set *ts)
     }
 
     TRS_ARG(ts)->trace_length = ts->num_samples * (ts->datatype & 0xF) + ts->data_size + ts->title_size;
-    TRS_ARG(ts)->trace_start = ftell(TRS_ARG(ts)->file);
+    TRS_ARG(ts)->trace_start = offs;
     return 0;
 
 __fail:
@@ -519,8 +546,8 @@ __fail:
 int __num_headers(FILE *ts_file)
 {
     int count = 0, stat;
-    size_t ret, start;
-    uint8_t tag = 0, data[512];
+    size_t offs = 0;
+    uint8_t tag = 0;
     uint32_t actual_len;
 
     if(!ts_file)
@@ -529,10 +556,9 @@ int __num_headers(FILE *ts_file)
         return -EINVAL;
     }
 
-    start = ftell(ts_file);
     while(tag != TRACE_BLOCK)
     {
-        stat = __read_tag_and_len(ts_file, &tag, &actual_len);
+        stat = __read_tag_and_len(ts_file, &offs, &tag, &actual_len);
         count++;
 
         if(stat < 0)
@@ -541,28 +567,8 @@ int __num_headers(FILE *ts_file)
             return stat;
         }
 
-        if(actual_len > sizeof(data))
-        {
-            err("Tag length bigger than data buffer (Gregor can fix this)\n");
-            return -ENOMEM;
-        }
-
-        if(actual_len == 0)
-            continue;
-
-        ret = fread(data, 1, actual_len, ts_file);
-        if(ret != actual_len)
-        {
-            err("Failed to read tag data from trace set file\n");
-            return -EIO;
-        }
-    }
-
-    stat = fseek(ts_file, start, SEEK_SET);
-    if(stat != 0)
-    {
-        err("Failed to seek trace set file to start\n");
-        return -EIO;
+        // only the tags are needed here, skip over the data
+        offs += actual_len;
     }
 
     debug("Counted %i headers\n", count);
@@ -602,12 +608,24 @@ int read_headers(struct trace_set *ts)
         return ret;
     }
 
+    // headers were read positionally, so leave the stream where
+    // sequential readers expect the first trace to be
+    ret = p_fseek(TRS_ARG(ts)->file, TRS_ARG(ts)->trace_start, SEEK_SET);
+    if(ret)
+    {
+        err("Failed to seek trace set file to first trace\n");
+        free_headers(ts);
+        TRS_ARG(ts)->headers = NULL;
+        return -EIO;
+    }
+
     return 0;
 }
 
 int write_default_headers(struct trace_set *ts)
 {
-    int ret;
+    int ret, codec;
+    uint32_t geometry;
     if(!ts)
     {
         err("Invalid trace set\n");
@@ -628,6 +646,28 @@ int write_default_headers(struct trace_set *ts)
     if(ret == 0) ret = __write_tag_len_data(TRS_ARG(ts)->file, OFFSET_X, &ts->xoffs);
     if(ret == 0) ret = __write_tag_len_data(TRS_ARG(ts)->file, SCALE_X, &ts->xscale);
     if(ret == 0) ret = __write_tag_len_data(TRS_ARG(ts)->file, SCALE_Y, &ts->yscale);
+    if(ret == 0 && TRS_ARG(ts)->codec != ZTRS_CODEC_NONE)
+    {
+        codec = TRS_ARG(ts)->codec | (TRS_ARG(ts)->level << 8);
+        ret = __write_tag_len_data(TRS_ARG(ts)->file, ZTRS_CODEC, &codec);
+    }
+    if(ret == 0 && TRS_ARG(ts)->block_traces != 0)
+    {
+        // both tags are 4 bytes wide
+        if(TRS_ARG(ts)->block_traces > UINT32_MAX || TRS_ARG(ts)->tile_samples > UINT32_MAX)
+        {
+            err("Chunked trace set geometry doesn't fit in its header\n");
+            return -EINVAL;
+        }
+
+        geometry = (uint32_t) TRS_ARG(ts)->block_traces;
+        ret = __write_tag_len_data(TRS_ARG(ts)->file, CTRS_BLOCK_TRACES, &geometry);
+        if(ret == 0)
+        {
+            geometry = (uint32_t) TRS_ARG(ts)->tile_samples;
+            ret = __write_tag_len_data(TRS_ARG(ts)->file, CTRS_TILE_SAMPLES, &geometry);
+        }
+    }
     if(ret == 0) ret = __write_tag_len_data(TRS_ARG(ts)->file, TRACE_BLOCK, NULL);
     if(ret < 0)
     {
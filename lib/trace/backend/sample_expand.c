@@ -0,0 +1,152 @@
+#include "__trace_internal.h"
+#include "__backend_internal.h"
+#include "__avx_macros.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Widening loads for each of the on-disk sample types. Each one
+ * produces a vector of floats from the next 16/8/4 raw samples.
+ */
+
+#define expand_byte_512(ptr)                                \
+    _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(                \
+        _mm_loadu_si128((__m128i *) (ptr))))
+
+#define expand_byte_256(ptr)                                \
+    _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(                \
+        _mm_loadl_epi64((__m128i *) (ptr))))
+
+#define expand_byte_128(ptr)                                \
+    _mm_cvtepi32_ps(_mm_cvtepi8_epi32(                      \
+        _mm_cvtsi32_si128(__load_u32(ptr))))
+
+#define expand_short_512(ptr)                               \
+    _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(               \
+        _mm256_loadu_si256((__m256i *) (ptr))))
+
+#define expand_short_256(ptr)                               \
+    _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(               \
+        _mm_loadu_si128((__m128i *) (ptr))))
+
+#define expand_short_128(ptr)                               \
+    _mm_cvtepi32_ps(_mm_cvtepi16_epi32(                     \
+        _mm_loadl_epi64((__m128i *) (ptr))))
+
+#define expand_int_512(ptr)                                 \
+    _mm512_cvtepi32_ps(_mm512_loadu_si512((ptr)))
+
+#define expand_int_256(ptr)                                 \
+    _mm256_cvtepi32_ps(_mm256_loadu_si256((__m256i *) (ptr)))
+
+#define expand_int_128(ptr)                                 \
+    _mm_cvtepi32_ps(_mm_loadu_si128((__m128i *) (ptr)))
+
+#define expand_float_512(ptr)   _mm512_loadu_ps((ptr))
+#define expand_float_256(ptr)   _mm256_loadu_ps((ptr))
+#define expand_float_128(ptr)   _mm_loadu_ps((ptr))
+
+#define expand_store(type, out_ptr, expanded, scale_name)   \
+    avx_storeu_ps(type, out_ptr,                            \
+        avx_mul_ps(type, expanded,                          \
+            avx_var(type, scale_name)))
+
+static inline int __load_u32(const void *ptr)
+{
+    int res;
+    memcpy(&res, ptr, sizeof(int));
+    return res;
+}
+
+#define EXPAND_LOOP(in_type, name, in, out, n, yscale)                      \
+    for(i = 0; i < (n);)                                                    \
+    {                                                                       \
+        LOOP_HAVE_512(i, (n),                                               \
+            expand_store(AVX512, &(out)[i],                                 \
+                expand_ ## name ## _512(&((in_type *) (in))[i]), scale));   \
+                                                                            \
+        LOOP_HAVE_256(i, (n),                                               \
+            expand_store(AVX256, &(out)[i],                                 \
+                expand_ ## name ## _256(&((in_type *) (in))[i]), scale));   \
+                                                                            \
+        LOOP_HAVE_128(i, (n),                                               \
+            expand_store(AVX128, &(out)[i],                                 \
+                expand_ ## name ## _128(&((in_type *) (in))[i]), scale));   \
+                                                                            \
+        (out)[i] = (yscale) * (float) ((in_type *) (in))[i];                \
+        i++;                                                                \
+    }
+
+int expand_samples(datatype_t datatype, float yscale,
+                   void *in, float *out, size_t n)
+{
+    size_t i;
+
+    IF_HAVE_512(__m512 scale_512 = _mm512_set1_ps(yscale));
+    IF_HAVE_256(__m256 scale_256 = _mm256_set1_ps(yscale));
+    IF_HAVE_128(__m128 scale_ = _mm_set1_ps(yscale));
+
+    switch(datatype)
+    {
+        case DT_BYTE:
+            EXPAND_LOOP(int8_t, byte, in, out, n, yscale);
+            break;
+
+        case DT_SHORT:
+            EXPAND_LOOP(int16_t, short, in, out, n, yscale);
+            break;
+
+        case DT_INT:
+            EXPAND_LOOP(int32_t, int, in, out, n, yscale);
+            break;
+
+        case DT_FLOAT:
+            EXPAND_LOOP(float, float, in, out, n, yscale);
+            break;
+
+        case DT_NONE:
+        default:
+            err("Invalid trace data type: %i\n", datatype);
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+int pack_samples(datatype_t datatype, float yscale,
+                 float *in, void *out, size_t n)
+{
+    size_t i;
+
+    switch(datatype)
+    {
+        case DT_BYTE:
+            for(i = 0; i < n; i++)
+                ((int8_t *) out)[i] = (int8_t) (in[i] / yscale);
+            break;
+
+        case DT_SHORT:
+            for(i = 0; i < n; i++)
+                ((int16_t *) out)[i] = (int16_t) (in[i] / yscale);
+            break;
+
+        case DT_INT:
+            for(i = 0; i < n; i++)
+                ((int32_t *) out)[i] = (int32_t) (in[i] / yscale);
+            break;
+
+        case DT_FLOAT:
+            for(i = 0; i < n; i++)
+                ((float *) out)[i] = in[i] / yscale;
+            break;
+
+        case DT_NONE:
+        default:
+            err("Invalid trace data type: %i\n", datatype);
+            return -EINVAL;
+    }
+
+    return 0;
+}
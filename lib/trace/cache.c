@@ -6,25 +6,155 @@
 #include <stdlib.h>
 #include <string.h>
 
+// out of every set, how many ways may hold twice-referenced traces,
+// and how many evicted trace indices are remembered to detect reuse
+#define CACHE_2Q_PROTECTED(nways)   ((nways) - (nways) / 4)
+#define CACHE_2Q_GHOSTS(nways)      (2 * (nways))
+
+// per-way policy flags
+#define WAY_REFERENCED      (1 << 0)    // CLOCK: touched since the hand passed
+#define WAY_PROTECTED       (1 << 1)    // 2Q: hit at least once after insertion
+
+// slots per byte budget -- traces from filtering transforms are often
+// missing members, so more of them fit than full-sized estimates say
+#define CACHE_SLOT_OVERCOMMIT       2
+
+// stores between re-scoring the caches sharing a budget, and the
+// smallest share of it (1 / (N * caches)) a cache is squeezed down to
+#define BUDGET_EPOCH_STORES         1024
+#define BUDGET_MIN_SHARE            8
+
+// victims evicted under the list lock before it is dropped to retire them
+#define BUDGET_RETIRE_BATCH         64
+
+// spill file slots are grouped like cache sets, oldest write is replaced
+#define SPILL_WAYS                  4
+
+/*
+ * Byte budget for one or more caches. The real size of every stored
+ * trace is charged against it, and while it is exceeded traces are
+ * evicted from whichever attached cache is worth the least per byte --
+ * that is, the one whose hits save the least production time for the
+ * memory it holds. Capacity thereby drifts towards stages that are
+ * both expensive to recompute and actually reused.
+ *
+ * Lock order is list_lock, then any set lock, then lock.
+ */
+struct tc_budget
+{
+    LT_SEM_TYPE lock;
+    size_t limit, used;
+    size_t stores;
+
+    LT_SEM_TYPE list_lock;
+    struct trace_cache **caches;
+    size_t ncaches;
+};
+
+// shared by every cache created with ts_create_cache_shared
+static struct tc_budget *gbl_budget = NULL;
+
+/*
+ * Second tier for evicted traces: a scratch file of fixed-size slots,
+ * each holding one raw trace. The slots are split into groups of
+ * SPILL_WAYS by trace index, and a newer eviction overwrites whichever
+ * slot of its group was written longest ago.
+ */
+struct tc_spill
+{
+    LT_SEM_TYPE lock;
+    LT_FILE_TYPE *file;
+    char *path;
+
+    size_t slot_size, nslots, nways;
+    size_t *index;          // trace in each slot, or SIZE_MAX
+    uint8_t *fields;        // which of title/data/samples it had
+    uint64_t *stamp;        // when each slot was written
+    int *busy;              // readers of each slot, or -1 while written
+
+    // guarded by lock
+    size_t hits, misses, writes, failed;
+};
+
+/*
+ * Background reader for one cached trace set. Consumers report every
+ * index they ask for, and the thread produces the depth indices after
+ * the furthest one into the cache, then sleeps until demand moves on.
+ * A jump back past the window restarts it from the new index.
+ */
+struct tc_prefetch
+{
+    struct trace_set *ts;
+    size_t depth;
+
+    LT_THREAD_TYPE thread;
+    LT_SEM_TYPE wake;
+
+    // guarded by lock
+    LT_SEM_TYPE lock;
+    size_t demand, next;
+    bool running, sleeping, started;
+    size_t issued, failed;
+};
+
 struct trace_cache
 {
     size_t cache_id;
-    LT_SEM_TYPE cache_lock;
     size_t nsets, nways;
 
+    cache_policy_t policy;
+    bool hashed;
+
+    // may be shared with other caches, or NULL for slots only
+    struct tc_budget *budget;
+
+    // optional, where evicted traces go instead of being freed
+    struct tc_spill *spill;
+
+    // optional, reading ahead of the consumers
+    struct tc_prefetch *prefetch;
+
+    // bytes charged to the budget, guarded by the budget lock
+    size_t held;
+
+    // eviction state, guarded by the budget list_lock
+    size_t cur_set;
+    size_t last_hits, last_fills;
+    uint64_t last_fill_ns;
+    double miss_cost, value;
+    bool exhausted;
+
+    // all sets are initialized up front, so only the set lock is
+    // ever taken and lookups in different sets never contend
     struct tc_set
     {
-        bool initialized;
         LT_SEM_TYPE set_lock;
 
         bool *valid;
-        uint8_t *lru;
+        bool *pending;
+        size_t *index;
+        uint8_t *flags;
+        uint64_t *stamp;
         uint8_t *refcount;
+        size_t *bytes;
+        uint64_t *started;
         struct trace **traces;
-    } *sets;
 
-    size_t hits, misses, accesses;
-    size_t stores, evictions;
+        // threads blocked on an in-flight trace, per way
+        LT_SEM_TYPE *filled;
+        size_t *waiters;
+
+        // replacement state, guarded by set_lock
+        uint64_t tick;
+        size_t hand, nprotected;
+        size_t *ghosts, ghost_head;
+
+        // guarded by set_lock, summed when reporting
+        size_t hits, misses, accesses;
+        size_t stores, evictions, waits;
+        size_t fills, lock_waits;
+        uint64_t fill_ns, lock_wait_ns;
+    } *sets;
 };
 
 size_t __find_num_traces(struct trace_set *ts, size_t size_bytes, int assoc)
@@ -38,232 +168,1578 @@ size_t __find_num_traces(struct trace_set *ts, size_t size_bytes, int assoc)
         {
             mem_used += sizeof(struct tc_set);
             mem_used += assoc * sizeof(bool);           // valid
-            mem_used += assoc * sizeof(uint8_t);        // lru
+            mem_used += assoc * sizeof(bool);           // pending
+            mem_used += assoc * sizeof(size_t);         // index
+            mem_used += assoc * sizeof(uint8_t);        // flags
+            mem_used += assoc * sizeof(uint64_t);       // stamp
             mem_used += assoc * sizeof(uint8_t);        // refcount
+            mem_used += assoc * sizeof(size_t);         // bytes
+            mem_used += assoc * sizeof(uint64_t);       // started
             mem_used += assoc * sizeof(struct trace *); // traces
+            mem_used += assoc * sizeof(LT_SEM_TYPE);    // filled
+            mem_used += assoc * sizeof(size_t);         // waiters
         }
 
         mem_used += trace_size;
         ntraces++;
     }
 
-    critical("Cache for trace set %zu can fit %zu traces\n", ts->set_id, ntraces);
-    return ntraces;
+    critical("Cache for trace set %zu can fit %zu traces\n", ts->set_id, ntraces);
+    return ntraces;
+}
+
+// splitmix64 finalizer, so strided access patterns
+// don't all land in the same handful of sets
+static inline uint64_t __hash_index(uint64_t h)
+{
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static inline size_t __set_index(struct trace_cache *cache, size_t index)
+{
+    if(!cache->hashed)
+        return index % cache->nsets;
+
+    return __hash_index(index) % cache->nsets;
+}
+
+void __2q_protect(struct trace_cache *cache, struct tc_set *curr_set, int way)
+{
+    int i, oldest = -1;
+
+    curr_set->flags[way] |= WAY_PROTECTED;
+    curr_set->nprotected++;
+
+    if(curr_set->nprotected <= CACHE_2Q_PROTECTED(cache->nways))
+        return;
+
+    // protected segment is full, demote its oldest entry
+    for(i = 0; i < cache->nways; i++)
+    {
+        if(i == way || !(curr_set->flags[i] & WAY_PROTECTED))
+            continue;
+
+        if(oldest == -1 || curr_set->stamp[i] < curr_set->stamp[oldest])
+            oldest = i;
+    }
+
+    curr_set->flags[oldest] &= ~WAY_PROTECTED;
+    curr_set->nprotected--;
+}
+
+void __policy_hit(struct trace_cache *cache, struct tc_set *curr_set, int way)
+{
+    switch(cache->policy)
+    {
+        case CACHE_CLOCK:
+            curr_set->flags[way] |= WAY_REFERENCED;
+            break;
+
+        case CACHE_2Q:
+            curr_set->stamp[way] = ++curr_set->tick;
+            if(!(curr_set->flags[way] & WAY_PROTECTED))
+                __2q_protect(cache, curr_set, way);
+            break;
+
+        case CACHE_LRU:
+        default:
+            curr_set->stamp[way] = ++curr_set->tick;
+            break;
+    }
+}
+
+void __policy_insert(struct trace_cache *cache, struct tc_set *curr_set, int way, size_t index)
+{
+    int i;
+
+    curr_set->stamp[way] = ++curr_set->tick;
+    curr_set->flags[way] = (cache->policy == CACHE_CLOCK) ? WAY_REFERENCED : 0;
+
+    if(cache->policy != CACHE_2Q)
+        return;
+
+    /*
+     * A trace which was recently evicted from probation is being
+     * reused, so its reuse distance is longer than the set. Protect
+     * it if there is room, but never at the expense of an already
+     * protected trace -- otherwise a loop over a large trace set
+     * would cycle through the protected segment just like LRU.
+     */
+    for(i = 0; i < CACHE_2Q_GHOSTS(cache->nways); i++)
+    {
+        if(curr_set->ghosts[i] == index)
+        {
+            curr_set->ghosts[i] = SIZE_MAX;
+            if(curr_set->nprotected < CACHE_2Q_PROTECTED(cache->nways))
+                __2q_protect(cache, curr_set, way);
+            break;
+        }
+    }
+}
+
+void __policy_evict(struct trace_cache *cache, struct tc_set *curr_set, int way)
+{
+    if(cache->policy != CACHE_2Q)
+        return;
+
+    if(curr_set->flags[way] & WAY_PROTECTED)
+        curr_set->nprotected--;
+    else
+    {
+        // remember probationary evictions, so a reuse can be detected
+        curr_set->ghosts[curr_set->ghost_head] = curr_set->index[way];
+        curr_set->ghost_head = (curr_set->ghost_head + 1) % CACHE_2Q_GHOSTS(cache->nways);
+    }
+}
+
+int __policy_victim(struct trace_cache *cache, struct tc_set *curr_set)
+{
+    int i, pass, way = -1;
+
+    switch(cache->policy)
+    {
+        case CACHE_CLOCK:
+            // two sweeps clear every reference bit at most once
+            for(i = 0; i < 2 * cache->nways; i++)
+            {
+                way = (int) curr_set->hand;
+                curr_set->hand = (curr_set->hand + 1) % cache->nways;
+
+                if(!curr_set->valid[way] || curr_set->refcount[way] != 0)
+                    continue;
+
+                if(curr_set->flags[way] & WAY_REFERENCED)
+                    curr_set->flags[way] &= ~WAY_REFERENCED;
+                else return way;
+            }
+            return -1;
+
+        case CACHE_2Q:
+            // oldest probationary entry first, so a scan
+            // only ever displaces other scanned traces
+            for(pass = 0; way == -1 && pass < 2; pass++)
+            {
+                for(i = 0; i < cache->nways; i++)
+                {
+                    if(!curr_set->valid[i] || curr_set->refcount[i] != 0 ||
+                       !!(curr_set->flags[i] & WAY_PROTECTED) != pass)
+                        continue;
+
+                    if(way == -1 || curr_set->stamp[i] < curr_set->stamp[way])
+                        way = i;
+                }
+            }
+            return way;
+
+        case CACHE_LRU:
+        default:
+            for(i = 0; i < cache->nways; i++)
+            {
+                if(!curr_set->valid[i] || curr_set->refcount[i] != 0)
+                    continue;
+
+                if(way == -1 || curr_set->stamp[i] < curr_set->stamp[way])
+                    way = i;
+            }
+            return way;
+    }
+}
+
+int __initialize_set(struct trace_cache *cache, size_t set)
+{
+    int ret, i;
+    struct tc_set *curr_set;
+
+    if(!cache || set >= cache->nsets)
+    {
+        err("Invalid cache or set index\n");
+        return -EINVAL;
+    }
+
+    debug("Initializing set %zu\n", set);
+    curr_set = &cache->sets[set];
+
+    ret = p_sem_create(&curr_set->set_lock, 1);
+    if(ret < 0)
+    {
+        err("Failed to initialize set lock semaphore: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    curr_set->valid = calloc(cache->nways, sizeof(bool));
+    if(!curr_set->valid)
+    {
+        err("Failed to allocate set valid array\n");
+        ret = -ENOMEM;
+        goto __free_tc_set;
+    }
+
+    curr_set->pending = calloc(cache->nways, sizeof(bool));
+    if(!curr_set->pending)
+    {
+        err("Failed to allocate set pending array\n");
+        ret = -ENOMEM;
+        goto __free_tc_set;
+    }
+
+    curr_set->index = calloc(cache->nways, sizeof(size_t));
+    if(!curr_set->index)
+    {
+        err("Failed to allocate set index array\n");
+        ret = -ENOMEM;
+        goto __free_tc_set;
+    }
+
+    curr_set->flags = calloc(cache->nways, sizeof(uint8_t));
+    if(!curr_set->flags)
+    {
+        err("Failed to allocate set flags array\n");
+        ret = -ENOMEM;
+        goto __free_tc_set;
+    }
+
+    curr_set->stamp = calloc(cache->nways, sizeof(uint64_t));
+    if(!curr_set->stamp)
+    {
+        err("Failed to allocate set stamp array\n");
+        ret = -ENOMEM;
+        goto __free_tc_set;
+    }
+
+    curr_set->refcount = calloc(cache->nways, sizeof(uint8_t));
+    if(!curr_set->refcount)
+    {
+        err("Failed to allocate set refcount array\n");
+        ret = -ENOMEM;
+        goto __free_tc_set;
+    }
+
+    curr_set->bytes = calloc(cache->nways, sizeof(size_t));
+    if(!curr_set->bytes)
+    {
+        err("Failed to allocate set byte count array\n");
+        ret = -ENOMEM;
+        goto __free_tc_set;
+    }
+
+    curr_set->started = calloc(cache->nways, sizeof(uint64_t));
+    if(!curr_set->started)
+    {
+        err("Failed to allocate set start time array\n");
+        ret = -ENOMEM;
+        goto __free_tc_set;
+    }
+
+    curr_set->traces = calloc(cache->nways, sizeof(struct strace *));
+    if(!curr_set->traces)
+    {
+        err("Failed to allocate set trace array\n");
+        ret = -ENOMEM;
+        goto __free_tc_set;
+    }
+
+    if(cache->policy == CACHE_2Q)
+    {
+        curr_set->ghosts = malloc(CACHE_2Q_GHOSTS(cache->nways) * sizeof(size_t));
+        if(!curr_set->ghosts)
+        {
+            err("Failed to allocate set ghost array\n");
+            ret = -ENOMEM;
+            goto __free_tc_set;
+        }
+
+        for(i = 0; i < CACHE_2Q_GHOSTS(cache->nways); i++)
+            curr_set->ghosts[i] = SIZE_MAX;
+    }
+
+    curr_set->waiters = calloc(cache->nways, sizeof(size_t));
+    if(!curr_set->waiters)
+    {
+        err("Failed to allocate set waiter array\n");
+        ret = -ENOMEM;
+        goto __free_tc_set;
+    }
+
+    curr_set->filled = calloc(cache->nways, sizeof(LT_SEM_TYPE));
+    if(!curr_set->filled)
+    {
+        err("Failed to allocate set fill semaphores\n");
+        ret = -ENOMEM;
+        goto __free_tc_set;
+    }
+
+    for(i = 0; i < cache->nways; i++)
+    {
+        ret = p_sem_create(&curr_set->filled[i], 0);
+        if(ret < 0)
+        {
+            err("Failed to initialize fill semaphore: %s\n", strerror(errno));
+            ret = -errno;
+
+            while(i-- > 0)
+                p_sem_destroy(&curr_set->filled[i]);
+            goto __free_tc_set;
+        }
+    }
+
+    debug("done initializing set %zu\n", set);
+    return 0;
+
+__free_tc_set:
+    p_sem_destroy(&curr_set->set_lock);
+
+    if(curr_set->valid)
+        free(curr_set->valid);
+
+    if(curr_set->pending)
+        free(curr_set->pending);
+
+    if(curr_set->index)
+        free(curr_set->index);
+
+    if(curr_set->flags)
+        free(curr_set->flags);
+
+    if(curr_set->stamp)
+        free(curr_set->stamp);
+
+    if(curr_set->refcount)
+        free(curr_set->refcount);
+
+    if(curr_set->bytes)
+        free(curr_set->bytes);
+
+    if(curr_set->started)
+        free(curr_set->started);
+
+    if(curr_set->traces)
+        free(curr_set->traces);
+
+    if(curr_set->ghosts)
+        free(curr_set->ghosts);
+
+    if(curr_set->waiters)
+        free(curr_set->waiters);
+
+    if(curr_set->filled)
+        free(curr_set->filled);
+
+    memset(curr_set, 0, sizeof(struct tc_set));
+    return ret;
+}
+
+void __free_set(struct trace_cache *cache, size_t set)
+{
+    int i;
+    struct tc_set *curr_set = &cache->sets[set];
+
+    p_sem_destroy(&curr_set->set_lock);
+    for(i = 0; i < cache->nways; i++)
+    {
+        if(curr_set->valid[i] && !curr_set->pending[i])
+            trace_free_memory(curr_set->traces[i]);
+
+        p_sem_destroy(&curr_set->filled[i]);
+    }
+
+    free(curr_set->valid);
+    free(curr_set->pending);
+    free(curr_set->index);
+    free(curr_set->flags);
+    free(curr_set->stamp);
+    free(curr_set->refcount);
+    free(curr_set->bytes);
+    free(curr_set->started);
+    free(curr_set->traces);
+
+    if(curr_set->ghosts)
+        free(curr_set->ghosts);
+
+    free(curr_set->waiters);
+    free(curr_set->filled);
+}
+
+// take a set lock, accounting for any time spent blocked on it
+static inline void __lock_set(struct tc_set *curr_set)
+{
+    uint64_t start;
+
+    if(p_sem_trywait(&curr_set->set_lock) == 0)
+        return;
+
+    start = p_time_ns();
+    sem_acquire(&curr_set->set_lock);
+    curr_set->lock_waits++;
+    curr_set->lock_wait_ns += p_time_ns() - start;
+}
+
+void __collect_stats(struct trace_cache *cache, struct cache_stats *stats)
+{
+    size_t i, way, held;
+    struct tc_set *curr_set;
+
+    memset(stats, 0, sizeof(struct cache_stats));
+    stats->nsets = cache->nsets;
+    stats->nways = cache->nways;
+
+    for(i = 0; i < cache->nsets; i++)
+    {
+        curr_set = &cache->sets[i];
+        sem_acquire(&curr_set->set_lock);
+
+        for(way = 0, held = 0; way < cache->nways; way++)
+        {
+            if(curr_set->valid[way] && !curr_set->pending[way])
+                held++;
+
+            stats->bytes_held += curr_set->bytes[way];
+        }
+
+        stats->traces_held += held;
+        stats->occupancy[held * (CACHE_OCCUPANCY_BUCKETS - 1) / cache->nways]++;
+
+        stats->accesses += curr_set->accesses;
+        stats->hits += curr_set->hits;
+        stats->misses += curr_set->misses;
+        stats->waits += curr_set->waits;
+        stats->stores += curr_set->stores;
+        stats->evictions += curr_set->evictions;
+        stats->fills += curr_set->fills;
+        stats->fill_ns += curr_set->fill_ns;
+        stats->lock_waits += curr_set->lock_waits;
+        stats->lock_wait_ns += curr_set->lock_wait_ns;
+
+        sem_release(&curr_set->set_lock);
+    }
+
+    if(cache->spill)
+    {
+        sem_acquire(&cache->spill->lock);
+        stats->spill_hits = cache->spill->hits;
+        stats->spill_misses = cache->spill->misses;
+        stats->spill_writes = cache->spill->writes;
+        sem_release(&cache->spill->lock);
+    }
+
+    if(cache->prefetch)
+        sem_with(&cache->prefetch->lock, stats->prefetched = cache->prefetch->issued);
+}
+
+void __print_stats(struct trace_cache *cache)
+{
+    struct cache_stats stats;
+
+    __collect_stats(cache, &stats);
+    if(stats.accesses == 0)
+        return;
+
+    warn("Cache %zu: %zu accesses\n\t\t%zu hits (%.5f)\n\t\t%zu misses (%.5f)\n\t\t%zu stores, %zu evictions (holding %zu, %zu bytes)\n\t\t%zu waits on in-flight traces\n\t\t%.2f us per miss, %.2f us blocked on locks\n",
+         cache->cache_id, stats.accesses,
+         stats.hits, (float) stats.hits / (float) stats.accesses,
+         stats.misses, (float) stats.misses / (float) stats.accesses,
+         stats.stores, stats.evictions, stats.traces_held, stats.bytes_held, stats.waits,
+         stats.fills ? (double) stats.fill_ns / (double) stats.fills / 1e3 : 0.0,
+         (double) stats.lock_wait_ns / 1e3);
+
+    if(cache->spill)
+    {
+        warn("Spill file %s: %zu slots\n\t\t%zu hits, %zu misses\n\t\t%zu writes, %zu failed\n",
+             cache->spill->path, cache->spill->nslots,
+             cache->spill->hits, cache->spill->misses,
+             cache->spill->writes, cache->spill->failed);
+    }
+}
+
+int ts_cache_stats(struct trace_set *ts, struct cache_stats *stats)
+{
+    if(!ts || !stats)
+    {
+        err("Invalid trace set or stats\n");
+        return -EINVAL;
+    }
+
+    // not an error, most sets in a pipeline aren't cached
+    if(!ts->cache)
+        return -ENOENT;
+
+    __collect_stats(ts->cache, stats);
+    return 0;
+}
+
+int ts_cache_stats_json(struct trace_set *ts, char *buf, size_t len)
+{
+    int ret, i, pos;
+    struct cache_stats stats;
+
+    if(!buf || len == 0)
+    {
+        err("Invalid buffer\n");
+        return -EINVAL;
+    }
+
+    ret = ts_cache_stats(ts, &stats);
+    if(ret < 0)
+        return ret;
+
+    pos = snprintf(buf, len,
+                   "{\"time_ns\":%llu,\"set\":%zu,\"nsets\":%zu,\"nways\":%zu,"
+                   "\"accesses\":%zu,\"hits\":%zu,\"misses\":%zu,\"waits\":%zu,"
+                   "\"stores\":%zu,\"evictions\":%zu,\"traces\":%zu,\"bytes\":%zu,"
+                   "\"fills\":%zu,\"fill_ns\":%llu,\"lock_waits\":%zu,\"lock_wait_ns\":%llu,"
+                   "\"spill_hits\":%zu,\"spill_misses\":%zu,\"spill_writes\":%zu,"
+                   "\"prefetched\":%zu,\"occupancy\":[",
+                   (unsigned long long) p_time_ns(), ts->set_id, stats.nsets, stats.nways,
+                   stats.accesses, stats.hits, stats.misses, stats.waits,
+                   stats.stores, stats.evictions, stats.traces_held, stats.bytes_held,
+                   stats.fills, (unsigned long long) stats.fill_ns,
+                   stats.lock_waits, (unsigned long long) stats.lock_wait_ns,
+                   stats.spill_hits, stats.spill_misses, stats.spill_writes,
+                   stats.prefetched);
+
+    for(i = 0; i < CACHE_OCCUPANCY_BUCKETS && pos > 0 && pos < len; i++)
+        pos += snprintf(buf + pos, len - pos, "%s%zu", i ? "," : "", stats.occupancy[i]);
+
+    if(pos > 0 && pos < len)
+        pos += snprintf(buf + pos, len - pos, "]}");
+
+    if(pos < 0 || pos >= len)
+    {
+        err("Buffer too small for cache stats\n");
+        return -ENOSPC;
+    }
+
+    return 0;
+}
+
+int __budget_create(struct tc_budget **budget, size_t limit)
+{
+    int ret;
+    struct tc_budget *res;
+
+    res = calloc(1, sizeof(struct tc_budget));
+    if(!res)
+    {
+        err("Failed to allocate cache budget\n");
+        return -ENOMEM;
+    }
+
+    ret = p_sem_create(&res->lock, 1);
+    if(ret < 0)
+    {
+        err("Failed to initialize budget lock semaphore: %s\n", strerror(errno));
+        free(res);
+        return -errno;
+    }
+
+    ret = p_sem_create(&res->list_lock, 1);
+    if(ret < 0)
+    {
+        err("Failed to initialize budget list semaphore: %s\n", strerror(errno));
+        p_sem_destroy(&res->lock);
+        free(res);
+        return -errno;
+    }
+
+    res->limit = limit;
+    *budget = res;
+    return 0;
+}
+
+void __budget_free(struct tc_budget *budget)
+{
+    p_sem_destroy(&budget->lock);
+    p_sem_destroy(&budget->list_lock);
+    free(budget->caches);
+    free(budget);
+}
+
+int __budget_attach(struct tc_budget *budget, struct trace_cache *cache)
+{
+    struct trace_cache **caches;
+
+    sem_acquire(&budget->list_lock);
+    caches = realloc(budget->caches, (budget->ncaches + 1) * sizeof(struct trace_cache *));
+    if(!caches)
+    {
+        err("Failed to grow budget cache list\n");
+        sem_release(&budget->list_lock);
+        return -ENOMEM;
+    }
+
+    caches[budget->ncaches++] = cache;
+    budget->caches = caches;
+    cache->budget = budget;
+    sem_release(&budget->list_lock);
+    return 0;
+}
+
+// returns the number of caches still attached
+size_t __budget_detach(struct tc_budget *budget, struct trace_cache *cache)
+{
+    size_t i, res;
+
+    sem_acquire(&budget->list_lock);
+    for(i = 0; i < budget->ncaches; i++)
+    {
+        if(budget->caches[i] == cache)
+        {
+            budget->caches[i] = budget->caches[--budget->ncaches];
+            break;
+        }
+    }
+
+    res = budget->ncaches;
+    sem_release(&budget->list_lock);
+    return res;
+}
+
+static inline void __budget_charge(struct trace_cache *cache, size_t add, size_t sub)
+{
+    struct tc_budget *budget = cache->budget;
+
+    if(!budget)
+        return;
+
+    sem_acquire(&budget->lock);
+    budget->used = budget->used + add - sub;
+    cache->held = cache->held + add - sub;
+    if(add)
+        budget->stores++;
+    sem_release(&budget->lock);
+}
+
+size_t __trace_bytes(struct trace *t)
+{
+    size_t res = sizeof(struct trace);
+
+    if(t->title)
+        res += t->owner->title_size;
+
+    if(t->data)
+        res += t->owner->data_size;
+
+    if(t->samples)
+        res += t->owner->num_samples * sizeof(float);
+
+    return res;
+}
+
+int tc_cache_manual(struct trace_cache **cache, size_t id, size_t nsets, size_t nways,
+                    cache_policy_t policy, bool hashed)
+{
+    int ret;
+    size_t i;
+    struct trace_cache *res;
+
+    debug("Creating cache %zu with assoc %zu sets %zu policy %i%s for trace set\n",
+          id, nways, nsets, policy, hashed ? " (hashed)" : "");
+
+    if(nsets == 0 || nways == 0 || policy >= NUM_CACHE_POLICIES)
+    {
+        err("Invalid cache geometry\n");
+        return -EINVAL;
+    }
+
+    res = calloc(1, sizeof(struct trace_cache));
+    if(!res)
+    {
+        err("Failed to allocate trace cache\n");
+        return -ENOMEM;
+    }
+
+    res->cache_id = id;
+    res->nsets = nsets;
+    res->nways = nways;
+    res->policy = policy;
+    res->hashed = hashed;
+
+    res->sets = calloc(res->nsets, sizeof(struct tc_set));
+    if(!res->sets)
+    {
+        err("Failed to allocate cache sets\n");
+        free(res);
+        return -ENOMEM;
+    }
+
+    for(i = 0; i < res->nsets; i++)
+    {
+        ret = __initialize_set(res, i);
+        if(ret < 0)
+        {
+            err("Failed to initialize cache set %zu\n", i);
+            goto __free_sets;
+        }
+    }
+
+    *cache = res;
+    return 0;
+
+__free_sets:
+    while(i-- > 0)
+        __free_set(res, i);
+
+    free(res->sets);
+    free(res);
+    return ret;
+}
+
+int ts_create_cache(struct trace_set *ts, size_t size_bytes, size_t assoc)
+{
+    return ts_create_cache_policy(ts, size_bytes, assoc, CACHE_LRU, false);
+}
+
+int __create_budgeted(struct trace_set *ts, struct tc_budget *budget, size_t assoc,
+                      cache_policy_t policy, bool hashed)
+{
+    int ret;
+    size_t ntraces;
+
+    // slots only bound the metadata, the budget bounds the memory
+    ntraces = CACHE_SLOT_OVERCOMMIT * __find_num_traces(ts, budget->limit, assoc);
+    ntraces -= (ntraces % assoc); // round to even trace sets
+
+    ret = tc_cache_manual(&ts->cache, ts->set_id, ntraces / assoc, assoc, policy, hashed);
+    if(ret < 0)
+    {
+        err("Failed to create cache\n");
+        return ret;
+    }
+
+    ret = __budget_attach(budget, ts->cache);
+    if(ret < 0)
+    {
+        err("Failed to attach cache to budget\n");
+        tc_free(ts->cache);
+        ts->cache = NULL;
+        return ret;
+    }
+
+    return 0;
+}
+
+int ts_create_cache_policy(struct trace_set *ts, size_t size_bytes, size_t assoc,
+                           cache_policy_t policy, bool hashed)
+{
+    int ret;
+    struct tc_budget *budget;
+
+    if(!ts || assoc == 0 || size_bytes < ts_trace_size(ts))
+    {
+        err("Invalid trace set, associativity, or cache size < size of one trace\n");
+        return -EINVAL;
+    }
+
+    ret = __budget_create(&budget, size_bytes);
+    if(ret < 0)
+    {
+        err("Failed to create cache budget\n");
+        return ret;
+    }
+
+    ret = __create_budgeted(ts, budget, assoc, policy, hashed);
+    if(ret < 0)
+        __budget_free(budget);
+
+    return ret;
+}
+
+int ts_set_cache_budget(size_t size_bytes)
+{
+    if(size_bytes == 0)
+    {
+        err("Invalid cache budget\n");
+        return -EINVAL;
+    }
+
+    if(!gbl_budget)
+        return __budget_create(&gbl_budget, size_bytes);
+
+    // caches already sized their slots, but the limit itself can move
+    sem_acquire(&gbl_budget->lock);
+    gbl_budget->limit = size_bytes;
+    sem_release(&gbl_budget->lock);
+    return 0;
+}
+
+int ts_create_cache_shared(struct trace_set *ts, size_t assoc,
+                           cache_policy_t policy, bool hashed)
+{
+    if(!ts || assoc == 0)
+    {
+        err("Invalid trace set or associativity\n");
+        return -EINVAL;
+    }
+
+    if(!gbl_budget || gbl_budget->limit < ts_trace_size(ts))
+    {
+        err("No global cache budget set, or budget < size of one trace\n");
+        return -EINVAL;
+    }
+
+    return __create_budgeted(ts, gbl_budget, assoc, policy, hashed);
+}
+
+int ts_cache_spill(struct trace_set *ts, const char *path, size_t size_bytes)
+{
+    int ret;
+    size_t i;
+    struct tc_spill *res;
+
+    if(!ts || !ts->cache || !path)
+    {
+        err("Invalid trace set, or trace set has no cache to spill from\n");
+        return -EINVAL;
+    }
+
+    if(ts->cache->spill)
+    {
+        err("Cache for trace set %zu already has a spill file\n", ts->set_id);
+        return -EINVAL;
+    }
+
+    res = calloc(1, sizeof(struct tc_spill));
+    if(!res)
+    {
+        err("Failed to allocate spill file\n");
+        return -ENOMEM;
+    }
+
+    res->slot_size = ts->title_size + ts->data_size + ts->num_samples * sizeof(float);
+    res->nslots = res->slot_size ? size_bytes / res->slot_size : 0;
+    if(res->nslots == 0)
+    {
+        err("Spill size %zu can't fit a single trace of %zu bytes\n",
+            size_bytes, res->slot_size);
+        ret = -EINVAL;
+        goto __free_res;
+    }
+
+    res->nways = res->nslots < SPILL_WAYS ? res->nslots : SPILL_WAYS;
+    res->nslots -= (res->nslots % res->nways);
+
+    ret = p_sem_create(&res->lock, 1);
+    if(ret < 0)
+    {
+        err("Failed to initialize spill lock semaphore: %s\n", strerror(errno));
+        ret = -errno;
+        goto __free_res;
+    }
+
+    res->path = calloc(strlen(path) + 1, sizeof(char));
+    res->index = calloc(res->nslots, sizeof(size_t));
+    res->fields = calloc(res->nslots, sizeof(uint8_t));
+    res->stamp = calloc(res->nslots, sizeof(uint64_t));
+    res->busy = calloc(res->nslots, sizeof(int));
+    if(!res->path || !res->index || !res->fields || !res->stamp || !res->busy)
+    {
+        err("Failed to allocate spill slot arrays\n");
+        ret = -ENOMEM;
+        goto __free_arrays;
+    }
+
+    strcpy(res->path, path);
+    for(i = 0; i < res->nslots; i++)
+        res->index[i] = SIZE_MAX;
+
+    res->file = p_fopen(path, "w+b");
+    if(!res->file)
+    {
+        err("Failed to create spill file %s: %s\n", path, strerror(errno));
+        ret = -errno;
+        goto __free_arrays;
+    }
+
+    critical("Spill file %s for trace set %zu can fit %zu traces\n",
+             path, ts->set_id, res->nslots);
+    ts->cache->spill = res;
+    return 0;
+
+__free_arrays:
+    free(res->path);
+    free(res->index);
+    free(res->fields);
+    free(res->stamp);
+    free(res->busy);
+    p_sem_destroy(&res->lock);
+
+__free_res:
+    free(res);
+    return ret;
+}
+
+void __print_prefetch_stats(struct tc_prefetch *prefetch)
+{
+    if(prefetch->issued == 0)
+        return;
+
+    warn("Prefetcher for trace set %zu: %zu traces ahead\n\t\t%zu issued, %zu failed\n",
+         prefetch->ts->set_id, prefetch->depth, prefetch->issued, prefetch->failed);
+}
+
+LT_THREAD_FUNC(__prefetch_func, thread_arg)
+{
+    int ret;
+    size_t index;
+    struct trace *t;
+    struct tc_prefetch *prefetch = thread_arg;
+
+    while(1)
+    {
+        sem_acquire(&prefetch->lock);
+        if(!prefetch->running)
+        {
+            sem_release(&prefetch->lock);
+            break;
+        }
+
+        // anything at or before the demand is being fetched already
+        if(prefetch->next <= prefetch->demand)
+            prefetch->next = prefetch->demand + 1;
+
+        if(!prefetch->started ||
+           prefetch->next > prefetch->demand + prefetch->depth ||
+           prefetch->next >= ts_num_traces(prefetch->ts))
+        {
+            prefetch->sleeping = true;
+            sem_release(&prefetch->lock);
+
+            sem_acquire(&prefetch->wake);
+            continue;
+        }
+
+        index = prefetch->next++;
+        prefetch->issued++;
+        sem_release(&prefetch->lock);
+
+        // leaves the trace behind in the cache, unreferenced
+        ret = __trace_get(prefetch->ts, &t, index, false);
+        if(ret < 0)
+        {
+            warn("Failed to prefetch trace %zu\n", index);
+            sem_with(&prefetch->lock, prefetch->failed++);
+            continue;
+        }
+
+        trace_free(t);
+    }
+
+    return NULL;
+}
+
+int ts_cache_prefetch(struct trace_set *ts, size_t depth)
+{
+    int ret;
+    struct tc_prefetch *res;
+
+    if(!ts || !ts->cache || depth == 0)
+    {
+        err("Invalid trace set or depth, or trace set has no cache\n");
+        return -EINVAL;
+    }
+
+    if(ts->cache->prefetch)
+    {
+        err("Cache for trace set %zu already has a prefetcher\n", ts->set_id);
+        return -EINVAL;
+    }
+
+    // reading past the end of these sets may block, or render them
+    if(ts->num_traces == UNKNOWN_NUM_TRACES)
+    {
+        err("Can't prefetch from trace set %zu of unknown length\n", ts->set_id);
+        return -EINVAL;
+    }
+
+    res = calloc(1, sizeof(struct tc_prefetch));
+    if(!res)
+    {
+        err("Failed to allocate prefetcher\n");
+        return -ENOMEM;
+    }
+
+    res->ts = ts;
+    res->depth = depth;
+    res->running = true;
+
+    ret = p_sem_create(&res->lock, 1);
+    if(ret < 0)
+    {
+        err("Failed to initialize prefetch lock semaphore: %s\n", strerror(errno));
+        free(res);
+        return -errno;
+    }
+
+    ret = p_sem_create(&res->wake, 0);
+    if(ret < 0)
+    {
+        err("Failed to initialize prefetch wake semaphore: %s\n", strerror(errno));
+        ret = -errno;
+        goto __free_lock;
+    }
+
+    ret = p_thread_create(&res->thread, __prefetch_func, res);
+    if(ret < 0)
+    {
+        err("Failed to create prefetch thread\n");
+        ret = -EINVAL;
+        goto __free_wake;
+    }
+
+    ts->cache->prefetch = res;
+    return 0;
+
+__free_wake:
+    p_sem_destroy(&res->wake);
+
+__free_lock:
+    p_sem_destroy(&res->lock);
+    free(res);
+    return ret;
+}
+
+void tc_stop_prefetch(struct trace_cache *cache)
+{
+    struct tc_prefetch *prefetch;
+
+    if(!cache || !cache->prefetch)
+        return;
+
+    prefetch = cache->prefetch;
+    sem_acquire(&prefetch->lock);
+    prefetch->running = false;
+    sem_release(&prefetch->lock);
+
+    // in case it's asleep, a spare wakeup is harmless
+    sem_release(&prefetch->wake);
+    p_thread_join(prefetch->thread);
+
+    cache->prefetch = NULL;
+    __print_prefetch_stats(prefetch);
+
+    p_sem_destroy(&prefetch->wake);
+    p_sem_destroy(&prefetch->lock);
+    free(prefetch);
+}
+
+void tc_demand(struct trace_cache *cache, size_t index)
+{
+    bool wake = false;
+    struct tc_prefetch *prefetch;
+
+    if(!cache || !cache->prefetch)
+        return;
+
+    prefetch = cache->prefetch;
+    sem_acquire(&prefetch->lock);
+    if(!prefetch->started || index > prefetch->demand ||
+       index + prefetch->depth < prefetch->demand)
+    {
+        // rewind, or the thread keeps running ahead of the old demand
+        if(index < prefetch->demand)
+            prefetch->next = index + 1;
+
+        prefetch->started = true;
+        prefetch->demand = index;
+
+        wake = prefetch->sleeping;
+        prefetch->sleeping = false;
+    }
+    sem_release(&prefetch->lock);
+
+    if(wake)
+        sem_release(&prefetch->wake);
+}
+
+void __spill_free(struct tc_spill *spill)
+{
+    p_fclose(spill->file);
+    if(remove(spill->path) != 0)
+        warn("Failed to remove spill file %s: %s\n", spill->path, strerror(errno));
+
+    p_sem_destroy(&spill->lock);
+    free(spill->path);
+    free(spill->index);
+    free(spill->fields);
+    free(spill->stamp);
+    free(spill->busy);
+    free(spill);
+}
+
+int tc_free(struct trace_cache *cache)
+{
+    int way;
+    size_t i, held = 0, remaining = 0;
+
+    if(!cache)
+    {
+        err("Invalid trace cache\n");
+        return -EINVAL;
+    }
+
+    debug("Freeing cache %zu\n", cache->cache_id);
+
+    // the prefetcher is still using this cache, so stop it first
+    tc_stop_prefetch(cache);
+    __print_stats(cache);
+
+    if(cache->budget)
+        remaining = __budget_detach(cache->budget, cache);
+
+    for(i = 0; i < cache->nsets; i++)
+    {
+        sem_acquire(&cache->sets[i].set_lock);
+        for(way = 0; way < cache->nways; way++)
+            held += cache->sets[i].bytes[way];
+
+        __free_set(cache, i);
+    }
+
+    __budget_charge(cache, 0, held);
+    if(cache->budget && cache->budget != gbl_budget && remaining == 0)
+        __budget_free(cache->budget);
+
+    if(cache->spill)
+        __spill_free(cache->spill);
+
+    free(cache->sets);
+    free(cache);
+    return 0;
+}
+
+int __find_way(struct trace_cache *cache, struct tc_set *curr_set, size_t index)
+{
+    int i;
+
+    for(i = 0; i < cache->nways; i++)
+    {
+        if(curr_set->valid[i] && curr_set->index[i] == index)
+            return i;
+    }
+
+    return -1;
 }
 
-int __update_lru(struct trace_cache *cache, size_t set, size_t way, bool hit)
+// first slot of the group, and the slot holding index within it or -1
+static inline size_t __spill_find(struct tc_spill *spill, size_t index, int *way)
 {
     int i;
-    uint8_t thresh = cache->sets[set].lru[way];
+    size_t first;
 
-    for(i = 0; i < cache->nways; i++)
+    first = (__hash_index(index) % (spill->nslots / spill->nways)) * spill->nways;
+    for(i = 0, *way = -1; i < spill->nways; i++)
+    {
+        if(spill->index[first + i] == index)
+            *way = i;
+    }
+
+    return first;
+}
+
+void __spill_write(struct tc_spill *spill, struct trace *t)
+{
+    int ret, way, i;
+    size_t slot;
+    uint8_t fields = 0, *buf;
+    struct trace_set *ts = t->owner;
+
+    sem_acquire(&spill->lock);
+    slot = __spill_find(spill, t->index, &way);
+
+    // traces never change, so one already on disk can stay there
+    if(way != -1)
+    {
+        sem_release(&spill->lock);
+        return;
+    }
+
+    // unused slots have a stamp of 0, so are taken first
+    for(i = 0, way = -1; i < spill->nways; i++)
+    {
+        if(spill->busy[slot + i] == 0 &&
+           (way == -1 || spill->stamp[slot + i] < spill->stamp[slot + way]))
+            way = i;
+    }
+
+    // every slot of the group is being read or written, so skip this one
+    if(way == -1)
+    {
+        sem_release(&spill->lock);
+        return;
+    }
+
+    // claim the slot, the write itself happens without the lock
+    slot += way;
+    spill->index[slot] = t->index;
+    spill->stamp[slot] = 0;
+    spill->busy[slot] = -1;
+    sem_release(&spill->lock);
+
+    // lay the trace out as one slot, so that it takes a single write
+    buf = p_thread_scratch(spill->slot_size);
+    if(buf)
     {
-        if(i == way) cache->sets[set].lru[i] = 0;
-        else
+        if(t->title)
         {
-            if(hit)
-            {
-                if(cache->sets[set].lru[i] < thresh)
-                    cache->sets[set].lru[i]++;
-            }
-            else cache->sets[set].lru[i]++;
+            fields |= REQ_TITLE;
+            memcpy(buf, t->title, ts->title_size);
         }
+
+        if(t->data)
+        {
+            fields |= REQ_DATA;
+            memcpy(buf + ts->title_size, t->data, ts->data_size);
+        }
+
+        if(t->samples)
+        {
+            fields |= REQ_SAMPLES;
+            memcpy(buf + ts->title_size + ts->data_size, t->samples,
+                   ts->num_samples * sizeof(float));
+        }
+
+        ret = p_pwrite(spill->file, buf, spill->slot_size, slot * spill->slot_size);
     }
+    else ret = -ENOMEM;
 
-    return 0;
+    sem_acquire(&spill->lock);
+    spill->busy[slot] = 0;
+    if(ret < 0)
+    {
+        spill->failed++;
+        spill->index[slot] = SIZE_MAX;
+    }
+    else
+    {
+        spill->writes++;
+        spill->fields[slot] = fields;
+        spill->stamp[slot] = spill->writes;
+    }
+    sem_release(&spill->lock);
 }
 
-int __initialize_set(struct trace_cache *cache, size_t set)
+int tc_unspill(struct trace_cache *cache, struct trace *t)
 {
-    int ret, i;
-    struct tc_set *curr_set;
+    int ret, way;
+    size_t slot;
+    uint8_t fields, *buf;
+    struct tc_spill *spill;
+    struct trace_set *ts;
 
-    if(!cache || set >= cache->nsets)
+    if(!cache || !t)
     {
-        err("Invalid cache or set index\n");
+        err("Invalid trace cache or trace\n");
         return -EINVAL;
     }
 
-    debug("Initializing set %zu\n", set);
-    curr_set = &cache->sets[set];
+    if(!cache->spill)
+        return 0;
 
-    ret = p_sem_create(&curr_set->set_lock, 1);
-    if(ret < 0)
+    ts = t->owner;
+    spill = cache->spill;
+
+    // a slot still being written counts as a miss
+    sem_acquire(&spill->lock);
+    slot = __spill_find(spill, t->index, &way);
+    if(way == -1 || spill->busy[slot + way] < 0)
     {
-        err("Failed to initialize set lock semaphore: %s\n", strerror(errno));
-        return -errno;
+        spill->misses++;
+        sem_release(&spill->lock);
+        return 0;
     }
 
-    curr_set->valid = calloc(cache->nways, sizeof(bool));
-    if(!curr_set->valid)
+    // pin the slot against overwrites while it is read without the lock
+    slot += way;
+    spill->busy[slot]++;
+    fields = spill->fields[slot];
+    sem_release(&spill->lock);
+
+    buf = p_thread_scratch(spill->slot_size);
+    ret = buf ? p_pread(spill->file, buf, spill->slot_size, slot * spill->slot_size) : -ENOMEM;
+
+    if(ret >= 0 && (fields & REQ_TITLE))
     {
-        err("Failed to allocate set valid array\n");
-        ret = -ENOMEM;
-        goto __free_tc_set;
+        t->title = tp_alloc(ts, POOL_TITLE, ts->title_size);
+        if(t->title)
+            memcpy(t->title, buf, ts->title_size);
+        else ret = -ENOMEM;
     }
 
-    curr_set->lru = calloc(cache->nways, sizeof(uint8_t));
-    if(!curr_set->lru)
+    if(ret >= 0 && (fields & REQ_DATA))
     {
-        err("Failed to allocate set LRU array\n");
-        ret = -ENOMEM;
-        goto __free_tc_set;
+        t->data = tp_alloc(ts, POOL_DATA, ts->data_size);
+        if(t->data)
+            memcpy(t->data, buf + ts->title_size, ts->data_size);
+        else ret = -ENOMEM;
     }
 
-    curr_set->refcount = calloc(cache->nways, sizeof(uint8_t));
-    if(!curr_set->refcount)
+    if(ret >= 0 && (fields & REQ_SAMPLES))
     {
-        err("Failed to allocate set refcount array\n");
-        ret = -ENOMEM;
-        goto __free_tc_set;
+        t->samples = tp_alloc(ts, POOL_SAMPLES, ts->num_samples * sizeof(float));
+        if(t->samples)
+            memcpy(t->samples, buf + ts->title_size + ts->data_size,
+                   ts->num_samples * sizeof(float));
+        else ret = -ENOMEM;
     }
 
-    curr_set->traces = calloc(cache->nways, sizeof(struct strace *));
-    if(!curr_set->traces)
+    sem_acquire(&spill->lock);
+    spill->busy[slot]--;
+
+    // a bad slot isn't fatal, the caller can still produce the trace
+    if(ret < 0)
     {
-        err("Failed to allocate set trace array\n");
-        ret = -ENOMEM;
-        goto __free_tc_set;
+        warn("Failed to read trace %zu back from spill file\n", t->index);
+        spill->failed++;
+        spill->misses++;
+        spill->index[slot] = SIZE_MAX;
+        spill->stamp[slot] = 0;
+        sem_release(&spill->lock);
+
+        tp_release(ts, POOL_TITLE, t->title, ts->title_size);
+        tp_release(ts, POOL_DATA, t->data, ts->data_size);
+        tp_release(ts, POOL_SAMPLES, t->samples, ts->num_samples * sizeof(float));
+        t->title = NULL;
+        t->data = NULL;
+        t->samples = NULL;
+        return 0;
     }
 
-    for(i = 0; i < cache->nways; i++)
-        curr_set->lru[i] = cache->nways - i - 1;
+    spill->hits++;
+    sem_release(&spill->lock);
+    return 1;
+}
 
-    debug("done initializing set %zu\n", set);
-    return 0;
+// detach the trace in a way, to be retired once the set lock is dropped
+struct trace *__evict_way(struct trace_cache *cache, struct tc_set *curr_set, int way)
+{
+    struct trace *res;
 
-__free_tc_set:
-    sem_acquire(&curr_set->set_lock);
+    debug("Evicting trace %zu, way %i from cache set\n",
+          curr_set->index[way], way);
 
-    if(curr_set->valid)
-        free(curr_set->valid);
+    curr_set->evictions++;
+    __policy_evict(cache, curr_set, way);
+    __budget_charge(cache, 0, curr_set->bytes[way]);
 
-    if(curr_set->lru)
-        free(curr_set->lru);
+    res = curr_set->traces[way];
+    curr_set->traces[way] = NULL;
+    curr_set->valid[way] = false;
+    curr_set->bytes[way] = 0;
+    return res;
+}
 
-    if(curr_set->refcount)
-        free(curr_set->refcount);
+// spill and free an evicted trace, without holding any set lock
+void __retire_trace(struct trace_cache *cache, struct trace *t)
+{
+    if(!t)
+        return;
 
-    if(curr_set->traces)
-        free(curr_set->traces);
+    if(cache->spill)
+        __spill_write(cache->spill, t);
 
-    return ret;
+    trace_free_memory(t);
 }
 
-int tc_cache_manual(struct trace_cache **cache, size_t id, size_t nsets, size_t nways)
+int __claim_way(struct trace_cache *cache, struct tc_set *curr_set,
+                size_t index, struct trace **evicted)
 {
-    int ret;
-    struct trace_cache *res;
-
-    debug("Creating cache %zu with assoc %zu sets %zu for trace set\n",
-          id, nways, nsets);
+    int i, way = -1;
 
-    res = calloc(1, sizeof(struct trace_cache));
-    if(!res)
-    {
-        err("Failed to allocate trace cache\n");
-        return -ENOMEM;
-    }
+    *evicted = NULL;
 
-    ret = p_sem_create(&res->cache_lock, 1);
-    if(ret < 0)
+    // first pass - look for empty slots
+    for(i = 0; i < cache->nways; i++)
     {
-        err("Failed to initialize semaphore: %s\n", strerror(errno));
-        return -errno;
+        if(!curr_set->valid[i])
+        {
+            way = i;
+            break;
+        }
     }
 
-    res->cache_id = id;
-    res->nsets = nsets;
-    res->nways = nways;
+    debug("First pass found way %i\n", way);
 
-    // these lazily initialize as traces miss in the cache
-    res->sets = calloc(res->nsets, sizeof(struct tc_set));
-    if(!res->sets)
+    // second pass - no empty slots, ask the replacement policy
+    if(way == -1)
     {
-        err("Failed to allocate cache sets\n");
-        free(res);
-        return -ENOMEM;
+        way = __policy_victim(cache, curr_set);
+        debug("Second pass found way %i\n", way);
     }
 
-    res->hits = 0;
-    res->misses = 0;
-    res->accesses = 0;
-    res->stores = 0;
-    res->evictions = 0;
+    if(way == -1)
+        return -1;
 
-    *cache = res;
-    return 0;
+    curr_set->stores++;
+    if(curr_set->valid[way])
+        *evicted = __evict_way(cache, curr_set, way);
+
+    curr_set->valid[way] = true;
+    curr_set->pending[way] = false;
+    curr_set->index[way] = index;
+    curr_set->refcount[way] = 1;
+    curr_set->traces[way] = NULL;
+    __policy_insert(cache, curr_set, way, index);
+    return way;
 }
 
-int ts_create_cache(struct trace_set *ts, size_t size_bytes, size_t assoc)
+// called with the list lock held
+void __budget_rescore(struct tc_budget *budget)
 {
-    int ret;
-    size_t ntraces;
+    size_t i, j, hits, fills;
+    uint64_t fill_ns;
+    double saved;
+    struct trace_cache *cache;
+    struct tc_set *curr_set;
 
-    if(!ts || size_bytes < ts_trace_size(ts))
+    for(i = 0; i < budget->ncaches; i++)
     {
-        err("Invalid trace set, or cache size < size of one trace\n");
-        return -EINVAL;
+        cache = budget->caches[i];
+        hits = fills = fill_ns = 0;
+
+        for(j = 0; j < cache->nsets; j++)
+        {
+            curr_set = &cache->sets[j];
+            __lock_set(curr_set);
+            hits += curr_set->hits;
+            fills += curr_set->fills;
+            fill_ns += curr_set->fill_ns;
+            sem_release(&curr_set->set_lock);
+        }
+
+        // keep the last known cost if nothing was produced this epoch
+        if(fills > cache->last_fills)
+            cache->miss_cost = (double) (fill_ns - cache->last_fill_ns) /
+                               (double) (fills - cache->last_fills);
+
+        // production time this cache saved per byte it held, smoothed
+        // so that one quiet epoch doesn't hand all its memory away
+        saved = (double) (hits - cache->last_hits) * cache->miss_cost;
+        sem_with(&budget->lock, saved /= (double) (cache->held + 1));
+        cache->value = (cache->value + saved) / 2;
+
+        debug("Cache %zu: %zu hits, %.0f ns per miss, value %e\n", cache->cache_id,
+              hits - cache->last_hits, cache->miss_cost, cache->value);
+
+        cache->last_hits = hits;
+        cache->last_fills = fills;
+        cache->last_fill_ns = fill_ns;
     }
+}
 
-    ntraces = __find_num_traces(ts, size_bytes, assoc);
-    ntraces -= (ntraces % assoc); // round to even trace sets
+// called with the list lock held
+struct trace_cache *__budget_victim(struct tc_budget *budget)
+{
+    size_t i, floor;
+    struct trace_cache *cache, *res = NULL, *fallback = NULL;
 
-    ret = tc_cache_manual(&ts->cache, ts->set_id, ntraces / assoc, assoc);
-    if(ret < 0)
+    sem_acquire(&budget->lock);
+    floor = budget->limit / (BUDGET_MIN_SHARE * budget->ncaches);
+
+    for(i = 0; i < budget->ncaches; i++)
     {
-        err("Failed to create cache\n");
-        return ret;
+        cache = budget->caches[i];
+        if(cache->exhausted || cache->held == 0)
+            continue;
+
+        if(!fallback || cache->held > fallback->held)
+            fallback = cache;
+
+        // with no history yet (equal values), shrink the largest
+        if(cache->held > floor && (!res || cache->value < res->value ||
+                                   (cache->value == res->value && cache->held > res->held)))
+            res = cache;
     }
+    sem_release(&budget->lock);
 
-    return 0;
+    // everyone is at their minimum, so take from the largest
+    return res ? res : fallback;
 }
 
-int tc_free(struct trace_cache *cache)
+// evict one trace from the next set that has an unpinned way, leaving
+// it to the caller to retire
+bool __budget_evict(struct trace_cache *cache, struct trace **evicted)
 {
-    int i, j;
-    debug("Freeing cache %zu\n", cache->cache_id);
+    int way = -1;
+    size_t tried;
+    struct tc_set *curr_set;
 
-    if(!cache)
+    *evicted = NULL;
+    for(tried = 0; tried < cache->nsets && way == -1; tried++)
     {
-        err("Invalid trace cache\n");
-        return -EINVAL;
+        curr_set = &cache->sets[cache->cur_set];
+        cache->cur_set = (cache->cur_set + 1) % cache->nsets;
+
+        __lock_set(curr_set);
+        way = __policy_victim(cache, curr_set);
+        if(way != -1)
+            *evicted = __evict_way(cache, curr_set, way);
+        sem_release(&curr_set->set_lock);
     }
 
-    sem_acquire(&cache->cache_lock);
-    p_sem_destroy(&cache->cache_lock);
+    return way != -1;
+}
 
-    for(i = 0; i < cache->nsets; i++)
+void __enforce_budget(struct tc_budget *budget)
+{
+    size_t i, nvictims;
+    bool over, rescore;
+    struct trace_cache *cache;
+    struct trace_cache *victim_cache[BUDGET_RETIRE_BATCH];
+    struct trace *victims[BUDGET_RETIRE_BATCH];
+
+    sem_acquire(&budget->lock);
+    over = (budget->used > budget->limit);
+    rescore = (budget->stores >= BUDGET_EPOCH_STORES);
+    if(rescore)
+        budget->stores = 0;
+    sem_release(&budget->lock);
+
+    if(!over && !rescore)
+        return;
+
+    // victims are spilled and freed in batches, without the list lock
+    do
     {
-        if(cache->sets[i].initialized)
+        sem_acquire(&budget->list_lock);
+        if(rescore && budget->ncaches > 1)
+            __budget_rescore(budget);
+
+        rescore = false;
+        for(i = 0; i < budget->ncaches; i++)
+            budget->caches[i]->exhausted = false;
+
+        // give up once every cache is exhausted, everything left is in use
+        for(nvictims = 0; over && nvictims < BUDGET_RETIRE_BATCH;)
         {
-            sem_acquire(&cache->sets[i].set_lock);
-            p_sem_destroy(&cache->sets[i].set_lock);
+            cache = __budget_victim(budget);
+            if(!cache)
+                break;
 
-            for(j = 0; j < cache->nways; j++)
-            {
-                if(cache->sets[i].valid[j])
-                    trace_free_memory(cache->sets[i].traces[j]);
-            }
+            if(!__budget_evict(cache, &victims[nvictims]))
+                cache->exhausted = true;
+            else if(victims[nvictims])
+                victim_cache[nvictims++] = cache;
 
-            free(cache->sets[i].valid);
-            free(cache->sets[i].lru);
-            free(cache->sets[i].refcount);
-            free(cache->sets[i].traces);
+            sem_with(&budget->lock, over = (budget->used > budget->limit));
         }
-    }
 
-    free(cache->sets);
-    free(cache);
+        sem_release(&budget->list_lock);
 
-    cache = NULL;
-    return 0;
+        for(i = 0; i < nvictims; i++)
+            __retire_trace(victim_cache[i], victims[i]);
+    }
+    while(over && nvictims == BUDGET_RETIRE_BATCH);
 }
 
-int tc_lookup(struct trace_cache *cache, size_t index, struct trace **trace, bool keep_lock)
+int tc_lookup(struct trace_cache *cache, size_t index, struct trace **trace, bool reserve)
 {
-    int i, ret;
+    int way;
     size_t set;
+    struct trace *evicted = NULL;
     struct tc_set *curr_set;
 
     if(!cache || !trace)
@@ -272,93 +1748,89 @@ int tc_lookup(struct trace_cache *cache, size_t index, struct trace **trace, boo
         return -EINVAL;
     }
 
-    debug("Trace cache %zu, cache access %zu for index %zu\n",
-          cache->cache_id, cache->accesses, index);
-
-    set = index % cache->nsets;
+    set = __set_index(cache, index);
     curr_set = &cache->sets[set];
 
-    sem_acquire(&cache->cache_lock);
-    cache->accesses++;
+    __lock_set(curr_set);
+    curr_set->accesses++;
 
-    if(!curr_set->initialized)
-    {
-        ret = __initialize_set(cache, set);
-        if(ret < 0)
-        {
-            err("Failed to initialize cache set %zu\n", set);
-            return -errno;
-        }
+    debug("Trace cache %zu, set access %zu for index %zu\n",
+          cache->cache_id, curr_set->accesses, index);
 
-        curr_set->initialized = true;
-        cache->misses++;
-        *trace = NULL;
+    *trace = NULL;
+    way = __find_way(cache, curr_set, index);
+    if(way != -1 && curr_set->pending[way])
+    {
+        // another thread is producing this trace, so block on this
+        // entry only and leave the rest of the set available
+        debug("Trace %zu in set %zu way %i is in flight, waiting\n", index, set, way);
+        curr_set->waits++;
+        curr_set->waiters[way]++;
+        sem_release(&curr_set->set_lock);
 
-        debug("Set %zu was not initialized, cache miss (%zu misses total)\n",
-                 set, cache->misses);
+        sem_acquire(&curr_set->filled[way]);
+        __lock_set(curr_set);
 
-        if(keep_lock)
-        sem_acquire(&curr_set->set_lock);
+        // the producer gave up and handed the placeholder to us
+        if(curr_set->pending[way])
+        {
+            debug("Inherited placeholder for %zu in set %zu way %i\n", index, set, way);
+            curr_set->started[way] = p_time_ns();
+            sem_release(&curr_set->set_lock);
+            return 1;
+        }
 
-        sem_release(&cache->cache_lock);
+        // otherwise, the producer already took a reference for us
+        curr_set->hits++;
+        *trace = curr_set->traces[way];
+        sem_release(&curr_set->set_lock);
         return 0;
     }
 
-    if(cache->accesses % 1000000 == 0)
+    // cache hit!
+    if(way != -1)
     {
-        warn("Cache %zu: %zu accesses\n\t\t%zu hits (%.5f)\n\t\t%zu misses (%.5f)\n\t\t%zu stores, %zu evictions (holding %zu)\n",
-             cache->cache_id, cache->accesses,
-             cache->hits, (float) cache->hits / (float) cache->accesses,
-             cache->misses, (float) cache->misses / (float) cache->accesses,
-             cache->stores, cache->evictions, (cache->stores - cache->evictions));
-    }
-
-    sem_release(&cache->cache_lock);
-    sem_acquire(&curr_set->set_lock);
+        __policy_hit(cache, curr_set, way);
+        curr_set->refcount[way]++;
 
-    *trace = NULL;
-    for(i = 0; i < cache->nways; i++)
-    {
-        // cache hit!
-        if(curr_set->valid[i])
-        {
-            if(TRACE_IDX(curr_set->traces[i]) == index)
-            {
-                __update_lru(cache, set, i, true);
-                curr_set->refcount[i]++;
+        curr_set->hits++;
+        *trace = curr_set->traces[way];
 
-                // this isnt guarded 100% correctly but I think thats fine
-                cache->hits++;
-                *trace = curr_set->traces[i];
+        debug("Cache hit for %zu in set %zu for way %i, refed %i times\n",
+              index, set, way, curr_set->refcount[way]);
 
-                debug("Cache hit for %zu in set %zu for way %i, refed %i times (%zu hits total)\n",
-                         index, set, i, curr_set->refcount[i], cache->hits);
-                break;
-            }
-        }
+        sem_release(&curr_set->set_lock);
+        return 0;
     }
 
-    if(*trace)
-    sem_release(&curr_set->set_lock)
-    else
+    curr_set->misses++;
+    debug("Cache miss for %zu in set %zu\n", index, set);
+
+    if(reserve)
     {
-        cache->misses++;
-        debug("Cache miss (%zu misses total)\n",
-                 cache->misses);
+        way = __claim_way(cache, curr_set, index, &evicted);
+        if(way != -1)
+        {
+            debug("Reserved set %zu way %i for %zu\n", set, way, index);
+            curr_set->pending[way] = true;
+            curr_set->started[way] = p_time_ns();
+        }
 
-        if(!keep_lock)
         sem_release(&curr_set->set_lock);
+        __retire_trace(cache, evicted);
+        return way != -1;
     }
 
+    sem_release(&curr_set->set_lock);
     return 0;
 }
 
-int tc_store(struct trace_cache *cache, size_t index, struct trace *trace, bool keep_lock)
+int tc_store(struct trace_cache *cache, size_t index, struct trace *trace)
 {
-    int i, ret, highest_lru, way;
+    int way;
     size_t set;
+    struct trace *evicted = NULL;
     struct tc_set *curr_set;
-    bool new_set = false;
 
     if(!cache || !trace)
     {
@@ -369,85 +1841,97 @@ int tc_store(struct trace_cache *cache, size_t index, struct trace *trace, bool
     debug("Trace cache %zu, store for index %zu\n",
           cache->cache_id, index);
 
-    set = index % cache->nsets;
+    set = __set_index(cache, index);
     curr_set = &cache->sets[set];
 
-    sem_acquire(&cache->cache_lock);
-    if(!curr_set->initialized)
+    __lock_set(curr_set);
+
+    // fill the placeholder from tc_lookup, and wake anyone waiting on it
+    way = __find_way(cache, curr_set, index);
+    if(way != -1 && curr_set->pending[way])
     {
-        ret = __initialize_set(cache, set);
-        if(ret < 0)
-        {
-            err("Failed to initialize cache set %zu\n", set);
-            return -errno;
-        }
+        debug("Filling index %zu in set %zu way %i for %zu waiters\n",
+              index, set, way, curr_set->waiters[way]);
 
-        curr_set->initialized = true;
-        new_set = true;
+        curr_set->pending[way] = false;
+        curr_set->traces[way] = trace;
+        curr_set->refcount[way] += curr_set->waiters[way];
 
-        // go ahead and grab this lock
-        sem_acquire(&curr_set->set_lock);
-    }
+        curr_set->fills++;
+        curr_set->fill_ns += p_time_ns() - curr_set->started[way];
 
-    sem_release(&cache->cache_lock);
-    if(!keep_lock && !new_set)
-        sem_acquire(&curr_set->set_lock);
+        for(; curr_set->waiters[way] > 0; curr_set->waiters[way]--)
+            sem_release(&curr_set->filled[way]);
 
-    // first pass - look for empty slots, pick the one with highest lru value
-    way = -1;
-    highest_lru = -1;
-    for(i = 0; i < cache->nways; i++)
+        goto __charge;
+    }
+
+    way = __claim_way(cache, curr_set, index, &evicted);
+    if(way == -1)
     {
-        if(!curr_set->valid[i] && curr_set->lru[i] > highest_lru)
-        {
-            highest_lru = curr_set->lru[i];
-            way = i;
-        }
+        err("No available slot found, cannot cache trace\n");
+        sem_release(&curr_set->set_lock);
+        return -EINVAL;
     }
 
-    debug("First pass found way %i with LRU %i\n", way, highest_lru);
+    debug("Placing index %zu in set %zu way %i\n", index, set, way);
+    curr_set->traces[way] = trace;
 
-    // second pass - no empty slots, look for refcount 0 and highest lru
-    if(highest_lru == -1)
-    {
-        for(i = 0; i < cache->nways; i++)
-        {
-            if(curr_set->refcount[i] == 0 && curr_set->lru[i] > highest_lru)
-            {
-                highest_lru = curr_set->lru[i];
-                way = i;
-            }
-        }
+__charge:
+    curr_set->bytes[way] = __trace_bytes(trace);
+    __budget_charge(cache, curr_set->bytes[way], 0);
+    sem_release(&curr_set->set_lock);
+    __retire_trace(cache, evicted);
+
+    // only after dropping the set lock, eviction may visit any set
+    if(cache->budget)
+        __enforce_budget(cache->budget);
+
+    return 0;
+}
+
+int tc_cancel(struct trace_cache *cache, size_t index)
+{
+    int way;
+    size_t set;
+    struct tc_set *curr_set;
 
-        debug("Second pass found way %i with LRU %i\n", way, highest_lru);
+    if(!cache)
+    {
+        err("Invalid trace cache\n");
+        return -EINVAL;
     }
 
-    if(highest_lru == -1)
+    set = __set_index(cache, index);
+    curr_set = &cache->sets[set];
+
+    __lock_set(curr_set);
+    way = __find_way(cache, curr_set, index);
+    if(way == -1 || !curr_set->pending[way])
     {
-        err("No available slot found, cannot cache trace\n");
+        err("No placeholder for index %zu in cache\n", index);
         sem_release(&curr_set->set_lock);
         return -EINVAL;
     }
 
-    cache->stores++;
-    if(curr_set->valid[way])
+    if(curr_set->waiters[way] > 0)
     {
-        debug("Evicting trace %zu, way %i from cache set %zu\n",
-                 TRACE_IDX(curr_set->traces[way]), way, set);
-
-        cache->evictions++;
-        trace_free_memory(curr_set->traces[way]);
+        // pass the placeholder (and our reference) on to one waiter
+        curr_set->waiters[way]--;
+        sem_release(&curr_set->filled[way]);
+    }
+    else
+    {
+        if(curr_set->flags[way] & WAY_PROTECTED)
+            curr_set->nprotected--;
 
-        curr_set->traces[way] = NULL;
+        curr_set->stores--;
         curr_set->valid[way] = false;
+        curr_set->pending[way] = false;
+        curr_set->refcount[way] = 0;
+        curr_set->flags[way] = 0;
     }
 
-    debug("Placing index %zu in set %zu way %i\n", index, set, way);
-    curr_set->valid[way] = true;
-    curr_set->refcount[way] = 1;
-    curr_set->traces[way] = trace;
-    __update_lru(cache, set, way, false);
-
     sem_release(&curr_set->set_lock);
     return 0;
 }
@@ -467,42 +1951,36 @@ int tc_deref(struct trace_cache *cache, size_t index, struct trace *trace)
     debug("Trace cache %zu, deref for index %zu\n",
           cache->cache_id, index);
 
-    set = index % cache->nsets;
+    set = __set_index(cache, index);
     curr_set = &cache->sets[set];
 
-    if(!curr_set->initialized)
-    {
-        err("Current set is not initialized, freeing trace\n");
-        trace_free_memory(trace);
-        return -EINVAL;
-    }
-
-    sem_acquire(&curr_set->set_lock);
+    __lock_set(curr_set);
     for(i = 0; i < cache->nways; i++)
     {
         // this is the correct entry
-        if(curr_set->valid[i] &&
-           TRACE_IDX(curr_set->traces[i]) == index)
+        if(curr_set->valid[i] && !curr_set->pending[i] &&
+           curr_set->index[i] == index && curr_set->traces[i] == trace)
         {
-            if(trace == curr_set->traces[i])
+            if(curr_set->refcount[i] == 0)
             {
-                curr_set->refcount[i]--;
-                debug("Found trace %zu %p, decremented refcount to %i\n",
-                      index, curr_set->traces[i], curr_set->refcount[i]);
-            }
-            else
-            {
-                err("Correct trace %zu found, but pointer (%p vs %p) does not match -- freeing\n", index,
-                    trace, curr_set->traces[i]);
-                trace_free_memory(trace);
-
+                err("Trace %zu %p dereferenced more times than it was referenced\n",
+                    index, trace);
                 sem_release(&curr_set->set_lock);
-                return COHESIVE_CACHES ? (-EINVAL) : (0);
+                return -EINVAL;
             }
-            break;
+
+            curr_set->refcount[i]--;
+            debug("Found trace %zu %p, decremented refcount to %i\n",
+                  index, curr_set->traces[i], curr_set->refcount[i]);
+
+            sem_release(&curr_set->set_lock);
+            return 0;
         }
     }
-
     sem_release(&curr_set->set_lock);
+
+    // the set was fully pinned when this trace was produced
+    debug("Trace %zu %p was never cached, freeing\n", index, trace);
+    trace_free_memory(trace);
     return 0;
 }
@@ -4,79 +4,234 @@
 #include "platform.h"
 #include <stdlib.h>
 
-struct __ts_render_arg
+// indices a worker takes off the shared cursor at once
+#define RENDER_CHUNK_MAX    64
+#define RENDER_CHUNK_SPLIT  4
+
+// and how many of those it gets from the set in one go
+#define RENDER_BATCH        16
+
+/*
+ * Workers own a range [front, back) of indices and pop runs of up to
+ * RENDER_BATCH from its front, which are fetched with trace_get_many.
+ * Once that runs dry they take the next chunk off the shared cursor,
+ * and when the cursor reaches the end of the set they steal the back
+ * half of another worker's range instead. Chunks shrink as the set
+ * runs out, so the last few traces still spread over every worker.
+ */
+struct __ts_render_queue
 {
-    int thread_index;
-    LT_SEM_TYPE *done_signal;
-    LT_SEM_TYPE thread_signal;
+    LT_SEM_TYPE lock;
+    size_t front, back;
+};
 
+struct __ts_render_state
+{
     struct trace_set *ts;
-    size_t trace_index;
+    size_t nthreads;
+    struct __ts_render_queue *queues;
+
+    // guarded by lock
+    LT_SEM_TYPE lock;
+    size_t next;
     int ret;
 };
 
+struct __ts_render_arg
+{
+    int thread_index;
+    struct __ts_render_state *state;
+
+    size_t rendered, steals;
+};
+
+size_t __render_pop(struct __ts_render_queue *queue, size_t *index)
+{
+    size_t res;
+
+    sem_acquire(&queue->lock);
+    res = queue->back - queue->front;
+    if(res > RENDER_BATCH)
+        res = RENDER_BATCH;
+
+    *index = queue->front;
+    queue->front += res;
+    sem_release(&queue->lock);
+
+    return res;
+}
+
+void __render_install(struct __ts_render_queue *queue, size_t front, size_t back)
+{
+    sem_acquire(&queue->lock);
+    queue->front = front;
+    queue->back = back;
+    sem_release(&queue->lock);
+}
+
+bool __render_refill(struct __ts_render_state *state, size_t *front, size_t *back)
+{
+    size_t limit, chunk;
+
+    sem_acquire(&state->lock);
+    limit = ts_num_traces(state->ts);
+    if(state->ret < 0 || state->next >= limit)
+    {
+        sem_release(&state->lock);
+        return false;
+    }
+
+    chunk = (limit - state->next) / (RENDER_CHUNK_SPLIT * state->nthreads);
+    if(chunk == 0)
+        chunk = 1;
+    else if(chunk > RENDER_CHUNK_MAX)
+        chunk = RENDER_CHUNK_MAX;
+
+    *front = state->next;
+    *back = state->next + chunk;
+    state->next = *back;
+    sem_release(&state->lock);
+    return true;
+}
+
+bool __render_steal(struct __ts_render_state *state, int thief, size_t *front, size_t *back)
+{
+    size_t i, remaining;
+    struct __ts_render_queue *victim;
+
+    for(i = 1; i < state->nthreads; i++)
+    {
+        victim = &state->queues[(thief + i) % state->nthreads];
+
+        sem_acquire(&victim->lock);
+        remaining = victim->back - victim->front;
+        if(remaining > 0)
+        {
+            *back = victim->back;
+            *front = victim->back - (remaining + 1) / 2;
+            victim->back = *front;
+            sem_release(&victim->lock);
+            return true;
+        }
+        sem_release(&victim->lock);
+    }
+
+    return false;
+}
+
+size_t __render_next(struct __ts_render_arg *arg, size_t *index)
+{
+    size_t front, back, res;
+    struct __ts_render_state *state = arg->state;
+    struct __ts_render_queue *own = &state->queues[arg->thread_index];
+
+    res = __render_pop(own, index);
+    if(res > 0)
+        return res;
+
+    if(!__render_refill(state, &front, &back))
+    {
+        if(!__render_steal(state, arg->thread_index, &front, &back))
+            return 0;
+
+        arg->steals++;
+    }
+
+    // keep the first run for ourselves, the rest stays up for grabs
+    res = (back - front < RENDER_BATCH) ? back - front : RENDER_BATCH;
+    *index = front;
+    __render_install(own, front + res, back);
+    return res;
+}
+
+void __render_abort(struct __ts_render_state *state, int ret)
+{
+    size_t i;
+
+    sem_acquire(&state->lock);
+    if(state->ret == 0)
+        state->ret = ret;
+    sem_release(&state->lock);
+
+    for(i = 0; i < state->nthreads; i++)
+        __render_install(&state->queues[i], 0, 0);
+}
+
 #include "statistics.h"
 
 LT_THREAD_FUNC(__ts_render_func, thread_arg)
 {
     int ret;
+    size_t i, index, limit, count;
     struct __ts_render_arg *arg = (struct __ts_render_arg *) thread_arg;
-    struct trace *trace;
+    struct trace_set *ts = arg->state->ts;
+    struct trace *traces[RENDER_BATCH], *trace;
 
     struct accumulator *acc;
     float maxabs;
 
-    stat_create_single(&acc, STAT_MAXABS);
-
-    debug("Hello from thread %i, ts %p\n", arg->thread_index, arg->ts);
-    while(1)
+    ret = stat_create_single(&acc, STAT_MAXABS);
+    if(ret < 0)
     {
-        sem_acquire(&arg->thread_signal);
-        debug("Thread %i has woken up with trace set %p\n", arg->thread_index, arg->ts);
+        err("Thread %i failed to create accumulator\n", arg->thread_index);
+        __render_abort(arg->state, ret);
+        return NULL;
+    }
 
-        // exit condition
-        if(arg->ts == NULL)
+    debug("Hello from thread %i, ts %p\n", arg->thread_index, ts);
+    while((count = __render_next(arg, &index)) > 0)
+    {
+        // sets of unknown length may have shrunk since this was handed out
+        limit = ts_num_traces(ts);
+        if(index >= limit)
+            continue;
+        else if(count > limit - index)
+            count = limit - index;
+
+        ret = trace_get_many(ts, index, count, traces);
+        if(ret < 0)
         {
-            debug("Thread %i exiting cleanly\n", arg->thread_index);
-            arg->ret = 0;
-            return NULL;
+            err("Thread %i failed to get traces at index %zu + %zu\n",
+                arg->thread_index, index, count);
+            __render_abort(arg->state, ret);
+            break;
         }
 
-        debug("Working on trace %zu\n", arg->trace_index);
-
-        ret = trace_get(arg->ts, &trace, arg->trace_index);
-        if(ret < 0)
+        for(i = 0; i < count; i++, index++)
         {
-            err("Thread %i failed to get trace at index %zu\n",
-                arg->thread_index, arg->trace_index);
-            arg->ret = ret;
-
-            sem_release(arg->done_signal);
-            return NULL;
-        }
+            trace = traces[i];
 
-        stat_reset_accumulator(acc);
-        stat_accumulate_single_many(acc, trace->samples, trace->owner->num_samples);
-        stat_get(acc, STAT_MAXABS, 0, &maxabs);
+            // traces past the end of such a set come back empty
+            if(!trace->samples)
+            {
+                trace_free(trace);
+                continue;
+            }
 
-        if(arg->trace_index % 65536 == 0)
-            printf("\n");
-        else
-            printf(",");
-        printf("%0.5f", maxabs);
+            stat_reset_accumulator(acc);
+            stat_accumulate_single_many(acc, trace->samples, trace->owner->num_samples);
+            stat_get(acc, STAT_MAXABS, 0, &maxabs);
 
-        if(arg->trace_index % 65536 < 8)
-            err("%s\n", trace->title);
-        if(arg->trace_index % 65536 == 8)
-            err("\n");
+            if(index % 65536 == 0)
+                printf("\n");
+            else
+                printf(",");
+            printf("%0.5f", maxabs);
 
-        trace_free(trace);
+            if(index % 65536 < 8)
+                err("%s\n", trace->title);
+            if(index % 65536 == 8)
+                err("\n");
 
-        arg->ret = 1;
-        sem_release(arg->done_signal);
+            trace_free(trace);
+            arg->rendered++;
+        }
     }
 
-    err("Thread %i has finished\n", arg->thread_index);
+    debug("Thread %i exiting, rendered %zu traces with %zu steals\n",
+          arg->thread_index, arg->rendered, arg->steals);
+    stat_free_accumulator(acc);
+    return NULL;
 }
 
 struct render
@@ -91,17 +246,21 @@ struct render
 LT_THREAD_FUNC(__ts_render_controller, controller_arg)
 {
     int i, j, ret;
-    size_t curr_index = 0;
-    LT_SEM_TYPE done_signal;
+    struct __ts_render_state state;
 
     LT_THREAD_TYPE *handles;
     struct __ts_render_arg *args;
     struct render *arg = controller_arg;
 
-    ret = p_sem_create(&done_signal, arg->nthreads);
+    state.ts = arg->ts;
+    state.nthreads = arg->nthreads;
+    state.next = 0;
+    state.ret = 0;
+
+    ret = p_sem_create(&state.lock, 1);
     if(ret < 0)
     {
-        err("Failed to initialize done semaphore\n");
+        err("Failed to initialize render state lock\n");
         arg->ret = -errno;
         return NULL;
     }
@@ -111,7 +270,7 @@ LT_THREAD_FUNC(__ts_render_controller, controller_arg)
     {
         err("Unable to allocate pthread handles\n");
         ret = -ENOMEM;
-        goto __destroy_done_signal;
+        goto __destroy_state_lock;
     }
 
     args = calloc(arg->nthreads, sizeof(struct __ts_render_arg));
@@ -122,20 +281,25 @@ LT_THREAD_FUNC(__ts_render_controller, controller_arg)
         goto __free_handles;
     }
 
+    state.queues = calloc(arg->nthreads, sizeof(struct __ts_render_queue));
+    if(!state.queues)
+    {
+        err("Unable to allocate worker queues\n");
+        ret = -ENOMEM;
+        goto __free_args;
+    }
+
     for(i = 0; i < arg->nthreads; i++)
     {
         args[i].thread_index = i;
-        args[i].done_signal = &done_signal;
-        args[i].ts = arg->ts;
-        args[i].trace_index = 0;
-        args[i].ret = 1;
+        args[i].state = &state;
 
-        ret = p_sem_create(&args[i].thread_signal, 0);
+        ret = p_sem_create(&state.queues[i].lock, 1);
         if(ret < 0)
         {
-            err("Unable to allocate thread signal for thread %i\n", i);
+            err("Unable to allocate queue lock for thread %i\n", i);
             ret = -errno;
-            goto __teardown_args;
+            goto __teardown_queues;
         }
     }
 
@@ -145,65 +309,34 @@ LT_THREAD_FUNC(__ts_render_controller, controller_arg)
         if(ret < 0)
         {
             err("Unable to create pthread %i\n", i);
-            ret = -errno;
-            goto __kill_threads;
+            __render_abort(&state, -errno);
+            goto __join_threads;
         }
     }
 
-    while(curr_index < ts_num_traces(arg->ts))
-    {
-        debug("Waiting for worker thread\n");
-        sem_acquire(&done_signal);
-
-        for(i = 0; i < arg->nthreads; i++)
-        {
-            if(args[i].ret == 1)
-            {
-                debug("Dispatching index %zu to thread %i\n", curr_index, i);
-
-                args[i].trace_index = curr_index++;
-                args[i].ret = 0;
-
-                sem_release(&args[i].thread_signal);
-                break;
-            }
-            else if(args[i].ret < 0)
-            {
-                err("Detected error for thread %i\n", i);
-
-                ret = args[i].ret;
-                goto __done;
-            }
-        }
-    }
-
-    debug("Done, waiting for workers to finish\n");
-    for(i = 0; i < arg->nthreads; i++)
-        sem_acquire(&done_signal);
-
-    ret = 0;
-__done:
-    i = arg->nthreads;
-__kill_threads:
+    debug("Started %zu workers, waiting for them to finish\n", arg->nthreads);
+__join_threads:
     for(j = 0; j < i; j++)
-    {
-        args[j].ts = NULL;
-
-        sem_release(&args[j].thread_signal);
         p_thread_join(handles[j]);
-    }
+
+    ret = state.ret;
+    if(ret < 0)
+        err("Detected error in worker threads\n");
 
     i = arg->nthreads;
-__teardown_args:
+__teardown_queues:
     for(j = 0; j < i; j++)
-        p_sem_destroy(&args[j].thread_signal);
+        p_sem_destroy(&state.queues[j].lock);
+    free(state.queues);
+
+__free_args:
     free(args);
 
 __free_handles:
     free(handles);
 
-__destroy_done_signal:
-    p_sem_destroy(&done_signal);
+__destroy_state_lock:
+    p_sem_destroy(&state.lock);
 
     arg->ret = ret;
     return NULL;
@@ -0,0 +1,344 @@
+#include "trace.h"
+#include "__trace_internal.h"
+
+#include "platform.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMO_MAGIC          "LTMEMO1"
+#define MEMO_PATH_MAX       4096
+
+// per-trace state in the file, on top of which REQ_* members it had
+#define MEMO_PRESENT        (1 << 7)
+
+/*
+ * Materialized output of one trace set, kept across runs. The file
+ * holds a header, one state byte per trace, and then a fixed-size slot
+ * per trace in index order. Slots are written once, before their state
+ * byte, so anything marked present can be read without further locking.
+ */
+struct memo_header
+{
+    char magic[8];
+    uint64_t key;
+    uint64_t num_traces, num_samples;
+    uint64_t title_size, data_size;
+};
+
+struct trace_memo
+{
+    LT_SEM_TYPE lock;
+    LT_FILE_TYPE *file;
+
+    size_t slot_size, slot_start;
+    uint8_t *state;
+
+    // guarded by lock
+    size_t restored, written;
+    bool failed;
+};
+
+// FNV-1a, chained through seed
+uint64_t tm_key(uint64_t seed, const void *buf, size_t len)
+{
+    size_t i;
+    uint64_t res = seed ? seed : 0xcbf29ce484222325ULL;
+
+    for(i = 0; i < len; i++)
+    {
+        res ^= ((const uint8_t *) buf)[i];
+        res *= 0x100000001b3ULL;
+    }
+
+    return res;
+}
+
+uint64_t tm_source_key(const char *name)
+{
+    int ret;
+    const char *path;
+    uint64_t size, mtime, res;
+
+    // "backend path", and only files have an identity to key on
+    path = strchr(name, ' ');
+    if(!path)
+        return 0;
+
+    ret = p_file_identity(path + 1, &size, &mtime);
+    if(ret < 0)
+        return 0;
+
+    res = tm_key(0, name, strlen(name));
+    res = tm_key(res, &size, sizeof(uint64_t));
+    return tm_key(res, &mtime, sizeof(uint64_t));
+}
+
+int __memo_load(struct trace_memo *memo, struct memo_header *expect)
+{
+    int ret;
+    struct memo_header found;
+
+    ret = p_pread(memo->file, &found, sizeof(struct memo_header), 0);
+    if(ret < 0 || memcmp(&found, expect, sizeof(struct memo_header)) != 0)
+        return -EINVAL;
+
+    return p_pread(memo->file, memo->state, expect->num_traces, sizeof(struct memo_header));
+}
+
+int ts_memoize(struct trace_set *ts, const char *dir)
+{
+    int ret;
+    size_t i, present = 0;
+    char path[MEMO_PATH_MAX];
+    struct memo_header header;
+    struct trace_memo *res;
+
+    if(!ts || !dir)
+    {
+        err("Invalid trace set or directory\n");
+        return -EINVAL;
+    }
+
+    if(ts->memo)
+    {
+        err("Trace set %zu is already memoized\n", ts->set_id);
+        return -EINVAL;
+    }
+
+    if(ts->key == 0 || ts->num_traces == UNKNOWN_NUM_TRACES || ts->num_traces == 0)
+    {
+        err("Trace set %zu has no stable key or trace count, can't memoize\n", ts->set_id);
+        return -EINVAL;
+    }
+
+    memset(&header, 0, sizeof(struct memo_header));
+    memcpy(header.magic, MEMO_MAGIC, sizeof(MEMO_MAGIC));
+    header.key = ts->key;
+    header.num_traces = ts->num_traces;
+    header.num_samples = ts->num_samples;
+    header.title_size = ts->title_size;
+    header.data_size = ts->data_size;
+
+    res = calloc(1, sizeof(struct trace_memo));
+    if(!res)
+    {
+        err("Failed to allocate memo\n");
+        return -ENOMEM;
+    }
+
+    res->slot_size = ts->title_size + ts->data_size + ts->num_samples * sizeof(float);
+    res->slot_start = sizeof(struct memo_header) + ts->num_traces;
+
+    res->state = calloc(ts->num_traces, sizeof(uint8_t));
+    if(!res->state)
+    {
+        err("Failed to allocate memo state array\n");
+        ret = -ENOMEM;
+        goto __free_res;
+    }
+
+    ret = p_sem_create(&res->lock, 1);
+    if(ret < 0)
+    {
+        err("Failed to initialize memo lock semaphore: %s\n", strerror(errno));
+        ret = -errno;
+        goto __free_state;
+    }
+
+    snprintf(path, MEMO_PATH_MAX, "%s/%016llx.memo", dir, (unsigned long long) ts->key);
+
+    // pick up where an earlier run left off, or start over
+    res->file = p_fopen(path, "r+b");
+    if(res->file && __memo_load(res, &header) < 0)
+    {
+        warn("Memo file %s doesn't match trace set %zu, replacing it\n", path, ts->set_id);
+        p_fclose(res->file);
+        res->file = NULL;
+        memset(res->state, 0, ts->num_traces);
+    }
+
+    if(!res->file)
+    {
+        res->file = p_fopen(path, "w+b");
+        if(!res->file)
+        {
+            err("Failed to create memo file %s: %s\n", path, strerror(errno));
+            ret = -errno;
+            goto __free_lock;
+        }
+
+        ret = p_pwrite(res->file, &header, sizeof(struct memo_header), 0);
+        if(ret >= 0)
+            ret = p_pwrite(res->file, res->state, ts->num_traces, sizeof(struct memo_header));
+
+        if(ret < 0)
+        {
+            err("Failed to write memo file header\n");
+            goto __close_file;
+        }
+    }
+
+    for(i = 0; i < ts->num_traces; i++)
+    {
+        if(res->state[i] & MEMO_PRESENT)
+            present++;
+    }
+
+    critical("Memo file %s for trace set %zu has %zu of %zu traces\n",
+             path, ts->set_id, present, ts->num_traces);
+    ts->memo = res;
+    return 0;
+
+__close_file:
+    p_fclose(res->file);
+
+__free_lock:
+    p_sem_destroy(&res->lock);
+
+__free_state:
+    free(res->state);
+
+__free_res:
+    free(res);
+    return ret;
+}
+
+void tm_free(struct trace_set *ts)
+{
+    if(!ts || !ts->memo)
+        return;
+
+    debug("Memo for trace set %zu: %zu traces restored, %zu written\n",
+          ts->set_id, ts->memo->restored, ts->memo->written);
+
+    p_fclose(ts->memo->file);
+    p_sem_destroy(&ts->memo->lock);
+    free(ts->memo->state);
+    free(ts->memo);
+    ts->memo = NULL;
+}
+
+int tm_read(struct trace_set *ts, struct trace *t)
+{
+    int ret = 0;
+    size_t offs;
+    uint8_t state;
+    struct trace_memo *memo;
+
+    if(!ts || !ts->memo || !t)
+    {
+        err("Invalid trace set, memo, or trace\n");
+        return -EINVAL;
+    }
+
+    memo = ts->memo;
+    sem_with(&memo->lock, state = memo->state[t->index]);
+    if(!(state & MEMO_PRESENT))
+        return 0;
+
+    offs = memo->slot_start + t->index * memo->slot_size;
+    if(state & REQ_TITLE)
+    {
+        t->title = tp_alloc(ts, POOL_TITLE, ts->title_size);
+        ret = t->title ? p_pread(memo->file, t->title, ts->title_size, offs) : -ENOMEM;
+    }
+
+    if(ret >= 0 && (state & REQ_DATA))
+    {
+        t->data = tp_alloc(ts, POOL_DATA, ts->data_size);
+        ret = t->data ? p_pread(memo->file, t->data, ts->data_size,
+                                offs + ts->title_size) : -ENOMEM;
+    }
+
+    if(ret >= 0 && (state & REQ_SAMPLES))
+    {
+        t->samples = tp_alloc(ts, POOL_SAMPLES, ts->num_samples * sizeof(float));
+        ret = t->samples ? p_pread(memo->file, t->samples, ts->num_samples * sizeof(float),
+                                   offs + ts->title_size + ts->data_size) : -ENOMEM;
+    }
+
+    if(ret < 0)
+    {
+        err("Failed to read trace %zu from memo file\n", t->index);
+        tp_release(ts, POOL_TITLE, t->title, ts->title_size);
+        tp_release(ts, POOL_DATA, t->data, ts->data_size);
+        tp_release(ts, POOL_SAMPLES, t->samples, ts->num_samples * sizeof(float));
+        t->title = NULL;
+        t->data = NULL;
+        t->samples = NULL;
+        return ret;
+    }
+
+    sem_with(&memo->lock, memo->restored++);
+    return 1;
+}
+
+int tm_write(struct trace_set *ts, struct trace *t)
+{
+    int ret = 0;
+    size_t offs;
+    uint8_t state = MEMO_PRESENT;
+    struct trace_memo *memo;
+
+    if(!ts || !ts->memo || !t)
+    {
+        err("Invalid trace set, memo, or trace\n");
+        return -EINVAL;
+    }
+
+    memo = ts->memo;
+    offs = memo->slot_start + t->index * memo->slot_size;
+
+    // after one failed write, the memo stays read-only
+    sem_acquire(&memo->lock);
+    if(memo->failed)
+    {
+        sem_release(&memo->lock);
+        return 0;
+    }
+    sem_release(&memo->lock);
+
+    // racing producers of one index write the same bytes, so that's fine
+    if(t->title)
+    {
+        state |= REQ_TITLE;
+        ret = p_pwrite(memo->file, t->title, ts->title_size, offs);
+    }
+
+    if(ret >= 0 && t->data)
+    {
+        state |= REQ_DATA;
+        ret = p_pwrite(memo->file, t->data, ts->data_size, offs + ts->title_size);
+    }
+
+    if(ret >= 0 && t->samples)
+    {
+        state |= REQ_SAMPLES;
+        ret = p_pwrite(memo->file, t->samples, ts->num_samples * sizeof(float),
+                       offs + ts->title_size + ts->data_size);
+    }
+
+    // only mark the trace present once all of it is on disk
+    if(ret >= 0)
+        ret = p_pwrite(memo->file, &state, sizeof(uint8_t),
+                       sizeof(struct memo_header) + t->index);
+
+    if(ret < 0)
+    {
+        sem_acquire(&memo->lock);
+        if(!memo->failed)
+            warn("Failed to write trace %zu to memo file, no longer memoizing trace set %zu\n",
+                 t->index, ts->set_id);
+
+        memo->failed = true;
+        sem_release(&memo->lock);
+        return ret;
+    }
+
+    sem_acquire(&memo->lock);
+    memo->state[t->index] = state;
+    memo->written++;
+    sem_release(&memo->lock);
+    return 0;
+}
@@ -0,0 +1,194 @@
+#include "trace.h"
+#include "__trace_internal.h"
+
+#include "platform.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// how much memory a pool may hold on to, per buffer class
+#define POOL_MAX_BYTES      (64 * 1024 * 1024)
+#define POOL_MIN_BUFFERS    4
+#define POOL_MAX_BUFFERS    256
+
+struct trace_pool
+{
+    LT_SEM_TYPE lock;
+    size_t capacity;
+
+    struct tp_class
+    {
+        size_t size, nfree;
+        void **free;
+
+        // guarded by lock, for reporting
+        size_t allocs, reuses;
+    } classes[NUM_POOL_CLASSES];
+};
+
+int tp_create(struct trace_set *ts)
+{
+    int ret, i;
+    size_t trace_bytes;
+    struct trace_pool *res;
+
+    if(!ts)
+    {
+        err("Invalid trace set\n");
+        return -EINVAL;
+    }
+
+    res = calloc(1, sizeof(struct trace_pool));
+    if(!res)
+    {
+        err("Failed to allocate buffer pool\n");
+        return -ENOMEM;
+    }
+
+    ret = p_sem_create(&res->lock, 1);
+    if(ret < 0)
+    {
+        err("Failed to initialize pool lock semaphore: %s\n", strerror(errno));
+        free(res);
+        return -errno;
+    }
+
+    res->classes[POOL_TRACE].size = sizeof(struct trace);
+    res->classes[POOL_TITLE].size = ts->title_size;
+    res->classes[POOL_DATA].size = ts->data_size;
+    res->classes[POOL_SAMPLES].size = ts->num_samples * sizeof(float);
+
+    // keep about POOL_MAX_BYTES worth of whole traces around
+    trace_bytes = ts->title_size + ts->data_size + ts->num_samples * sizeof(float);
+    res->capacity = trace_bytes ? POOL_MAX_BYTES / trace_bytes : POOL_MAX_BUFFERS;
+    if(res->capacity < POOL_MIN_BUFFERS)
+        res->capacity = POOL_MIN_BUFFERS;
+    else if(res->capacity > POOL_MAX_BUFFERS)
+        res->capacity = POOL_MAX_BUFFERS;
+
+    for(i = 0; i < NUM_POOL_CLASSES; i++)
+    {
+        res->classes[i].free = calloc(res->capacity, sizeof(void *));
+        if(!res->classes[i].free)
+        {
+            err("Failed to allocate pool free list\n");
+            ret = -ENOMEM;
+            goto __free_classes;
+        }
+    }
+
+    debug("Created buffer pool for trace set %zu, %zu buffers per class\n",
+          ts->set_id, res->capacity);
+    ts->pool = res;
+    return 0;
+
+__free_classes:
+    while(i-- > 0)
+        free(res->classes[i].free);
+
+    p_sem_destroy(&res->lock);
+    free(res);
+    return ret;
+}
+
+void tp_free(struct trace_set *ts)
+{
+    int i;
+    size_t j;
+    struct trace_pool *pool;
+
+    if(!ts || !ts->pool)
+        return;
+
+    pool = ts->pool;
+    debug("Pool for trace set %zu: %zu samples allocations, %zu reused\n",
+          ts->set_id, pool->classes[POOL_SAMPLES].allocs,
+          pool->classes[POOL_SAMPLES].reuses);
+
+    for(i = 0; i < NUM_POOL_CLASSES; i++)
+    {
+        for(j = 0; j < pool->classes[i].nfree; j++)
+            free(pool->classes[i].free[j]);
+
+        free(pool->classes[i].free);
+    }
+
+    p_sem_destroy(&pool->lock);
+    free(pool);
+    ts->pool = NULL;
+}
+
+void *tp_alloc(struct trace_set *ts, pool_class_t cls, size_t size)
+{
+    void *res = NULL;
+    struct tp_class *curr;
+
+    // anything not shaped like a whole trace of this set bypasses the pool
+    if(!ts || !ts->pool || size != ts->pool->classes[cls].size)
+        return calloc(1, size);
+
+    curr = &ts->pool->classes[cls];
+    sem_acquire(&ts->pool->lock);
+    curr->allocs++;
+    if(curr->nfree > 0)
+    {
+        curr->reuses++;
+        res = curr->free[--curr->nfree];
+    }
+    sem_release(&ts->pool->lock);
+
+    // recycled buffers are handed out as-is, except trace structs
+    if(!res)
+        res = calloc(1, size);
+    else if(cls == POOL_TRACE)
+        memset(res, 0, size);
+
+    return res;
+}
+
+void tp_release(struct trace_set *ts, pool_class_t cls, void *buf, size_t size)
+{
+    struct tp_class *curr;
+
+    if(!buf)
+        return;
+
+    if(!ts || !ts->pool || size != ts->pool->classes[cls].size)
+    {
+        free(buf);
+        return;
+    }
+
+    curr = &ts->pool->classes[cls];
+    sem_acquire(&ts->pool->lock);
+    if(curr->nfree < ts->pool->capacity)
+    {
+        curr->free[curr->nfree++] = buf;
+        buf = NULL;
+    }
+    sem_release(&ts->pool->lock);
+
+    if(buf)
+        free(buf);
+}
+
+void tp_release_trace(struct trace_set *ts, struct trace *t)
+{
+    if(!t)
+        return;
+
+    if(ts)
+    {
+        tp_release(ts, POOL_TITLE, t->title, ts->title_size);
+        tp_release(ts, POOL_DATA, t->data, ts->data_size);
+        tp_release(ts, POOL_SAMPLES, t->samples, ts->num_samples * sizeof(float));
+    }
+    else
+    {
+        free(t->title);
+        free(t->data);
+        free(t->samples);
+    }
+
+    tp_release(ts, POOL_TRACE, t, sizeof(struct trace));
+}
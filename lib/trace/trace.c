@@ -16,28 +16,96 @@ int trace_free_memory(struct trace *t)
     }
 
     if(t->owner && t->owner->prev && t->owner->tfm)
+    {
         t->owner->tfm->free(t);
-    else
+        tp_release(t->owner, POOL_TRACE, t, sizeof(struct trace));
+    }
+    else tp_release_trace(t->owner, t);
+
+    return 0;
+}
+
+// trace_get_many works through this many traces at a time
+#define GET_MANY_CHUNK      64
+
+// traces evicted earlier may be waiting in the spill file,
+// or an earlier run may have left them in the memo file
+bool __trace_restore(struct trace_set *ts, struct trace *t, bool reserved)
+{
+    if(reserved && tc_unspill(ts->cache, t) == 1)
+    {
+        debug("Restored trace %zu from spill file\n", TRACE_IDX(t));
+        return true;
+    }
+
+    if(ts->memo && tm_read(ts, t) == 1)
+    {
+        debug("Restored trace %zu from memo file\n", TRACE_IDX(t));
+        return true;
+    }
+
+    return false;
+}
+
+// produce num traces with consecutive indices, as one batch where possible
+int __trace_produce(struct trace_set *ts, struct trace **t, size_t num)
+{
+    int ret = 0;
+    size_t i;
+    struct trace_request req = {
+            .fields = REQ_ALL,
+            .first_sample = 0,
+            .num_samples = ts->num_samples
+    };
+
+    if(ts->prev && ts->tfm)
     {
-        if(t->title)
-            free(t->title);
+        if(ts->tfm->get_many && num > 1)
+            ret = ts->tfm->get_many(t, num);
+        else
+        {
+            for(i = 0; i < num && ret >= 0; i++)
+                ret = ts->tfm->get(t[i]);
+        }
+
+        if(ret < 0)
+        {
+            err("Failed to get trace from transformation\n");
+            return ret;
+        }
 
-        if(t->data)
-            free(t->data);
+        // the traces are good even if they can't be memoized
+        for(i = 0; ts->memo && i < num; i++)
+        {
+            if(tm_write(ts, t[i]) < 0)
+                break;
+        }
+    }
+    else
+    {
+        if(ts->backend->read_batch && num > 1)
+            ret = ts->backend->read_batch(t, num, &req);
+        else
+        {
+            for(i = 0; i < num && ret >= 0; i++)
+                ret = ts->backend->read(t[i]);
+        }
 
-        if(t->samples)
-            free(t->samples);
+        if(ret < 0)
+        {
+            err("Failed to read trace from file\n");
+            return ret;
+        }
     }
 
-    free(t);
     return 0;
 }
 
-int trace_get(struct trace_set *ts, struct trace **t, size_t index)
+int __trace_get(struct trace_set *ts, struct trace **t, size_t index, bool demand)
 {
     int ret;
     struct trace *t_result;
-    bool cache_missed = false;
+    bool reserved = false;
 
     if(!ts || !t)
     {
@@ -55,8 +123,10 @@ int trace_get(struct trace_set *ts, struct trace **t, size_t index)
     if(ts->cache)
     {
         debug("Looking up trace %zu in cache\n", index);
-        ret = tc_lookup(ts->cache, index, &t_result,
-                        COHESIVE_CACHES ? true : false);
+        if(demand)
+            tc_demand(ts->cache, index);
+
+        ret = tc_lookup(ts->cache, index, &t_result, true);
         if(ret < 0)
         {
             err("Failed to lookup trace in cache\n");
@@ -64,16 +134,17 @@ int trace_get(struct trace_set *ts, struct trace **t, size_t index)
         }
 
         if(t_result) goto __done;
-        else cache_missed = true;
+        else reserved = (ret == 1);
 
         debug("Trace %zu not found in cache\n", index);
     }
 
-    t_result = calloc(1, sizeof(struct trace));
+    t_result = tp_alloc(ts, POOL_TRACE, sizeof(struct trace));
     if(!t_result)
     {
         err("Failed to allocate memory for trace\n");
-        return -ENOMEM;
+        ret = -ENOMEM;
+        goto __cancel;
     }
 
     t_result->owner = ts;
@@ -82,30 +153,17 @@ int trace_get(struct trace_set *ts, struct trace **t, size_t index)
     t_result->data = NULL;
     t_result->samples = NULL;
 
-    if(ts->prev && ts->tfm)
+    if(!__trace_restore(ts, t_result, reserved))
     {
-        ret = ts->tfm->get(t_result);
+        ret = __trace_produce(ts, &t_result, 1);
         if(ret < 0)
-        {
-            err("Failed to get trace from transformation\n");
             goto __fail;
-        }
-    }
-    else
-    {
-        ret = ts->backend->read(t_result);
-        if(ret < 0)
-        {
-            err("Failed to read trace from file\n");
-            goto __fail;
-        }
     }
 
-    if(cache_missed)
+    if(reserved)
     {
         debug("Storing trace %zu in the cache\n", index);
-        ret = tc_store(ts->cache, index, t_result,
-                       COHESIVE_CACHES ? true : false);
+        ret = tc_store(ts->cache, index, t_result);
         if(ret < 0)
         {
             err("Failed to store result trace in cache\n");
@@ -119,16 +177,344 @@ __done:
 
 __fail:
     trace_free_memory(t_result);
+
+__cancel:
+    // let anyone waiting on this index retry it themselves
+    if(reserved)
+        tc_cancel(ts->cache, index);
+
     *t = NULL;
     return ret;
 }
 
+int trace_get(struct trace_set *ts, struct trace **t, size_t index)
+{
+    return __trace_get(ts, t, index, true);
+}
+
+int __trace_get_chunk(struct trace_set *ts, size_t first, size_t num,
+                      struct trace **traces, bool *reserved)
+{
+    int ret;
+    size_t i, j, npending = 0;
+    struct trace *pending[GET_MANY_CHUNK];
+
+    for(i = 0; i < num; i++)
+    {
+        if(ts->cache)
+        {
+            ret = tc_lookup(ts->cache, first + i, &traces[i], true);
+            if(ret < 0)
+            {
+                err("Failed to lookup trace in cache\n");
+                return ret;
+            }
+
+            if(traces[i]) continue;
+            else reserved[i] = (ret == 1);
+        }
+
+        traces[i] = tp_alloc(ts, POOL_TRACE, sizeof(struct trace));
+        if(!traces[i])
+        {
+            err("Failed to allocate memory for trace\n");
+            return -ENOMEM;
+        }
+
+        traces[i]->owner = ts;
+        traces[i]->index = first + i;
+        traces[i]->title = NULL;
+        traces[i]->data = NULL;
+        traces[i]->samples = NULL;
+
+        if(!__trace_restore(ts, traces[i], reserved[i]))
+            pending[npending++] = traces[i];
+    }
+
+    // hits and restored traces split what's left into runs of consecutive indices
+    for(i = 0; i < npending; i = j)
+    {
+        for(j = i + 1; j < npending; j++)
+        {
+            if(TRACE_IDX(pending[j]) != TRACE_IDX(pending[j - 1]) + 1)
+                break;
+        }
+
+        ret = __trace_produce(ts, &pending[i], j - i);
+        if(ret < 0)
+            return ret;
+    }
+
+    for(i = 0; i < num; i++)
+    {
+        if(reserved[i])
+        {
+            ret = tc_store(ts->cache, first + i, traces[i]);
+            if(ret < 0)
+            {
+                err("Failed to store result trace in cache\n");
+                return ret;
+            }
+
+            reserved[i] = false;
+        }
+    }
+
+    return 0;
+}
+
+int trace_get_many(struct trace_set *ts, size_t first, size_t count, struct trace **traces)
+{
+    int ret = 0;
+    size_t i, j, num;
+    bool reserved[GET_MANY_CHUNK];
+
+    if(!ts || !traces)
+    {
+        err("Invalid trace set or trace array\n");
+        return -EINVAL;
+    }
+
+    if(first + count > ts_num_traces(ts) || first + count < first)
+    {
+        err("Range %zu + %zu out of bounds for trace set\n", first, count);
+        return -EINVAL;
+    }
+
+    debug("Getting traces %zu + %zu from trace set %zu\n", first, count, ts->set_id);
+    memset(traces, 0, count * sizeof(struct trace *));
+    if(ts->cache && count > 0)
+        tc_demand(ts->cache, first + count - 1);
+
+    for(i = 0; i < count; i += num)
+    {
+        num = (count - i < GET_MANY_CHUNK) ? count - i : GET_MANY_CHUNK;
+        memset(reserved, 0, sizeof(reserved));
+
+        ret = __trace_get_chunk(ts, first + i, num, &traces[i], reserved);
+        if(ret < 0)
+            goto __fail;
+    }
+
+    return 0;
+
+__fail:
+    for(j = 0; j < i + num; j++)
+    {
+        // placeholders still held are released for someone else to retry
+        if(j >= i && reserved[j - i])
+        {
+            if(traces[j])
+                trace_free_memory(traces[j]);
+
+            tc_cancel(ts->cache, first + j);
+        }
+        else if(traces[j])
+            trace_free(traces[j]);
+
+        traces[j] = NULL;
+    }
+
+    return ret;
+}
+
+// copy the requested fields and samples of a whole trace into t
+int __trace_copy_request(struct trace_set *ts, struct trace *t, struct trace *full,
+                         struct trace_request *req)
+{
+    if((req->fields & REQ_TITLE) && full->title)
+    {
+        t->title = tp_alloc(ts, POOL_TITLE, ts->title_size);
+        if(!t->title)
+            goto __nomem;
+
+        memcpy(t->title, full->title, ts->title_size * sizeof(char));
+    }
+
+    if((req->fields & REQ_DATA) && full->data)
+    {
+        t->data = tp_alloc(ts, POOL_DATA, ts->data_size);
+        if(!t->data)
+            goto __nomem;
+
+        memcpy(t->data, full->data, ts->data_size * sizeof(uint8_t));
+    }
+
+    if((req->fields & REQ_SAMPLES) && full->samples && req->num_samples)
+    {
+        t->samples = tp_alloc(ts, POOL_SAMPLES, req->num_samples * sizeof(float));
+        if(!t->samples)
+            goto __nomem;
+
+        memcpy(t->samples, &full->samples[req->first_sample],
+               req->num_samples * sizeof(float));
+    }
+
+    return 0;
+
+__nomem:
+    err("Failed to allocate memory for requested fields\n");
+    if(t->title)
+        free(t->title);
+
+    if(t->data)
+        free(t->data);
+
+    t->title = NULL;
+    t->data = NULL;
+    return -ENOMEM;
+}
+
+void __trace_release_request(struct trace_set *ts, struct trace *t,
+                             struct trace_request *req)
+{
+    tp_release(ts, POOL_TITLE, t->title, ts->title_size);
+    tp_release(ts, POOL_DATA, t->data, ts->data_size);
+    tp_release(ts, POOL_SAMPLES, t->samples, req->num_samples * sizeof(float));
+
+    t->title = NULL;
+    t->data = NULL;
+    t->samples = NULL;
+}
+
+int trace_get_request(struct trace_set *ts, struct trace *t, size_t index,
+                      struct trace_request *req)
+{
+    int ret;
+    struct trace *full;
+
+    if(!ts || !t || !req)
+    {
+        err("Invalid trace set, trace, or request\n");
+        return -EINVAL;
+    }
+
+    if(req->first_sample + req->num_samples > ts_num_samples(ts))
+    {
+        err("Requested samples out of bounds for trace set\n");
+        return -EINVAL;
+    }
+
+    t->owner = ts;
+    t->index = index;
+    t->title = NULL;
+    t->data = NULL;
+    t->samples = NULL;
+
+    // uncached files can skip what isn't needed
+    if(!ts->tfm && !ts->cache && ts->backend && ts->backend->read_request)
+    {
+        if(index >= ts_num_traces(ts))
+        {
+            err("Index %zu out of bounds for trace set\n", index);
+            return -EINVAL;
+        }
+
+        return ts->backend->read_request(t, req);
+    }
+
+    ret = trace_get(ts, &full, index);
+    if(ret < 0)
+    {
+        err("Failed to get trace %zu\n", index);
+        return ret;
+    }
+
+    ret = __trace_copy_request(ts, t, full, req);
+    trace_free(full);
+    return ret;
+}
+
+int trace_get_request_many(struct trace_set *ts, struct trace *t, size_t first, size_t num,
+                           struct trace_request *req)
+{
+    int ret = 0;
+    size_t i;
+    struct trace **traces;
+
+    if(!ts || !t || !req)
+    {
+        err("Invalid trace set, trace array, or request\n");
+        return -EINVAL;
+    }
+
+    traces = calloc(num, sizeof(struct trace *));
+    if(!traces)
+    {
+        err("Failed to allocate trace pointer array\n");
+        return -ENOMEM;
+    }
+
+    // uncached files read the whole range at once
+    if(!ts->tfm && !ts->cache && ts->backend && ts->backend->read_batch && num > 1)
+    {
+        if(req->first_sample + req->num_samples > ts_num_samples(ts) ||
+           first + num > ts_num_traces(ts))
+        {
+            err("Request out of bounds for trace set\n");
+            ret = -EINVAL;
+            goto __free_traces;
+        }
+
+        for(i = 0; i < num; i++)
+        {
+            t[i].owner = ts;
+            t[i].index = first + i;
+            t[i].title = NULL;
+            t[i].data = NULL;
+            t[i].samples = NULL;
+            traces[i] = &t[i];
+        }
+
+        ret = ts->backend->read_batch(traces, num, req);
+        if(ret < 0)
+        {
+            err("Failed to read traces %zu + %zu from file\n", first, num);
+            for(i = 0; i < num; i++)
+                __trace_release_request(ts, &t[i], req);
+        }
+
+        goto __free_traces;
+    }
+
+    ret = trace_get_many(ts, first, num, traces);
+    if(ret < 0)
+    {
+        err("Failed to get traces %zu + %zu\n", first, num);
+        goto __free_traces;
+    }
+
+    for(i = 0; i < num; i++)
+    {
+        t[i].owner = ts;
+        t[i].index = first + i;
+        t[i].title = NULL;
+        t[i].data = NULL;
+        t[i].samples = NULL;
+
+        if(ret >= 0)
+            ret = __trace_copy_request(ts, &t[i], traces[i], req);
+
+        trace_free(traces[i]);
+    }
+
+    if(ret < 0)
+    {
+        for(i = 0; i < num; i++)
+            __trace_release_request(ts, &t[i], req);
+    }
+
+__free_traces:
+    free(traces);
+    return ret;
+}
+
 int trace_copy(struct trace **res, struct trace *prev)
 {
     int ret;
     struct trace *t_result;
 
-    t_result = calloc(1, sizeof(struct trace));
+    t_result = tp_alloc(prev->owner, POOL_TRACE, sizeof(struct trace));
     if(!t_result)
     {
         err("Failed to allocate memory for trace\n");
@@ -137,7 +523,7 @@ int trace_copy(struct trace **res, struct trace *prev)
 
     if(prev->title)
     {
-        t_result->title = calloc(prev->owner->title_size, sizeof(char));
+        t_result->title = tp_alloc(prev->owner, POOL_TITLE, prev->owner->title_size);
         if(!t_result->title)
         {
             err("Failed to allocate memory for new trace title\n");
@@ -153,7 +539,7 @@ int trace_copy(struct trace **res, struct trace *prev)
 
     if(prev->data)
     {
-        t_result->data = calloc(prev->owner->data_size, sizeof(uint8_t));
+        t_result->data = tp_alloc(prev->owner, POOL_DATA, prev->owner->data_size);
         if(!t_result->data)
         {
             err("Failed to allocate memory for new trace data\n");
@@ -169,7 +555,8 @@ int trace_copy(struct trace **res, struct trace *prev)
 
     if(prev->samples)
     {
-        t_result->samples = calloc(prev->owner->num_samples, sizeof(float));
+        t_result->samples = tp_alloc(prev->owner, POOL_SAMPLES,
+                                     prev->owner->num_samples * sizeof(float));
         if(!t_result->samples)
         {
             err("Failed to allocate memory for new trace samples\n");
@@ -29,6 +29,9 @@ int ts_open(struct trace_set **ts, const char *path)
     ts_result->set_id = gbl_set_index++;
     debug("Creating new trace set with ID %zu\n", ts_result->set_id);
 
+    // before create_backend, which splits the path in place
+    ts_result->key = tm_source_key(path);
+
     ret = create_backend(ts_result, path);
     if(ret < 0)
     {
@@ -43,6 +46,13 @@ int ts_open(struct trace_set **ts, const char *path)
         goto __free_backend;
     }
 
+    ret = tp_create(ts_result);
+    if(ret < 0)
+    {
+        err("Failed to create buffer pool for trace set\n");
+        goto __free_backend;
+    }
+
     ts_result->cache = NULL;
     ts_result->prev = NULL;
     ts_result->tfm = NULL;
@@ -74,6 +84,10 @@ int ts_close(struct trace_set *ts)
 
     debug("Closing trace set %zu\n", ts->set_id);
 
+    // nothing may be produced in the background past this point
+    if(ts->cache)
+        tc_stop_prefetch(ts->cache);
+
     // transform specific teardown
     if(ts->prev && ts->tfm)
         ts->tfm->exit(ts);
@@ -91,6 +105,10 @@ int ts_close(struct trace_set *ts)
     if(ts->cache)
         tc_free(ts->cache);
 
+    tm_free(ts);
+
+    // after the cache, since evicted traces are recycled into the pool
+    tp_free(ts);
     free(ts);
     return 0;
 }
@@ -129,6 +147,10 @@ int ts_transform(struct trace_set **new_ts, struct trace_set *prev, struct tfm *
     ts_result->tfm_next = NULL;
     ts_result->tfm_next_arg = NULL;
 
+    // only fully described chains are identifiable across runs
+    if(prev->key && transform->key)
+        ts_result->key = tm_key(prev->key, &transform->key, sizeof(uint64_t));
+
     debug("Creating transformed trace set with ID %zu\n", ts_result->set_id);
 
     // transform-specific initialization
@@ -140,6 +162,15 @@ int ts_transform(struct trace_set **new_ts, struct trace_set *prev, struct tfm *
         return ret;
     }
 
+    ret = tp_create(ts_result);
+    if(ret < 0)
+    {
+        err("Failed to create buffer pool for trace set\n");
+        transform->exit(ts_result);
+        free(ts_result);
+        return ret;
+    }
+
     *new_ts = ts_result;
     return 0;
 }
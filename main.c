@@ -48,6 +48,12 @@ static const char *filter_t_strings[] = {
         STR_AT_IDX(ALONG_DATA)
 };
 
+static const char *cache_policy_t_strings[] = {
+        [CACHE_LRU] = "lru",
+        [CACHE_CLOCK] = "clock",
+        [CACHE_2Q] = "2q"
+};
+
 static const char *aes_leakage_t_strings[] = {
         STR_AT_IDX(AES128_R0_R1_HD_NOMC),
         STR_AT_IDX(AES128_RO_HW_ADDKEY_OUT),
@@ -391,23 +397,89 @@ struct trace_set_entry
     struct trace_set *set;
 };
 
+// periodically writes the cache stats of every trace set, as JSON lines
+struct stats_dumper
+{
+    LT_THREAD_TYPE handle;
+    LT_FILE_TYPE *out;
+    int interval_ms;
+
+    LT_SEM_TYPE lock;
+    bool running;
+
+    struct list_head *trace_sets;
+};
+
 struct parse_args
 {
     struct list_head async;
     struct list_head trace_sets;
+    struct stats_dumper *stats;
 
     struct trace_set *main;
     size_t main_nthreads;
     int main_port;
 };
 
+// whether the next token is word, without consuming it
+bool __next_is(char **config, const char *word)
+{
+    size_t len;
+
+    if(!*config)
+        return false;
+
+    len = strcspn(*config, SEPARATORS ")");
+    return len == strlen(word) && strncmp(*config, word, len) == 0;
+}
+
 int parse_cache(char **config, struct trace_set *ts)
 {
-    int ret;
-    parse_arg(size, memsize, config);
+    int ret, i;
+    size_t size = 0;
+    cache_policy_t policy = CACHE_LRU;
+    bool shared = false, hashed = false, matched = true;
+
+    // either a size of its own, or a share of the global cache_budget
+    if(__next_is(config, "shared"))
+    {
+        strsep(config, SEPARATORS);
+        shared = true;
+    }
+    else
+    {
+        __parse_arg_nodecl(size, memsize, config);
+    }
+
     parse_arg(assoc, size_t, config);
 
-    ret = ts_create_cache(ts, size, assoc);
+    // optional trailing [lru|clock|2q] [hash], in either order
+    while(*config && matched)
+    {
+        matched = false;
+        for(i = 0; i < NUM_TABLE_ENTRIES(cache_policy_t_strings); i++)
+        {
+            if(__next_is(config, cache_policy_t_strings[i]))
+            {
+                policy = i;
+                matched = true;
+            }
+        }
+
+        if(__next_is(config, "hash"))
+        {
+            hashed = true;
+            matched = true;
+        }
+
+        if(matched)
+            strsep(config, SEPARATORS);
+    }
+
+    if(shared)
+        ret = ts_create_cache_shared(ts, assoc, policy, hashed);
+    else ret = ts_create_cache_policy(ts, size, assoc, policy, hashed);
+
     if(ret < 0)
     {
         err("Failed to create cache\n");
@@ -417,6 +489,182 @@ int parse_cache(char **config, struct trace_set *ts)
     return 0;
 }
 
+int parse_spill(char **config, struct trace_set *ts)
+{
+    int ret;
+    parse_arg(size, memsize, config);
+    parse_arg(path, string, config);
+
+    // step past the separator after the closing quote
+    strsep(config, SEPARATORS);
+
+    ret = ts_cache_spill(ts, path, size);
+    if(ret < 0)
+    {
+        err("Failed to create cache spill file\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+int parse_prefetch(char **config, struct trace_set *ts)
+{
+    int ret;
+    parse_arg(depth, size_t, config);
+
+    ret = ts_cache_prefetch(ts, depth);
+    if(ret < 0)
+    {
+        err("Failed to start cache prefetcher\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+int parse_memo(char **config, struct trace_set *ts)
+{
+    int ret;
+    parse_arg(dir, string, config);
+
+    // step past the separator after the closing quote
+    strsep(config, SEPARATORS);
+
+    ret = ts_memoize(ts, dir);
+    if(ret < 0)
+    {
+        err("Failed to memoize trace set\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+int parse_cache_budget(char **config)
+{
+    int ret;
+    parse_arg(size, memsize, config);
+
+    ret = ts_set_cache_budget(size);
+    if(ret < 0)
+    {
+        err("Failed to set global cache budget\n");
+        return ret;
+    }
+
+    return 1;
+}
+
+int parse_cache_stats(char **config, struct parse_args *parsed)
+{
+    int ret;
+    struct stats_dumper *res;
+
+    parse_arg(path, string, config);
+    strsep(config, SEPARATORS);
+    parse_arg(interval_ms, int, config);
+
+    if(parsed->stats || interval_ms <= 0)
+    {
+        err("Duplicate cache_stats, or invalid interval\n");
+        return -EINVAL;
+    }
+
+    res = calloc(1, sizeof(struct stats_dumper));
+    if(!res)
+    {
+        err("Failed to allocate stats dumper\n");
+        return -ENOMEM;
+    }
+
+    ret = p_sem_create(&res->lock, 1);
+    if(ret < 0)
+    {
+        err("Failed to initialize stats dumper lock\n");
+        free(res);
+        return -errno;
+    }
+
+    res->out = p_fopen(path, "w");
+    if(!res->out)
+    {
+        err("Failed to open cache stats file %s\n", path);
+        p_sem_destroy(&res->lock);
+        free(res);
+        return -EINVAL;
+    }
+
+    res->interval_ms = interval_ms;
+    res->trace_sets = &parsed->trace_sets;
+    parsed->stats = res;
+    return 1;
+}
+
+void __dump_stats(struct stats_dumper *dumper)
+{
+    char line[MAX_LINELENGTH * 2];
+    struct trace_set_entry *curr;
+
+    list_for_each_entry(curr, dumper->trace_sets, struct trace_set_entry, list)
+    {
+        if(ts_cache_stats_json(curr->set, line, sizeof(line)) == 0)
+            fprintf(dumper->out, "%s\n", line);
+    }
+
+    p_fflush(dumper->out);
+}
+
+LT_THREAD_FUNC(__stats_dumper_func, arg)
+{
+    int waited;
+    bool running = true;
+    struct stats_dumper *dumper = arg;
+
+    while(running)
+    {
+        // short naps, so that stopping doesn't wait a whole interval
+        for(waited = 0; running && waited < dumper->interval_ms; waited += 100)
+        {
+            p_sleep(dumper->interval_ms - waited < 100 ? dumper->interval_ms - waited : 100);
+            sem_with(&dumper->lock, running = dumper->running);
+        }
+
+        if(running)
+            __dump_stats(dumper);
+    }
+
+    return NULL;
+}
+
+int stats_dumper_start(struct stats_dumper *dumper)
+{
+    int ret;
+
+    dumper->running = true;
+    ret = p_thread_create(&dumper->handle, __stats_dumper_func, dumper);
+    if(ret < 0)
+    {
+        err("Failed to create stats dumper thread\n");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+void stats_dumper_stop(struct stats_dumper *dumper)
+{
+    sem_with(&dumper->lock, dumper->running = false);
+    p_thread_join(dumper->handle);
+
+    // and one last time, with everything finished
+    __dump_stats(dumper);
+
+    p_fclose(dumper->out);
+    p_sem_destroy(&dumper->lock);
+    free(dumper);
+}
+
 int parse_render(char **config, struct trace_set *ts, struct parse_args *parsed)
 {
     int ret;
@@ -507,6 +755,33 @@ int parse_extras(char **config, struct trace_set *ts, struct parse_args *parsed)
                 return ret;
             }
         }
+        else if(strcmp(type, "spill") == 0)
+        {
+            ret = parse_spill(config, ts);
+            if(ret < 0)
+            {
+                err("Failed to parse spill\n");
+                return ret;
+            }
+        }
+        else if(strcmp(type, "prefetch") == 0)
+        {
+            ret = parse_prefetch(config, ts);
+            if(ret < 0)
+            {
+                err("Failed to parse prefetch\n");
+                return ret;
+            }
+        }
+        else if(strcmp(type, "memo") == 0)
+        {
+            ret = parse_memo(config, ts);
+            if(ret < 0)
+            {
+                err("Failed to parse memo\n");
+                return ret;
+            }
+        }
         else if(strcmp(type, "render") == 0)
         {
             if(parsed->main)
@@ -574,14 +849,26 @@ int parse_transform(char *line, struct trace_set **ts,
 {
     int ret;
     char *curr = line, *type;
+    char params[MAX_LINELENGTH];
 
     struct trace_set_entry *new_entry;
     struct tfm *tfm = NULL;
 
+    // the stage itself, without extras, is what identifies its output
+    strncpy(params, line, MAX_LINELENGTH - 1);
+    params[MAX_LINELENGTH - 1] = '\0';
+    params[strcspn(params, "(\n")] = '\0';
+
     type = strsep(&curr, SEPARATORS);
 
+    // global settings, which don't create a trace set
+    if(strcmp(type, "cache_budget") == 0)
+        return parse_cache_budget(&curr);
+    else if(strcmp(type, "cache_stats") == 0)
+        return parse_cache_stats(&curr, parsed);
+
     // system
-    if(strcmp(type, "source") == 0)
+    else if(strcmp(type, "source") == 0)
         ret = __parse_tfm_source(&curr, ts);
     else if(strcmp(type, "save") == 0)
         ret = __parse_tfm_save(&curr, &tfm);
@@ -649,6 +936,13 @@ int parse_transform(char *line, struct trace_set **ts,
 
     if(tfm)
     {
+        ret = tfm_describe(tfm, params);
+        if(ret < 0)
+        {
+            err("Failed to describe transform\n");
+            return ret;
+        }
+
         ret = ts_transform(ts, prev, tfm);
         if(ret < 0)
         {
@@ -776,6 +1070,7 @@ int main(int argc, char *argv[])
     parsed.main = NULL;
     parsed.main_nthreads = -1;
     parsed.main_port = -1;
+    parsed.stats = NULL;
 
     ret = parse_config(argv[1], &parsed);
     if(ret < 0)
@@ -784,6 +1079,16 @@ int main(int argc, char *argv[])
         return ret;
     }
 
+    if(parsed.stats)
+    {
+        ret = stats_dumper_start(parsed.stats);
+        if(ret < 0)
+        {
+            err("Failed to start cache stats dumper\n");
+            return ret;
+        }
+    }
+
     if(parsed.main_nthreads != -1)
     {
         if(parsed.main_port == -1)
@@ -842,6 +1147,9 @@ int main(int argc, char *argv[])
         free(curr_render);
     }
 
+    if(parsed.stats)
+        stats_dumper_stop(parsed.stats);
+
     list_for_each_entry_safe(curr_ts, n_ts, &parsed.trace_sets, struct trace_set_entry, list)
     {
         ts_close(curr_ts->set);
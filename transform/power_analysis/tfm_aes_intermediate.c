@@ -211,6 +211,7 @@ int tfm_aes_intermediate(struct tfm **tfm, aes_leakage_t leakage_model)
     struct cpa_args cpa_args = {
             .power_model = NULL,
             .num_models = PMS_PER_THREAD,
+            .shared_scan = true,
             .consumer_init = tfm_aes_intermediate_init,
             .consumer_exit = tfm_aes_intermediate_exit,
             .progress_title = tfm_aes_intermediate_progress_title,
@@ -192,6 +192,7 @@ int tfm_aes_knownkey(struct tfm **tfm)
     struct cpa_args cpa_args = {
             .power_model = aes128_knownkey_models,
             .num_models = PMS_PER_THREAD,
+            .shared_scan = true,
             .consumer_init = tfm_aes_knownkey_init,
             .consumer_exit = tfm_aes_knownkey_exit,
             .progress_title = tfm_aes_knownkey_progress_title,
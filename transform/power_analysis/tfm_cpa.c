@@ -4,6 +4,7 @@
 
 #include "__tfm_internal.h"
 #include "__trace_internal.h"
+#include "platform.h"
 
 #include <string.h>
 #include <errno.h>
@@ -13,6 +14,85 @@
 #define CPA_REPORT_INTERVAL     100000
 #define CPA_TITLE_SIZE          128
 
+// worker threads per scan, and how many traces they take at once
+#define CPA_THREADS             4
+#define CPA_CHUNK               64
+
+struct __cpa_state;
+
+/*
+ * Outputs computed by a shared scan, until they're asked for. Threads
+ * asking for an output while the scan runs join it as extra workers,
+ * and then wait on scan_done for it to finish. At most as many guests
+ * as the scan has workers of its own hold accumulators at once.
+ */
+struct tfm_cpa_state
+{
+    LT_SEM_TYPE lock;
+    LT_SEM_TYPE scan_done;
+
+    // guarded by lock
+    bool scanned, scanning;
+    struct __cpa_state *scan;
+    int waiters, guests;
+    float **pearson;
+};
+
+int __tfm_cpa_create_state(struct trace_set *ts)
+{
+    int ret;
+    struct tfm_cpa_state *state;
+
+    state = calloc(1, sizeof(struct tfm_cpa_state));
+    if(!state)
+    {
+        err("Failed to allocate CPA state\n");
+        return -ENOMEM;
+    }
+
+    state->pearson = calloc(ts->num_traces, sizeof(float *));
+    if(!state->pearson)
+    {
+        err("Failed to allocate CPA output array\n");
+        ret = -ENOMEM;
+        goto __free_state;
+    }
+
+    ret = p_sem_create(&state->lock, 1);
+    if(ret < 0)
+    {
+        err("Failed to initialize CPA state semaphore\n");
+        ret = -errno;
+        goto __free_pearson;
+    }
+
+    ret = p_sem_create(&state->scan_done, 0);
+    if(ret < 0)
+    {
+        err("Failed to initialize CPA scan semaphore\n");
+        ret = -errno;
+        goto __destroy_lock;
+    }
+
+    state->scanned = false;
+    state->scanning = false;
+    state->scan = NULL;
+    state->waiters = 0;
+    state->guests = 0;
+    ts->tfm_state = state;
+    return 0;
+
+__destroy_lock:
+    p_sem_destroy(&state->lock);
+
+__free_pearson:
+    free(state->pearson);
+
+__free_state:
+    free(state);
+    return ret;
+}
+
 int __tfm_cpa_init(struct trace_set *ts)
 {
     int ret;
@@ -45,6 +125,17 @@ int __tfm_cpa_init(struct trace_set *ts)
         return -EINVAL;
     }
 
+    if(tfm->shared_scan && ts->num_traces > 1)
+    {
+        ret = __tfm_cpa_create_state(ts);
+        if(ret < 0)
+        {
+            err("Failed to create shared scan state\n");
+            tfm->consumer_exit(ts, tfm->init_args);
+            return ret;
+        }
+    }
+
     return 0;
 }
 
@@ -97,180 +188,786 @@ size_t __tfm_cpa_trace_size(struct trace_set *ts)
 
 void __tfm_cpa_exit(struct trace_set *ts)
 {
+    size_t i;
+    struct tfm_cpa_state *state = ts->tfm_state;
     struct cpa_args *tfm = TFM_DATA(ts->tfm);
+
+    if(state)
+    {
+        for(i = 0; i < ts->num_traces; i++)
+            free(state->pearson[i]);
+
+        p_sem_destroy(&state->scan_done);
+        p_sem_destroy(&state->lock);
+        free(state->pearson);
+        free(state);
+        ts->tfm_state = NULL;
+    }
+
     tfm->consumer_exit(ts, tfm->init_args);
 }
 
-int __tfm_cpa_get(struct trace *t)
+/*
+ * Input traces are split among a pool of workers, each of which takes
+ * runs of CPA_CHUNK traces at a time and accumulates into accumulators
+ * of its own. The pool lives for the whole scan and works through one
+ * CPA_REPORT_INTERVAL of input traces at a time: start lets every worker
+ * into an interval, and the last one out of it posts finished, after
+ * which the scan merges their accumulators into the total. That is what
+ * intermediate results are reported from.
+ *
+ * A scan covers a range of outputs at once, so that every input trace
+ * is read once and then fed to the power models of all of them. Guests
+ * (threads otherwise blocked on a shared scan) can join the pool while
+ * it runs, straight into the current interval if there is one.
+ */
+struct __cpa_state
+{
+    struct trace_set *ts;
+    size_t first_out, num_out;
+    LT_SEM_TYPE start, finished;
+
+    // guarded by lock
+    LT_SEM_TYPE lock;
+    size_t next, end;
+    bool done;
+    int running;
+    int nworkers, nguests, max_workers;
+    struct __cpa_worker **workers;
+};
+
+struct __cpa_worker
 {
-    int i, j, ret;
-    int count = 0;
+    LT_THREAD_TYPE handle;
+    struct __cpa_state *state;
 
-    struct trace *curr = NULL;
-    float *pm, *pearson;
-    char title[CPA_TITLE_SIZE];
+    struct accumulator **acc;
+    int *count;
+    float *pm;
+    int ret;
+};
 
-    struct accumulator *acc;
-    struct cpa_args *tfm = TFM_DATA(t->owner->tfm);
+void __cpa_free_accs(struct accumulator **acc, int *count, size_t num_out)
+{
+    size_t o;
 
-    pm = calloc(tfm->num_models, sizeof(float));
-    if(!pm)
+    if(acc)
     {
-        err("Failed to allocate power model array\n");
-        return -ENOMEM;
+        for(o = 0; o < num_out; o++)
+        {
+            if(acc[o])
+                stat_free_accumulator(acc[o]);
+        }
+
+        free(acc);
     }
 
-    ret = stat_create_dual_array(&acc, STAT_PEARSON, ts_num_samples(t->owner->prev), tfm->num_models);
-    if(ret < 0)
+    free(count);
+}
+
+int __cpa_create_accs(struct trace_set *ts, size_t num_out,
+                      struct accumulator ***acc, int **count)
+{
+    int ret;
+    size_t o;
+    struct accumulator **res_acc;
+    int *res_count;
+    struct cpa_args *tfm = TFM_DATA(ts->tfm);
+
+    res_acc = calloc(num_out, sizeof(struct accumulator *));
+    res_count = calloc(num_out, sizeof(int));
+    if(!res_acc || !res_count)
     {
-        err("Failed to create accumulator\n");
-        goto __free_pm;
+        err("Failed to allocate accumulator arrays\n");
+        ret = -ENOMEM;
+        goto __fail;
     }
 
-    for(i = 0; i < ts_num_traces(t->owner->prev); i++)
+    for(o = 0; o < num_out; o++)
     {
-        if(i % CPA_REPORT_INTERVAL == 0)
-            warn("CPA %zu working on trace %i\n", TRACE_IDX(t), i);
-
-        ret = trace_get(t->owner->prev, &curr, i);
+        ret = stat_create_dual_array(&res_acc[o], STAT_PEARSON,
+                                     ts_num_samples(ts->prev), tfm->num_models);
         if(ret < 0)
         {
-            err("Failed to get trace at index %i\n", i);
-            goto __free_accumulator;
+            err("Failed to create accumulator\n");
+            goto __fail;
+        }
+    }
+
+    *acc = res_acc;
+    *count = res_count;
+    return 0;
+
+__fail:
+    __cpa_free_accs(res_acc, res_count, num_out);
+    return ret;
+}
+
+size_t __cpa_claim(struct __cpa_state *state, size_t *first)
+{
+    size_t res;
+
+    sem_acquire(&state->lock);
+    res = state->end - state->next;
+    if(res > CPA_CHUNK)
+        res = CPA_CHUNK;
+
+    *first = state->next;
+    state->next += res;
+    sem_release(&state->lock);
+
+    return res;
+}
+
+void __cpa_abort(struct __cpa_state *state)
+{
+    sem_acquire(&state->lock);
+    state->next = state->end;
+    sem_release(&state->lock);
+}
+
+// feed num input traces from first to the power models of every output
+int __cpa_accumulate(struct __cpa_worker *worker, size_t first, size_t num)
+{
+    int j, ret;
+    size_t i, o;
+
+    struct trace *traces[CPA_CHUNK], *curr;
+    struct __cpa_state *state = worker->state;
+    struct trace_set *ts = state->ts;
+    struct cpa_args *tfm = TFM_DATA(ts->tfm);
+
+    ret = trace_get_many(ts->prev, first, num, traces);
+    if(ret < 0)
+    {
+        err("Failed to get traces at index %zu + %zu\n", first, num);
+        return ret;
+    }
+
+    for(i = 0; i < num && ret >= 0; i++)
+    {
+        curr = traces[i];
+        if(!curr->samples || !curr->data)
+        {
+            debug("No samples or data for index %zu, skipping\n", first + i);
+            continue;
         }
 
-        if(curr->samples && curr->data)
+        for(o = 0; o < state->num_out; o++)
         {
             for(j = 0; j < tfm->num_models; j++)
             {
                 ret = tfm->power_model(curr->data,
                                        (size_t) (tfm->num_models *
-                                                 TRACE_IDX(t) + j), &pm[j]);
+                                                 (state->first_out + o) + j), &worker->pm[j]);
                 if(ret < 0)
                 {
-                    err("Failed to calculate power model for trace %i, lets skip this one\n", i);
-                    goto __next_trace;
+                    err("Failed to calculate power model for trace %zu, lets skip this one\n",
+                        first + i);
+                    break;
                 }
             }
 
-            err("%f\n", pm[0]);
-            ret = stat_accumulate_dual_array(acc, curr->samples, pm,
-                                             ts_num_samples(t->owner->prev), j);
+            if(j < tfm->num_models)
+            {
+                ret = 0;
+                continue;
+            }
+
+            debug("%f\n", worker->pm[0]);
+            ret = stat_accumulate_dual_array(worker->acc[o], curr->samples, worker->pm,
+                                             ts_num_samples(ts->prev), j);
             if(ret < 0)
             {
-                err("Failed to accumulate index %i\n", i);
-                goto __free_trace;
+                err("Failed to accumulate index %zu\n", first + i);
+                break;
             }
 
-            count++;
-            if(count % CPA_REPORT_INTERVAL == 0)
+            worker->count[o]++;
+        }
+    }
+
+    for(i = 0; i < num; i++)
+        trace_free(traces[i]);
+
+    return ret;
+}
+
+// work through intervals until the scan is done, starting in one if running
+void __cpa_participate(struct __cpa_worker *worker, bool running)
+{
+    int ret;
+    size_t first, num;
+    bool done;
+    struct __cpa_state *state = worker->state;
+
+    while(1)
+    {
+        if(!running)
+        {
+            sem_acquire(&state->start);
+            sem_with(&state->lock, done = state->done);
+            if(done)
+                break;
+        }
+
+        // after an error, stop claiming but still check in
+        running = false;
+        while(worker->ret >= 0 && (num = __cpa_claim(state, &first)) > 0)
+        {
+            ret = __cpa_accumulate(worker, first, num);
+            if(ret < 0)
             {
-                if(t->owner->tfm_next)
-                {
-                    ret = stat_get_all(acc, STAT_PEARSON, &pearson);
-                    if(ret < 0)
-                    {
-                        err("Failed to get all pearson values from accumulator\n");
-                        goto __free_trace;
-                    }
-
-                    debug("CPA %zu pushing intermediate %zu\n", TRACE_IDX(t),
-                          TRACE_IDX(t) + ts_num_traces(t->owner) *
-                                         (count / CPA_REPORT_INTERVAL - 1));
-
-                    memset(title, 0, CPA_TITLE_SIZE * sizeof(char));
-                    snprintf(title, CPA_TITLE_SIZE,
-                             "CPA %zu (%i traces)", TRACE_IDX(t), count);
-
-                    ret = t->owner->tfm_next(t->owner->tfm_next_arg, PORT_CPA_PROGRESS, 4,
-                                             TRACE_IDX(t) + ts_num_traces(t->owner) *
-                                                            (count / CPA_REPORT_INTERVAL - 1),
-                                             title, NULL, pearson);
-                    if(ret < 0)
-                    {
-                        err("Failed to push pearson to consumer\n");
-                        goto __free_trace;
-                    }
-
-                    for(j = 0; j < tfm->num_models; j++)
-                    {
-                        memset(title, 0, CPA_TITLE_SIZE * sizeof(char));
-
-                        tfm->progress_title(title, CPA_TITLE_SIZE,
-                                            tfm->num_models * TRACE_IDX(t) + j,
-                                            count);
-
-                        ret = t->owner->tfm_next(t->owner->tfm_next_arg, PORT_CPA_SPLIT_PM_PROGRESS, 4,
-                                                 tfm->num_models * ts_num_traces(t->owner) *
-                                                 (count / CPA_REPORT_INTERVAL - 1) +
-                                                 tfm->num_models * TRACE_IDX(t) + j,
-                                                 title, NULL,
-                                                 &pearson[j * ts_num_samples(t->owner) / tfm->num_models]);
-                        if(ret < 0)
-                        {
-                            err("Failed to push pearson to consumer\n");
-                            goto __free_trace;
-                        }
-                    }
-
-                    free(pearson);
-                }
+                worker->ret = ret;
+                __cpa_abort(state);
             }
         }
-        else debug("No samples or data for index %i, skipping\n", i);
 
-__next_trace:
-        trace_free(curr);
-        curr = NULL;
+        sem_acquire(&state->lock);
+        if(--state->running == 0)
+            sem_release(&state->finished);
+        sem_release(&state->lock);
     }
+}
 
-    t->title = NULL;
-    t->data = NULL;
+LT_THREAD_FUNC(__cpa_worker_func, worker_arg)
+{
+    __cpa_participate(worker_arg, false);
+    return NULL;
+}
+
+int __cpa_start_workers(struct __cpa_state *state, struct __cpa_worker *workers, int nworkers)
+{
+    int i, ret;
+
+    state->done = false;
+    state->running = 0;
+    state->nguests = 0;
+    state->nworkers = nworkers;
+
+    for(i = 0; i < nworkers; i++)
+        state->workers[i] = &workers[i];
+
+    for(i = 0; i < nworkers; i++)
+    {
+        workers[i].ret = 0;
+        ret = p_thread_create(&workers[i].handle, __cpa_worker_func, &workers[i]);
+        if(ret < 0)
+        {
+            err("Failed to create CPA worker thread %i\n", i);
+            ret = -errno;
+            goto __stop_workers;
+        }
+    }
+
+    return 0;
+
+__stop_workers:
+    sem_with(&state->lock, state->done = true);
+    for(nworkers = i, i = 0; i < nworkers; i++)
+        sem_release(&state->start);
+
+    for(i = 0; i < nworkers; i++)
+        p_thread_join(workers[i].handle);
+
+    return ret;
+}
+
+// stops own workers and guests alike, between intervals
+void __cpa_stop_workers(struct __cpa_state *state, struct __cpa_worker *workers, int nworkers)
+{
+    int i, total, nguests;
+
+    sem_acquire(&state->lock);
+    state->done = true;
+    total = state->nworkers;
+    nguests = state->nguests;
+    sem_release(&state->lock);
+
+    for(i = 0; i < total; i++)
+        sem_release(&state->start);
+
+    for(i = 0; i < nworkers; i++)
+        p_thread_join(workers[i].handle);
+
+    // guests check out through finished, and are gone after that
+    for(i = 0; i < nguests; i++)
+        sem_acquire(&state->finished);
+}
+
+// whether a running scan still takes guests
+bool __cpa_joinable(struct __cpa_state *state)
+{
+    bool joinable;
+
+    sem_acquire(&state->lock);
+    joinable = !state->done && state->nworkers < state->max_workers;
+    sem_release(&state->lock);
+    return joinable;
+}
+
+// add a guest to a running scan, reporting whether it's mid-interval
+int __cpa_join(struct __cpa_state *state, struct __cpa_worker *guest, bool *running)
+{
+    int ret = 0;
+
+    sem_acquire(&state->lock);
+    if(state->done || state->nworkers == state->max_workers)
+    {
+        ret = -EBUSY;
+        goto __unlock;
+    }
+
+    guest->state = state;
+    guest->ret = 0;
+    state->workers[state->nworkers++] = guest;
+    state->nguests++;
+
+    *running = (state->running > 0);
+    if(*running)
+        state->running++;
+
+__unlock:
+    sem_release(&state->lock);
+    return ret;
+}
+
+// let the pool through one interval, and wait for all of it to finish
+int __cpa_run_interval(struct __cpa_state *state, size_t first, size_t end)
+{
+    int i, nworkers, ret = 0;
+
+    sem_acquire(&state->lock);
+    state->next = first;
+    state->end = end;
+    state->running = nworkers = state->nworkers;
+    sem_release(&state->lock);
+
+    for(i = 0; i < nworkers; i++)
+        sem_release(&state->start);
+
+    sem_acquire(&state->finished);
+
+    sem_with(&state->lock, nworkers = state->nworkers);
+    for(i = 0; i < nworkers; i++)
+    {
+        if(state->workers[i]->ret < 0)
+        {
+            err("Detected error in CPA worker thread %i\n", i);
+            ret = state->workers[i]->ret;
+        }
+    }
+
+    return ret;
+}
+
+int __tfm_cpa_report(struct trace_set *ts, size_t index,
+                     struct accumulator *acc, int count, size_t report)
+{
+    int j, ret;
+    float *pearson;
+    char title[CPA_TITLE_SIZE];
+    struct cpa_args *tfm = TFM_DATA(ts->tfm);
 
     ret = stat_get_all(acc, STAT_PEARSON, &pearson);
     if(ret < 0)
     {
         err("Failed to get all pearson values from accumulator\n");
-        t->samples = NULL;
+        return ret;
     }
-    else
+
+    debug("CPA %zu pushing intermediate %zu\n", index,
+          index + ts_num_traces(ts) * report);
+
+    memset(title, 0, CPA_TITLE_SIZE * sizeof(char));
+    snprintf(title, CPA_TITLE_SIZE,
+             "CPA %zu (%i traces)", index, count);
+
+    ret = ts->tfm_next(ts->tfm_next_arg, PORT_CPA_PROGRESS, 4,
+                       index + ts_num_traces(ts) * report,
+                       title, NULL, pearson);
+    if(ret < 0)
     {
-        if(t->owner->tfm_next)
+        err("Failed to push pearson to consumer\n");
+        goto __free_pearson;
+    }
+
+    for(j = 0; j < tfm->num_models; j++)
+    {
+        memset(title, 0, CPA_TITLE_SIZE * sizeof(char));
+
+        tfm->progress_title(title, CPA_TITLE_SIZE,
+                            tfm->num_models * index + j,
+                            count);
+
+        ret = ts->tfm_next(ts->tfm_next_arg, PORT_CPA_SPLIT_PM_PROGRESS, 4,
+                           tfm->num_models * ts_num_traces(ts) * report +
+                           tfm->num_models * index + j,
+                           title, NULL,
+                           &pearson[j * ts_num_samples(ts) / tfm->num_models]);
+        if(ret < 0)
         {
-            for(j = 0; j < tfm->num_models; j++)
-            {
-                memset(title, 0, CPA_TITLE_SIZE * sizeof(char));
+            err("Failed to push pearson to consumer\n");
+            goto __free_pearson;
+        }
+    }
+
+__free_pearson:
+    free(pearson);
+    return ret;
+}
+
+int __tfm_cpa_push(struct trace_set *ts, size_t index, float *pearson, int count)
+{
+    int j, ret;
+    char title[CPA_TITLE_SIZE];
+    struct cpa_args *tfm = TFM_DATA(ts->tfm);
+
+    for(j = 0; j < tfm->num_models; j++)
+    {
+        memset(title, 0, CPA_TITLE_SIZE * sizeof(char));
+
+        tfm->progress_title(title, CPA_TITLE_SIZE,
+                            tfm->num_models * index + j,
+                            count);
+
+        ret = ts->tfm_next(ts->tfm_next_arg, PORT_CPA_SPLIT_PM, 4,
+                           tfm->num_models * index + j,
+                           title, NULL, &pearson[j * ts_num_samples(ts) / tfm->num_models]);
+        if(ret < 0)
+        {
+            err("Failed to push pearson to consumer\n");
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Compute outputs first_out to first_out + num_out - 1 of the set in one
+ * pass over the input, placing their pearson values in the (zeroed)
+ * pearson array. Memory use scales with num_out, as each worker keeps
+ * accumulators for all of them. With a shared state, the scan is open
+ * to guests for as long as its pool runs.
+ */
+int __tfm_cpa_scan(struct trace_set *ts, size_t first_out, size_t num_out,
+                   float **pearson, struct tfm_cpa_state *shared)
+{
+    int i, nworkers, ret;
+    size_t o, first, end;
+    int *count = NULL;
+
+    struct accumulator **acc = NULL;
+    struct __cpa_state state;
+    struct __cpa_worker *workers, *curr;
+    struct cpa_args *tfm = TFM_DATA(ts->tfm);
+
+    nworkers = CPA_THREADS;
+    state.max_workers = nworkers + (shared ? nworkers : 0);
+
+    workers = calloc(nworkers, sizeof(struct __cpa_worker));
+    state.workers = calloc(state.max_workers, sizeof(struct __cpa_worker *));
+    if(!workers || !state.workers)
+    {
+        err("Failed to allocate CPA workers\n");
+        ret = -ENOMEM;
+        goto __free_workers_arr;
+    }
+
+    state.ts = ts;
+    state.first_out = first_out;
+    state.num_out = num_out;
 
-                tfm->progress_title(title, CPA_TITLE_SIZE,
-                                    tfm->num_models * TRACE_IDX(t) + j,
-                                    count);
+    ret = p_sem_create(&state.lock, 1);
+    if(ret < 0)
+    {
+        err("Failed to initialize CPA state lock\n");
+        ret = -errno;
+        goto __free_workers_arr;
+    }
+
+    ret = p_sem_create(&state.start, 0);
+    if(ret < 0)
+    {
+        err("Failed to initialize CPA start semaphore\n");
+        ret = -errno;
+        goto __destroy_lock;
+    }
+
+    ret = p_sem_create(&state.finished, 0);
+    if(ret < 0)
+    {
+        err("Failed to initialize CPA finished semaphore\n");
+        ret = -errno;
+        goto __destroy_start;
+    }
+
+    ret = __cpa_create_accs(ts, num_out, &acc, &count);
+    if(ret < 0)
+    {
+        err("Failed to create accumulators\n");
+        goto __destroy_finished;
+    }
+
+    for(i = 0; i < nworkers; i++)
+    {
+        workers[i].state = &state;
+        workers[i].pm = calloc(tfm->num_models, sizeof(float));
+        if(!workers[i].pm)
+        {
+            err("Failed to allocate power model array\n");
+            ret = -ENOMEM;
+            goto __free_workers;
+        }
+
+        ret = __cpa_create_accs(ts, num_out, &workers[i].acc, &workers[i].count);
+        if(ret < 0)
+        {
+            err("Failed to create worker accumulators\n");
+            goto __free_workers;
+        }
+    }
+
+    ret = __cpa_start_workers(&state, workers, nworkers);
+    if(ret < 0)
+    {
+        err("Failed to start CPA workers\n");
+        goto __free_workers;
+    }
+
+    if(shared)
+        sem_with(&shared->lock, shared->scan = &state);
+
+    for(first = 0; first < ts_num_traces(ts->prev); first = end)
+    {
+        warn("CPA %zu working on trace %zu\n", first_out, first);
+
+        end = first + CPA_REPORT_INTERVAL;
+        if(end > ts_num_traces(ts->prev))
+            end = ts_num_traces(ts->prev);
 
-                ret = t->owner->tfm_next(t->owner->tfm_next_arg, PORT_CPA_SPLIT_PM, 4,
-                                         tfm->num_models * TRACE_IDX(t) + j,
-                                         title, NULL, &pearson[j * ts_num_samples(t->owner) / tfm->num_models]);
+        ret = __cpa_run_interval(&state, first, end);
+        if(ret < 0)
+        {
+            err("Failed to accumulate traces %zu to %zu\n", first, end);
+            goto __stop_workers;
+        }
+
+        // guests may join from here on, but they have nothing to merge yet
+        sem_with(&state.lock, i = state.nworkers);
+        while(i-- > 0)
+        {
+            curr = state.workers[i];
+            for(o = 0; o < num_out; o++)
+            {
+                ret = stat_merge_accumulator(acc[o], curr->acc[o]);
                 if(ret < 0)
                 {
-                    err("Failed to push pearson to consumer\n");
-                    goto __free_trace;
+                    err("Failed to merge worker accumulator\n");
+                    goto __stop_workers;
                 }
+
+                count[o] += curr->count[o];
+                curr->count[o] = 0;
+                stat_reset_accumulator(curr->acc[o]);
             }
         }
 
-        t->samples = pearson;
+        // progress is reported for every full interval of input traces
+        if(end - first == CPA_REPORT_INTERVAL && ts->tfm_next)
+        {
+            for(o = 0; o < num_out; o++)
+            {
+                ret = __tfm_cpa_report(ts, first_out + o, acc[o], count[o],
+                                       first / CPA_REPORT_INTERVAL);
+                if(ret < 0)
+                    goto __stop_workers;
+            }
+        }
     }
 
-__free_trace:
-    if(curr)
-        trace_free(curr);
+__stop_workers:
+    if(shared)
+        sem_with(&shared->lock, shared->scan = NULL);
 
-__free_accumulator:
-    stat_free_accumulator(acc);
+    __cpa_stop_workers(&state, workers, nworkers);
+    if(ret < 0)
+        goto __free_workers;
 
-__free_pm:
-    free(pm);
+    for(o = 0; o < num_out; o++)
+    {
+        ret = stat_get_all(acc[o], STAT_PEARSON, &pearson[o]);
+        if(ret < 0)
+        {
+            err("Failed to get all pearson values from accumulator\n");
+            goto __free_pearson;
+        }
+
+        if(ts->tfm_next)
+        {
+            ret = __tfm_cpa_push(ts, first_out + o, pearson[o], count[o]);
+            if(ret < 0)
+                goto __free_pearson;
+        }
+    }
+
+    goto __free_workers;
+
+__free_pearson:
+    for(o = 0; o < num_out; o++)
+    {
+        free(pearson[o]);
+        pearson[o] = NULL;
+    }
+
+__free_workers:
+    for(i = 0; i < nworkers; i++)
+    {
+        __cpa_free_accs(workers[i].acc, workers[i].count, num_out);
+        free(workers[i].pm);
+    }
+
+    __cpa_free_accs(acc, count, num_out);
+
+__destroy_finished:
+    p_sem_destroy(&state.finished);
+
+__destroy_start:
+    p_sem_destroy(&state.start);
+
+__destroy_lock:
+    p_sem_destroy(&state.lock);
+
+__free_workers_arr:
+    free(state.workers);
+    free(workers);
     return ret;
 }
 
+// work on the shared scan with accumulators of our own, if it lets us
+void __tfm_cpa_guest(struct trace_set *ts, struct tfm_cpa_state *state)
+{
+    int ret;
+    bool running, joined = false;
+    struct __cpa_worker guest;
+    struct cpa_args *tfm = TFM_DATA(ts->tfm);
+
+    // a shared scan always covers every output
+    memset(&guest, 0, sizeof(struct __cpa_worker));
+    guest.pm = calloc(tfm->num_models, sizeof(float));
+    ret = guest.pm ? __cpa_create_accs(ts, ts_num_traces(ts), &guest.acc, &guest.count) : -ENOMEM;
+    if(ret < 0)
+    {
+        warn("Failed to allocate CPA guest, waiting on the scan instead\n");
+        goto __free_pm;
+    }
+
+    // the scan may have finished or filled up while we allocated
+    sem_acquire(&state->lock);
+    if(state->scan)
+        joined = (__cpa_join(state->scan, &guest, &running) == 0);
+    sem_release(&state->lock);
+
+    if(joined)
+    {
+        __cpa_participate(&guest, running);
+
+        // the scan is gone once it sees us check out
+        sem_release(&guest.state->finished);
+    }
+
+    __cpa_free_accs(guest.acc, guest.count, ts_num_traces(ts));
+__free_pm:
+    free(guest.pm);
+}
+
+// join the shared scan running in another thread, then wait for it
+void __tfm_cpa_help(struct trace_set *ts, struct tfm_cpa_state *state)
+{
+    sem_acquire(&state->lock);
+    if(state->scan && state->guests < CPA_THREADS && __cpa_joinable(state->scan))
+    {
+        state->guests++;
+        sem_release(&state->lock);
+
+        __tfm_cpa_guest(ts, state);
+
+        sem_acquire(&state->lock);
+        state->guests--;
+    }
+
+    if(state->scanning)
+    {
+        state->waiters++;
+        sem_release(&state->lock);
+        sem_acquire(&state->scan_done);
+    }
+    else sem_release(&state->lock);
+}
+
+int __tfm_cpa_get(struct trace *t)
+{
+    int ret;
+    float *pearson = NULL;
+    struct tfm_cpa_state *state = t->owner->tfm_state;
+
+    t->title = NULL;
+    t->data = NULL;
+    t->samples = NULL;
+
+    if(state)
+    {
+        sem_acquire(&state->lock);
+        while(state->scanning)
+        {
+            sem_release(&state->lock);
+            __tfm_cpa_help(t->owner, state);
+            sem_acquire(&state->lock);
+        }
+
+        // whoever gets here first scans for every output, the rest help
+        if(!state->scanned)
+        {
+            state->scanning = true;
+            sem_release(&state->lock);
+
+            ret = __tfm_cpa_scan(t->owner, 0, ts_num_traces(t->owner), state->pearson, state);
+
+            sem_acquire(&state->lock);
+            state->scanning = false;
+            state->scanned = (ret >= 0);
+            for(; state->waiters > 0; state->waiters--)
+                sem_release(&state->scan_done);
+
+            if(ret < 0)
+            {
+                err("Failed to scan for all outputs\n");
+                sem_release(&state->lock);
+                return ret;
+            }
+        }
+
+        // each output is handed over once, asking again scans for it alone
+        pearson = state->pearson[TRACE_IDX(t)];
+        state->pearson[TRACE_IDX(t)] = NULL;
+        sem_release(&state->lock);
+    }
+
+    if(!pearson)
+    {
+        ret = __tfm_cpa_scan(t->owner, TRACE_IDX(t), 1, &pearson, NULL);
+        if(ret < 0)
+        {
+            err("Failed to scan for output %zu\n", TRACE_IDX(t));
+            return ret;
+        }
+    }
+
+    t->samples = pearson;
+    return 0;
+}
+
 void __tfm_cpa_free(struct trace *t)
 {
     free(t->samples);
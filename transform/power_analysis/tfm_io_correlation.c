@@ -142,6 +142,7 @@ int tfm_io_correlation(struct tfm **tfm, bool verify_data, int granularity, int
     struct cpa_args cpa_args = {
             .power_model = NULL,
             .num_models = 1,
+            .shared_scan = true,
             .consumer_init = tfm_io_correlation_init,
             .consumer_exit = tfm_io_correlation_exit,
             .progress_title = tfm_io_correlation_progress_title,
@@ -1,6 +1,5 @@
 #include "transform.h"
 #include "trace.h"
-#include "list.h"
 
 #include "__tfm_internal.h"
 #include "__trace_internal.h"
@@ -9,7 +8,14 @@
 #include <errno.h>
 #include <string.h>
 
-#define SENTINEL        SIZE_MAX
+// upper bound on how much is handed to the backend in one write
+#define COMMIT_BATCH_BYTES  (64 * 1024 * 1024)
+
+// rendered-but-uncommitted traces (and their ring slots) are bounded
+// by this many bytes, within this many slots
+#define COMMIT_QUEUE_BYTES  (256 * 1024 * 1024)
+#define COMMIT_QUEUE_MIN    64
+#define COMMIT_QUEUE_MAX    (64 * 1024)
 
 struct tfm_save_state
 {
@@ -18,11 +24,20 @@ struct tfm_save_state
     void *commit_data;
 };
 
+typedef enum
+{
+    ENTRY_FREE = 0,
+    ENTRY_PENDING,
+    ENTRY_DONE,
+    ENTRY_SKIPPED,
+    ENTRY_SENTINEL
+} entry_state_t;
+
 struct __commit_queue_entry
 {
-    struct list_head list;
     struct trace *trace;
     size_t prev_index;
+    entry_state_t state;
 };
 
 struct __commit_queue
@@ -33,107 +48,146 @@ struct __commit_queue
     struct trace_set *ts;
     int thread_ret;
 
+    // reorder ring, slot (prev_index % capacity) for every
+    // prev_index in [base, base + capacity)
     LT_SEM_TYPE list_lock;
-    struct list_head head;
+    struct __commit_queue_entry *ring;
+    size_t capacity, base;
+
+    // one per free slot, renderers block here when the ring is full
+    LT_SEM_TYPE slots;
+
+    // posted whenever the slot at base becomes committable
+    LT_SEM_TYPE ready;
+    bool exiting;
 
     size_t written;
     bool sentinel_seen;
 };
 
-int index_order(void *node1, void *node2)
-{
-    struct __commit_queue_entry *entry1 = node1;
-    struct __commit_queue_entry *entry2 = node2;
-
-    if(entry1->prev_index == SENTINEL)
-        return -1;
+#define RING_SLOT(queue, i)     (&(queue)->ring[(i) % (queue)->capacity])
 
-    if(entry2->prev_index == SENTINEL)
-        return 1;
-
-    return (int) entry2->prev_index - (int) entry1->prev_index;
-}
-
-void print_commit(void *data)
+int __ring_claim_entry(struct __commit_queue *queue, size_t *prev_index,
+                       size_t index, size_t prev_num_traces)
 {
-    struct __commit_queue_entry *entry = data;
-    fprintf(stderr, " %zu (%p)\n", entry->prev_index, entry->trace);
-}
-
-int __list_create_entry(struct __commit_queue *queue,
-                        struct __commit_queue_entry **res,
-                        size_t prev_index)
-{
-    int count = 0;
-    struct __commit_queue_entry *entry, *curr;
+    bool signal = false;
+    struct __commit_queue_entry *entry;
+    struct tfm_save_state *tfm_data = queue->ts->tfm_state;
 
-    if(!queue || !res)
+    // backpressure, wait until the committer frees up a slot
+    sem_acquire(&queue->slots);
+    if(queue->thread_ret < 0)
     {
-        err("Invalid commit queue or node\n");
-        return -EINVAL;
+        sem_release(&queue->slots);
+        err("Detected error in commit thread\n");
+        return queue->thread_ret;
     }
 
-    entry = calloc(1, sizeof(struct __commit_queue_entry));
-    if(!entry)
+    sem_acquire(&queue->list_lock);
+    if(index < tfm_data->num_traces_written)
     {
-        err("Failed to allocate commit queue entry\n");
-        return -ENOMEM;
+        debug("Index %zu < written %zu, exiting\n", index, tfm_data->num_traces_written);
+        sem_release(&queue->list_lock);
+        sem_release(&queue->slots);
+        return 1;
     }
 
-    entry->prev_index = prev_index;
+    *prev_index = tfm_data->prev_next_trace++;
+    entry = RING_SLOT(queue, *prev_index);
 
-    sem_acquire(&queue->list_lock);
-    list_for_each_entry(curr, &queue->head, struct __commit_queue_entry, list)
+    entry->trace = NULL;
+    entry->prev_index = *prev_index;
+    if(*prev_index >= prev_num_traces)
     {
-        if(curr->prev_index > prev_index)
-            break;
-        else count++;
+        // sentinels are committable right away
+        entry->state = ENTRY_SENTINEL;
+        signal = (*prev_index == queue->base);
     }
-    list_add_tail(&entry->list, &curr->list);
-    debug("Appending prev_index %zu at spot %i\n", prev_index, count);
-
+    else entry->state = ENTRY_PENDING;
     sem_release(&queue->list_lock);
-    *res = entry;
+
+    if(signal)
+        sem_release(&queue->ready);
+
     return 0;
 }
 
-int __list_remove_entry(struct __commit_queue *queue,
-                        struct __commit_queue_entry *entry)
+void __ring_complete_entry(struct __commit_queue *queue, size_t prev_index,
+                           struct trace *trace)
 {
-    if(!queue || !entry)
-    {
-        err("Invalid commit queue or node\n");
-        return -EINVAL;
-    }
+    bool signal;
+    struct __commit_queue_entry *entry;
 
     sem_acquire(&queue->list_lock);
-    list_del(&entry->list);
-    free(entry);
+    entry = RING_SLOT(queue, prev_index);
+    entry->trace = trace;
+    entry->state = trace ? ENTRY_DONE : ENTRY_SKIPPED;
+
+    // later slots are picked up along with the one at base
+    signal = (prev_index == queue->base);
     sem_release(&queue->list_lock);
 
-    return 0;
+    if(signal)
+        sem_release(&queue->ready);
 }
 
-int __commit_traces(struct __commit_queue *queue, struct list_head *write_head)
+int __commit_batch(struct __commit_queue *queue, struct trace **batch, size_t num)
 {
     int ret;
-    size_t prev_index;
+    size_t i;
 
-    struct trace *trace_to_commit;
-    struct __commit_queue_entry *entry;
+    if(num == 0)
+        return 0;
+
+    if(queue->ts->backend->write_batch)
+    {
+        ret = queue->ts->backend->write_batch(batch, num);
+        if(ret < 0)
+            err("Failed to append traces to file\n");
+    }
+    else
+    {
+        for(i = 0, ret = 0; i < num && ret >= 0; i++)
+        {
+            ret = queue->ts->backend->write(batch[i]);
+            if(ret < 0)
+                err("Failed to append trace to file\n");
+        }
+    }
 
-    while(!list_empty(write_head))
+    for(i = 0; i < num; i++)
     {
-        entry = list_entry(write_head->next, struct __commit_queue_entry, list);
+        // copied from the previous set, so recycle into its pool
+        tp_release_trace(queue->ts->prev, batch[i]);
+    }
 
-        prev_index = entry->prev_index;
-        trace_to_commit = entry->trace;
+    if(ret < 0)
+        return ret;
 
-        list_del(&entry->list);
-        free(entry);
+    queue->written += num;
+    return 0;
+}
 
-        if(prev_index == SENTINEL)
+int __commit_traces(struct __commit_queue *queue, struct __commit_queue_entry *entries,
+                    size_t count, struct trace **batch, size_t max_batch)
+{
+    int ret;
+    size_t i, num = 0;
+    struct trace *trace_to_commit;
+
+    for(i = 0; i < count; i++)
+    {
+        trace_to_commit = entries[i].trace;
+        if(entries[i].state == ENTRY_SKIPPED)
+            continue;
+        else if(entries[i].state == ENTRY_SENTINEL)
         {
+            // everything before the sentinel goes out first
+            ret = __commit_batch(queue, batch, num);
+            if(ret < 0)
+                return ret;
+
+            num = 0;
             debug("Encountered sentinel, setting num_traces %zu\n",
                   queue->written);
 
@@ -150,87 +204,139 @@ int __commit_traces(struct __commit_queue *queue, struct list_head *write_head)
                 if(trace_to_commit->owner != queue->ts)
                 {
                     err("Bad trace to commit -- unknown trace set\n");
-                    return -EINVAL;
+                    ret = -EINVAL;
+                    goto __release_batch;
                 }
 
                 debug("Committing %s\n", trace_to_commit->title);
 
-                trace_to_commit->index = queue->written;
-                ret = queue->ts->backend->write(trace_to_commit);
-                if(ret < 0)
+                trace_to_commit->index = queue->written + num;
+                batch[num++] = trace_to_commit;
+                entries[i].trace = NULL;
+
+                if(num == max_batch)
                 {
-                    err("Failed to append trace to file\n");
-                    return ret;
-                }
+                    ret = __commit_batch(queue, batch, num);
+                    if(ret < 0)
+                        return ret;
 
-                // make this an anonymous trace to ensure memory is actually freed
-                trace_to_commit->owner = NULL;
-                trace_free_memory(trace_to_commit);
-                queue->written++;
+                    num = 0;
+                }
             }
             else
             {
                 err("Encountered trace to write after seeing sentinel\n");
-                return -EINVAL;
+                ret = -EINVAL;
+                goto __release_batch;
             }
         }
     }
 
-    return 0;
+    return __commit_batch(queue, batch, num);
+
+__release_batch:
+    for(i = 0; i < num; i++)
+        tp_release_trace(queue->ts->prev, batch[i]);
+
+    return ret;
 }
 
 LT_THREAD_FUNC(__commit_thread, arg)
 {
     int ret;
-    size_t count;
+    size_t i, count = 0, max_batch;
+    bool exiting;
 
     struct __commit_queue *queue = arg;
-    struct __commit_queue_entry *curr;
-    struct tfm_save_state *tfm_data;
-    LIST_HEAD(write_head);
+    struct __commit_queue_entry *entries = NULL, *curr;
+    struct tfm_save_state *tfm_data = queue->ts->tfm_state;
+    struct trace **batch = NULL;
+
+    max_batch = COMMIT_BATCH_BYTES /
+                (queue->ts->title_size + queue->ts->data_size +
+                 queue->ts->num_samples * sizeof(float) + 1);
+    if(max_batch == 0)
+        max_batch = 1;
+    else if(max_batch > queue->capacity)
+        max_batch = queue->capacity;
+
+    entries = calloc(max_batch, sizeof(struct __commit_queue_entry));
+    batch = calloc(max_batch, sizeof(struct trace *));
+    if(!entries || !batch)
+    {
+        err("Failed to allocate commit buffers\n");
+        ret = -ENOMEM;
+        goto __fail;
+    }
 
     while(1)
     {
-        p_sleep(1000);
-        sem_acquire(&queue->list_lock);
+        // sleep until the slot at base can be written
+        sem_acquire(&queue->ready);
 
-        if(queue->ts == NULL)
+        do
         {
-            debug("Commit thread exiting cleanly\n");
-            queue->thread_ret = 0;
-            return NULL;
-        }
-
-        // examine the commit list
-        tfm_data = queue->ts->tfm_state;
+            // take the contiguous run at base, at most one batch at a time
+            sem_acquire(&queue->list_lock);
+            for(count = 0; count < max_batch; count++)
+            {
+                curr = RING_SLOT(queue, queue->base + count);
+                if(curr->state == ENTRY_FREE || curr->state == ENTRY_PENDING)
+                    break;
 
-        count = 0;
-        list_for_each_entry(curr, &queue->head, struct __commit_queue_entry, list)
-        {
-            if(curr->trace || curr->prev_index == SENTINEL)
-                count++;
-            else break;
-        }
+                entries[count] = *curr;
+                curr->state = ENTRY_FREE;
+                curr->trace = NULL;
+            }
 
-        list_cut_before(&write_head, &queue->head, &curr->list);
-        sem_release(&queue->list_lock);
+            queue->base += count;
+            exiting = queue->exiting;
+            sem_release(&queue->list_lock);
 
-        // write the collected batch
-        if(!list_empty(&write_head))
-        {
-            warn("Writing %zu traces\n", count);
-            ret = __commit_traces(queue, &write_head);
-            if(ret < 0)
+            // write the collected batch
+            if(count > 0)
             {
-                err("Failed to commit traces\n");
-                queue->thread_ret = ret;
-                return NULL;
+                debug("Writing %zu traces\n", count);
+                ret = __commit_traces(queue, entries, count, batch, max_batch);
+                if(ret < 0)
+                {
+                    err("Failed to commit traces\n");
+                    goto __fail;
+                }
+
+                // update global written counter, then let renderers reuse the slots
+                sem_with(&queue->list_lock, tfm_data->num_traces_written = queue->written);
+                for(i = 0; i < count; i++)
+                    sem_release(&queue->slots);
             }
+        } while(count == max_batch);
 
-            // update global written counter
-            sem_with(&queue->list_lock, tfm_data->num_traces_written += count);
+        if(exiting)
+        {
+            debug("Commit thread exiting cleanly\n");
+            queue->thread_ret = 0;
+            free(entries);
+            free(batch);
+            return NULL;
         }
     }
+
+__fail:
+    // traces taken off the ring but not handed to the backend
+    for(i = 0; entries && i < count; i++)
+    {
+        if(entries[i].trace)
+            tp_release_trace(queue->ts->prev, entries[i].trace);
+    }
+
+    // wake anyone waiting on the ring so they see the error
+    queue->thread_ret = ret;
+    for(i = 0; i < queue->capacity; i++)
+        sem_release(&queue->slots);
+
+    free(entries);
+    free(batch);
+    return NULL;
 }
 
 int __tfm_save_init(struct trace_set *ts)
@@ -276,12 +382,29 @@ int __tfm_save_init(struct trace_set *ts)
     if(!queue)
     {
         err("Failed to allocate commit queue struct\n");
+        ret = -ENOMEM;
         goto __close_backend;
     }
 
+    queue->capacity = COMMIT_QUEUE_BYTES /
+                      (ts_trace_size(ts) + sizeof(struct __commit_queue_entry));
+    if(queue->capacity < COMMIT_QUEUE_MIN)
+        queue->capacity = COMMIT_QUEUE_MIN;
+    else if(queue->capacity > COMMIT_QUEUE_MAX)
+        queue->capacity = COMMIT_QUEUE_MAX;
+
+    queue->ring = calloc(queue->capacity, sizeof(struct __commit_queue_entry));
+    if(!queue->ring)
+    {
+        err("Failed to allocate commit queue ring\n");
+        ret = -ENOMEM;
+        goto __free_commit_queue;
+    }
+
     queue->ts = ts;
     queue->thread_ret = 0;
-    LIST_HEAD_INIT_INLINE(queue->head);
+    queue->base = 0;
+    queue->exiting = false;
     queue->written = 0;
     queue->sentinel_seen = false;
 
@@ -289,7 +412,7 @@ int __tfm_save_init(struct trace_set *ts)
     if(ret < 0)
     {
         err("Failed to initialize sentinel semaphore\n");
-        goto __free_commit_queue;
+        goto __free_commit_ring;
     }
 
     ret = p_sem_create(&queue->list_lock, 1);
@@ -299,23 +422,48 @@ int __tfm_save_init(struct trace_set *ts)
         goto __destroy_sentinel_event;
     }
 
-    ret = p_thread_create(&queue->handle, __commit_thread, queue);
+    ret = p_sem_create(&queue->ready, 0);
     if(ret < 0)
     {
-        err("Failed to create commit thread\n");
+        err("Failed to initialize queue ready event\n");
         goto __destroy_queue_list;
     }
 
+    ret = p_sem_create(&queue->slots, (int) queue->capacity);
+    if(ret < 0)
+    {
+        err("Failed to initialize queue slot count\n");
+        goto __destroy_ready_event;
+    }
+
     tfm_data->commit_data = queue;
     ts->tfm_state = tfm_data;
+
+    ret = p_thread_create(&queue->handle, __commit_thread, queue);
+    if(ret < 0)
+    {
+        err("Failed to create commit thread\n");
+        ts->tfm_state = NULL;
+        goto __destroy_slot_count;
+    }
+
     return 0;
 
+__destroy_slot_count:
+    p_sem_destroy(&queue->slots);
+
+__destroy_ready_event:
+    p_sem_destroy(&queue->ready);
+
 __destroy_queue_list:
     p_sem_destroy(&queue->list_lock);
 
 __destroy_sentinel_event:
     p_sem_destroy(&queue->sentinel);
 
+__free_commit_ring:
+    free(queue->ring);
+
 __free_commit_queue:
     free(queue);
 
@@ -342,26 +490,32 @@ size_t __tfm_save_trace_size(struct trace_set *ts)
 void __tfm_save_exit(struct trace_set *ts)
 {
     int ret;
+    size_t i;
     struct tfm_save_state *tfm_data = ts->tfm_state;
     struct __commit_queue *queue = tfm_data->commit_data;
 
-    // first, wait for commit list to drain
-    while(1)
+    // the commit thread drains what is committable, then exits
+    sem_with(&queue->list_lock, queue->exiting = true);
+    sem_release(&queue->ready);
+    p_thread_join(queue->handle);
+
+    if(queue->thread_ret < 0)
+        err("Commit thread exited with error %i\n", queue->thread_ret);
+
+    for(i = 0; i < queue->capacity; i++)
     {
-        sem_acquire(&queue->list_lock);
-        if(list_empty(&queue->head))
+        if(queue->ring[i].trace)
         {
-            debug("Commit queue is drained\n");
-            break;
+            warn("Dropping uncommitted trace for prev_index %zu\n", queue->ring[i].prev_index);
+            tp_release_trace(ts->prev, queue->ring[i].trace);
         }
-        sem_release(&queue->list_lock);
     }
 
-    // kill the commit threads
-    queue->ts = NULL;
-    p_thread_join(queue->handle);
-
+    p_sem_destroy(&queue->slots);
+    p_sem_destroy(&queue->ready);
     p_sem_destroy(&queue->list_lock);
+    p_sem_destroy(&queue->sentinel);
+    free(queue->ring);
     free(queue);
 
     // finalize headers
@@ -370,6 +524,8 @@ void __tfm_save_exit(struct trace_set *ts)
     if(ret < 0)
         err("Failed to close backend for trace set\n");
 
+    // the backend frees itself, so don't let ts_close close it again
+    ts->backend = NULL;
     free(tfm_data);
     ts->tfm_state = NULL;
 }
@@ -381,48 +537,32 @@ int __render_to_index(struct trace_set *ts, size_t index)
 
     struct tfm_save_state *tfm_data = ts->tfm_state;
     struct __commit_queue *queue = tfm_data->commit_data;
-    struct __commit_queue_entry *entry;
     struct trace *t_prev, *t_result;
 
     while(1)
     {
-        sem_acquire(&queue->list_lock);
-        if(index < tfm_data->num_traces_written)
+        ret = __ring_claim_entry(queue, &prev_index, index, ts_num_traces(ts->prev));
+        if(ret < 0)
         {
-            debug("Index %zu < written %zu, exiting\n", index, tfm_data->num_traces_written);
-            sem_release(&queue->list_lock); break;
+            err("Failed to claim a commit queue slot\n");
+            return ret;
         }
-
-        prev_index = tfm_data->prev_next_trace++;
-        sem_release(&queue->list_lock);
+        else if(ret == 1)
+            break;
 
         debug("Checking prev_index %zu (want %zu)\n", prev_index, index);
         if(prev_index >= ts_num_traces(ts->prev))
         {
-            // send a sentinel down the pipeline
+            // the claimed slot already holds a sentinel
             debug("Index %zu out of bounds for previous trace set\n", prev_index);
-
-            ret = __list_create_entry(queue, &entry, SENTINEL);
-            if(ret < 0)
-            {
-                err("Failed to add sentinel to synchronization list\n");
-                return ret;
-            }
-
             return 1;
         }
 
-        ret = __list_create_entry(queue, &entry, prev_index);
-        if(ret < 0)
-        {
-            err("Failed to add prev index to synchronization list\n");
-            return ret;
-        }
-
         ret = trace_get(ts->prev, &t_prev, prev_index);
         if(ret < 0)
         {
             err("Failed to get trace from previous trace set\n");
+            __ring_complete_entry(queue, prev_index, NULL);
             return ret;
         }
 
@@ -432,29 +572,22 @@ int __render_to_index(struct trace_set *ts, size_t index)
         {
             debug("prev_index %zu not a valid index\n", prev_index);
             trace_free(t_prev);
-            __list_remove_entry(queue, entry);
+            __ring_complete_entry(queue, prev_index, NULL);
             continue;
         }
 
         debug("prev_index %zu is a valid index, appending\n", prev_index);
         ret = trace_copy(&t_result, t_prev);
-        t_result->owner = ts;
-
         trace_free(t_prev);
         if(ret < 0)
         {
             err("Failed to create new trace from previous\n");
+            __ring_complete_entry(queue, prev_index, NULL);
             return ret;
         }
 
-        entry->trace = t_result;
-        if(queue->thread_ret < 0)
-        {
-            err("Detected error in commit thread\n");
-            trace_free(t_result);
-            __list_remove_entry(queue, entry);
-            return queue->thread_ret;
-        }
+        t_result->owner = ts;
+        __ring_complete_entry(queue, prev_index, t_result);
     }
 
     return 0;
@@ -501,7 +634,7 @@ int __tfm_save_get(struct trace *t)
 
 void __tfm_save_free(struct trace *t)
 {
-    passthrough_free(t);
+    passthrough_release(t);
 }
 
 int tfm_save(struct tfm **tfm, char *path)
@@ -267,7 +267,7 @@ int __tfm_synchronize_get(struct trace *t)
 
 void __tfm_synchronize_free(struct trace *t)
 {
-    passthrough_free(t);
+    passthrough_release(t);
 }
 
 int tfm_synchronize(struct tfm **tfm, int max_distance)
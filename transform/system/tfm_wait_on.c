@@ -129,7 +129,7 @@ int __tfm_wait_on_push(void *arg, port_t port, int nargs, ...)
             new_trace->index = index;
 
             sem_acquire(&curr_waiter->lock);
-            ret = tc_store(curr_waiter->available, index, new_trace, false);
+            ret = tc_store(curr_waiter->available, index, new_trace);
             if(ret < 0)
             {
                 err("Failed to store new trace in cache\n");
@@ -243,7 +243,8 @@ int __tfm_wait_on_init(struct trace_set *ts)
     assoc = 8;
     entry->ntraces = __find_num_traces(ts, tfm->bufsize, assoc);
 
-    ret = tc_cache_manual(&entry->available, ts->set_id, entry->ntraces / assoc, assoc);
+    ret = tc_cache_manual(&entry->available, ts->set_id, entry->ntraces / assoc, assoc,
+                          CACHE_LRU, false);
     if(ret < 0)
     {
         err("Failed to create backing cache\n");
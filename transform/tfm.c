@@ -20,7 +20,7 @@ int copy_title(struct trace *to, struct trace *from)
 
     if(from->title)
     {
-        res = calloc(from->owner->title_size, sizeof(char));
+        res = tp_alloc(to->owner, POOL_TITLE, to->owner->title_size);
         if(!res)
         {
             err("Failed to allocate memory for trace title\n");
@@ -46,7 +46,7 @@ int copy_data(struct trace *to, struct trace *from)
 
     if(from->data)
     {
-        res = calloc(from->owner->data_size, sizeof(uint8_t));
+        res = tp_alloc(to->owner, POOL_DATA, to->owner->data_size);
         if(!res)
         {
             err("Failed to allocate memory for trace data\n");
@@ -72,7 +72,7 @@ int copy_samples(struct trace *to, struct trace *from)
 
     if(from->samples)
     {
-        res = calloc(from->owner->num_samples, sizeof(float));
+        res = tp_alloc(to->owner, POOL_SAMPLES, to->owner->num_samples * sizeof(float));
         if(!res)
         {
             err("Failed to allocate memory for trace samples\n");
@@ -147,6 +147,28 @@ void passthrough_free(struct trace *t)
         free(t->samples);
 }
 
+// for transforms whose members only ever come from passthrough()
+// or copy_*(), so they are recycled into the trace set's pool
+void passthrough_release(struct trace *t)
+{
+    tp_release(t->owner, POOL_TITLE, t->title, t->owner->title_size);
+    tp_release(t->owner, POOL_DATA, t->data, t->owner->data_size);
+    tp_release(t->owner, POOL_SAMPLES, t->samples,
+               t->owner->num_samples * sizeof(float));
+}
+
+int tfm_describe(struct tfm *tfm, const char *params)
+{
+    if(!tfm || !params)
+    {
+        err("Invalid transform or parameters\n");
+        return -EINVAL;
+    }
+
+    tfm->key = tm_key(0, params, strlen(params));
+    return 0;
+}
+
 // this is used by various transformations
 stat_t __summary_to_cability(summary_t s)
 {
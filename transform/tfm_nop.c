@@ -38,7 +38,7 @@ int __tfm_nop_get(struct trace *t)
 
 void __tfm_nop_free(struct trace *t)
 {
-    passthrough_free(t);
+    passthrough_release(t);
 }
 
 int tfm_nop(struct tfm **tfm)
@@ -101,7 +101,7 @@ int __tfm_verify_get(struct trace *t)
 
 void __tfm_verify_free(struct trace *t)
 {
-    passthrough_free(t);
+    passthrough_release(t);
 }
 
 int tfm_verify(struct tfm **tfm, crypto_t which)
@@ -98,9 +98,80 @@ int __tfm_append_get(struct trace *t)
     }
 }
 
+// copy num traces starting at first in from into t
+int __tfm_append_copy_many(struct trace **t, size_t num, struct trace_set *from, size_t first)
+{
+    int ret;
+    size_t i;
+    struct trace **prev_traces;
+
+    prev_traces = calloc(num, sizeof(struct trace *));
+    if(!prev_traces)
+    {
+        err("Failed to allocate previous trace array\n");
+        return -ENOMEM;
+    }
+
+    ret = trace_get_many(from, first, num, prev_traces);
+    if(ret < 0)
+    {
+        err("Failed to get traces from previous trace set\n");
+        goto __free_prev;
+    }
+
+    for(i = 0; i < num; i++)
+    {
+        if(ret >= 0)
+            ret = copy_title(t[i], prev_traces[i]);
+        if(ret >= 0)
+            ret = copy_data(t[i], prev_traces[i]);
+        if(ret >= 0)
+            ret = copy_samples(t[i], prev_traces[i]);
+
+        trace_free(prev_traces[i]);
+    }
+
+    if(ret < 0)
+        err("Failed to copy something\n");
+
+__free_prev:
+    free(prev_traces);
+    return ret;
+}
+
+int __tfm_append_get_many(struct trace **t, size_t num)
+{
+    int ret;
+    size_t split, first = TRACE_IDX(t[0]);
+    struct trace_set *ts = t[0]->owner;
+
+    // the run may straddle the end of the previous set
+    split = ts_num_traces(ts->prev);
+    split = first < split ? split - first : 0;
+    if(split > num)
+        split = num;
+
+    if(split > 0)
+    {
+        ret = __tfm_append_copy_many(t, split, ts->prev, first);
+        if(ret < 0)
+            return ret;
+    }
+
+    if(split < num)
+    {
+        ret = __tfm_append_copy_many(&t[split], num - split, ts->tfm_state,
+                                     first + split - ts_num_traces(ts->prev));
+        if(ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
 void __tfm_append_free(struct trace *t)
 {
-    passthrough_free(t);
+    passthrough_release(t);
 }
 
 int tfm_append(struct tfm **tfm, const char *path)
@@ -114,6 +185,7 @@ int tfm_append(struct tfm **tfm, const char *path)
     }
 
     ASSIGN_TFM_FUNCS(res, __tfm_append);
+    res->get_many = __tfm_append_get_many;
 
     res->data = calloc(strlen(path) + 1, sizeof(char));
     if(!res->data)
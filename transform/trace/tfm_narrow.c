@@ -47,51 +47,73 @@ void __tfm_narrow_exit(struct trace_set *ts)
 int __tfm_narrow_get(struct trace *t)
 {
     int ret;
-    float *res;
-
-    struct trace *prev_trace;
+    struct trace prev_trace;
     struct tfm_narrow *tfm = TFM_DATA(t->owner->tfm);
-
-    ret = trace_get(t->owner->prev, &prev_trace, TRACE_IDX(t) + tfm->first_trace);
+    struct trace_request req = {
+            .fields = REQ_ALL,
+            .first_sample = tfm->first_sample,
+            .num_samples = t->owner->num_samples
+    };
+
+    // backends that support it only read the narrowed window
+    ret = trace_get_request(t->owner->prev, &prev_trace,
+                            TRACE_IDX(t) + tfm->first_trace, &req);
     if(ret < 0)
     {
         err("Failed to get previous trace\n");
         return ret;
     }
 
-    ret = copy_title(t, prev_trace);
-    if(ret >= 0)
-        ret = copy_data(t, prev_trace);
+    t->title = prev_trace.title;
+    t->data = prev_trace.data;
+    t->samples = prev_trace.samples;
+    return 0;
+}
+
+int __tfm_narrow_get_many(struct trace **t, size_t num)
+{
+    int ret;
+    size_t i;
+    struct trace *prev_traces;
+    struct trace_set *ts = t[0]->owner;
+    struct tfm_narrow *tfm = TFM_DATA(ts->tfm);
+    struct trace_request req = {
+            .fields = REQ_ALL,
+            .first_sample = tfm->first_sample,
+            .num_samples = ts->num_samples
+    };
+
+    prev_traces = calloc(num, sizeof(struct trace));
+    if(!prev_traces)
+    {
+        err("Failed to allocate previous traces\n");
+        return -ENOMEM;
+    }
+
+    // the whole window of the run comes back from one request
+    ret = trace_get_request_many(ts->prev, prev_traces,
+                                 TRACE_IDX(t[0]) + tfm->first_trace, num, &req);
+    if(ret < 0)
+    {
+        err("Failed to get previous traces\n");
+        goto __free_prev;
+    }
 
-    if(ret >= 0)
+    for(i = 0; i < num; i++)
     {
-        if(prev_trace->samples)
-        {
-            res = calloc(t->owner->num_samples, sizeof(float));
-            if(!res)
-            {
-                err("Failed to allocate memory for trace samples\n");
-                ret = -ENOMEM;
-                goto __done;
-            }
-
-            memcpy(res, &prev_trace->samples[tfm->first_sample],
-                   t->owner->num_samples * sizeof(float));
-            t->samples = res;
-        }
-
-        ret = 0;
+        t[i]->title = prev_traces[i].title;
+        t[i]->data = prev_traces[i].data;
+        t[i]->samples = prev_traces[i].samples;
     }
-    else err("Failed to copy something\n");
 
-__done:
-    trace_free(prev_trace);
+__free_prev:
+    free(prev_traces);
     return ret;
 }
 
 void __tfm_narrow_free(struct trace *t)
 {
-    passthrough_free(t);
+    passthrough_release(t);
 }
 
 int tfm_narrow(struct tfm **tfm,
@@ -107,6 +129,7 @@ int tfm_narrow(struct tfm **tfm,
     }
 
     ASSIGN_TFM_FUNCS(res, __tfm_narrow);
+    res->get_many = __tfm_narrow_get_many;
 
     res->data = calloc(1, sizeof(struct tfm_narrow));
     if(!res->data)
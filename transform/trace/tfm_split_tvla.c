@@ -73,17 +73,23 @@ int __tfm_split_tvla_get(struct trace *t)
     int ret;
     bool type = TVLA_FIXED;
 
-    struct trace *prev_trace;
+    struct trace prev_trace;
     struct tfm_split_tvla *tfm = TFM_DATA(t->owner->tfm);
-
-    ret = trace_get(t->owner->prev, &prev_trace, TRACE_IDX(t));
+    struct trace_request req = {
+            .fields = REQ_TITLE,
+            .first_sample = 0,
+            .num_samples = 0
+    };
+
+    // only the title is needed to decide, so don't read everything
+    ret = trace_get_request(t->owner->prev, &prev_trace, TRACE_IDX(t), &req);
     if(ret < 0)
     {
-        err("Failed to get trace from previous set\n");
+        err("Failed to get trace title from previous set\n");
         return ret;
     }
 
-    ret = __get_trace_type(prev_trace, &type);
+    ret = __get_trace_type(&prev_trace, &type);
     if(ret < 0)
     {
         err("Failed to get trace type from title\n");
@@ -101,13 +107,15 @@ int __tfm_split_tvla_get(struct trace *t)
     }
 
 __done:
-    trace_free(prev_trace);
+    if(prev_trace.title)
+        free(prev_trace.title);
+
     return ret;
 }
 
 void __tfm_split_tvla_free(struct trace *t)
 {
-    passthrough_free(t);
+    passthrough_release(t);
 }
 
 int tfm_split_tvla(struct tfm **tfm, bool which)